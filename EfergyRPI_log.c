@@ -1,512 +1,5346 @@
-// EFERGY ENERGY SENSOR RTL-SDR DECODER via rtl_fm
-//
-// Compile:
-//  gcc -O3 -lm -o EfergyDecode EfergyRPI_log.c
-//
-// Run:
-//  rtl_fm -f 433.25M -s 200000 -r 96000 -A fast -g 19.7 | ./EfergyRPI_log
-//
-//------------------------------------------------------------------------------
-// Originally Authored by Nathaniel Elijah
-//
-// (Formerly named EfergyRPI_001.c )
-// Copyright 2013 Nathaniel Elijah
-// Permission is hereby granted to use this Software for any purpose
-// including combining with commercial products, creating derivative
-// works, and redistribution of source or binary code, without
-// limitation or consideration. Any redistributed copies of this
-// Software must include the above Copyright Notice.
-// THIS SOFTWARE IS PROVIDED "AS IS". THE AUTHOR OF THIS CODE MAKES NO
-// WARRANTIES REGARDING THIS SOFTWARE, EXPRESS OR IMPLIED, AS TO ITS
-// SUITABILITY OR FITNESS FOR A PARTICULAR PURPOSE.
-//------------------------------------------------------------------------------
-// Changes by Gough (me@goughlui.com)
-//
-// Suggested compilation command is:
-// gcc -O3 -o EfergyRPI_001 EfergyRPI_001.c -lm
-// Note: -lm coming last avoids error from compiler which complains of
-// undefined reference to function `pow'. The addition of -O3 turns on
-// compiler optimizations which may or may not improve performance.
-//
-// Logging filename defined by additional command line argument.
-//
-// Added logging to file by append, with adjustable "samples to flush".
-// This can avoid SSD wear while also avoiding too much lost data in case
-// of power loss or crash.
-//
-// Also have ability to change line endings to DOS \r\n format.
-//
-// Consider changing the Voltage to match your local line voltage for
-// best results.
-//
-// Poor signals seem to cause rtl_fm and this code to consume CPU and slow
-// down. Best results for me seem to be with the E4000 tuner. My R820T
-// requires higher gain but sees some decode issues. Sometimes it stops
-// altogether, but that's because rtl_fm seems to starve in providing
-// samples.
-//
-// Should build and run on anything where rtl-fm works. You'll need to grab
-// build, and install rtl-sdr from http://sdr.osmocom.org/trac/wiki/rtl-sdr
-// first.
-//
-// Execute similarly
-// rtl_fm -f 433550000 -s 200000 -r 96000 -g 19.7 2>/dev/null | ./EfergyRPI_log
-// but play with the value for gain (in this case, 19.7) to achieve best result.
-// -----------------------------------------------------------------------------
-// Changes by github user magellannh
-//
-// 08-14-2014 - Changed logic to support different Efergy sensor types without 
-// changing settings logic uses message size to determine if checksum or crc 
-// should be used. Also, changed code so instead of doing bit by bit processing 
-// when samples arrive, a frame's worth of samples is saved after a valid 
-// preamble and then processed. One advantage of this approach is that the 
-// center is recalculated for each frame for more reliable decoding, especially 
-// if there's lots of 433Mhz noise, which for me was throwing off the old center 
-// calculation (noise from weather sensors). This is less efficient, but still 
-// uses < 7% of cpu on raspberry pi (plus another 25% for rtl_fm w/ -A fast 
-// option)
-// 08-13-2014 - Added code to check the CRC-CCIT (Xmodem)  crc used by Elite 3.0
-// TPM
-// 08/12/2014 - Some debugging and sample analysis code added
-//
-// Bug Fix - Changed frame bytearray to unsigned char and added cast on  byte 
-// used in pow() function to explicitly make it signed char.  Default 
-// signed/unsigned for char is compiler dependent and this resulted in various 
-// problems.
-//
-// New Feature  - Added frame analysis feature that dumps debug information to 
-// help characterize the FSK sample data received by rtl_fm.  The feature is 
-// invoked using a "-d" option followed by an optional debug level (1..4). The 
-// output is sent to stdout.
-//
-// Usage Examples: (original examples above still work as before plus these new 
-// options)
-//
-//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 1
-//      This mode shows the least information which is just the best guess at 
-//      the decoded frame and a KW calculation using bytes 4, 5, and 6.  The 
-//      checksum is computed and displayed, but not validated.
-//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 2
-//      This  level shows average plus and minus sample values and centering 
-//      which can help with finding the best frequency. Adjust frequency to get 
-//      wave center close to  0 .  If center is too high, lower frequency, 
-//      otherwise increase it.
-//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 3
-//      This mode outputs a summary with counts of consecutive positive or 
-//      negative samples.  These consecutive pulse counts are what the main code 
-//      uses to decode 0 and 1 data bits.  See comments below for more details 
-//      on expected pulse counts.
-//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 4
-//      This mode shows everything in modes 1..3 plus a raw dump of the sample 
-//      data received from rtl_fm.
-//
-//  *Notice the "-A fast" option on  rtl_fm.  This cut Raspberry Pi cpu load 
-//  from 50% to 25% and decode still worked fine. Also, with an R820T USB 
-//  dongle, leaving  rtl_fm gain in 'auto' mode  produced the best results.
-// -----------------------------------------------------------------------------
-// Changes by github user guiguan (root@guiguan.net)
-//
-// 18/09/2015 - Added TARGET_UID setting to only capture frames with the
-// targeted unique identifier and drop the rest. This is necessary when your 
-// neighbours are using the same kind of sensors.
-// Changed the unit from kW to W in debugging output. Also, the threshold from 
-// 10 to 10000, which means 10kW.
-// Included unistd.h for sleep in linux environment
-// Slightly formatted the source code.
-
-#include <stdio.h>
-#include <stdint.h>
-#include <time.h>
-#include <math.h>
-#include <stdlib.h> // For exit function
-#include <string.h>
-#include <unistd.h>
-
-#define VOLTAGE         240 /* For non-TPM type sensors, set to line voltage, 
-such as 240; For Efergy Elite 3.0 TPM,  set to 1 */
-#define TARGET_UID     -1 /* The 3rd byte of the frame received is used to
-uniquely identify the transmitter. If set, only frames match this UID will be
-captured; otherwise, set to -1 to disable this feature */
-
-#define FRAMEBYTECOUNT          9  /* Attempt to decode up to this many bytes.   */
-#define MINLOWBITS              3  /* Min number of positive samples for a logic 0 */
-#define MINHIGHBITS             9  /* Min number of positive samples for a logic 1 */
-#define MIN_POSITIVE_PREAMBLE_SAMPLES       40 /* Number of positive samples in  an efergy  preamble */
-#define MIN_NEGATIVE_PREAMBLE_SAMPLES       40 /* Number of negative samples for a valid preamble  */
-#define EXPECTED_BYTECOUNT_IF_CHECKSUM_USED 8
-#define EXPECTED_BYTECOUNT_IF_CRC_USED      9
-
-int analysis_wavecenter;
-
-#define LOGTYPE         1   // Allows changing line-endings - 0 is for Unix /n, 1 for Windows /r/n
-#define SAMPLES_TO_FLUSH    10  // Number of samples taken before writing to file.
-// Setting this too low will cause excessive wear to flash due to updates to
-// filesystem! You have been warned! Set to 10 samples for 6 seconds = every min.
-int loggingok;   // Global var indicating logging on or off
-int samplecount; // Global var counter for samples taken since last flush
-FILE *fp;    // Global var file handle
-
-// Instead of processing frames bit by bit as samples arrive from rtl_fm, all samples are stored once a preamble is detected until
-// enough samples have been saved to cover the expected maximum frame size.  This maximum number of samples needed for a frame
-// is an estimate with padding which will hopefully be enough to store a full frame with some extra.
-//
-// It seems that with most Efergy formats, each data bit is encoded  using some combination of about 18-20 rtl_fm samples.
-// zero bits are usually received as 10-13 negative samples followed by 4-7 positive samples, while 1 bits
-// come in as 4-7 negative samples followed by 10-13 positive samples ( these #s may have wide tolerences)
-// If the signal has excessive noise, it's theoretically possible to fill up this storage and still have more frame data coming in.
-// The code handles this overflow by trunkating the frame, but when this happens, it usually means the data is  junk anyway.
-//
-// To skip over noise frames, the code checks for a sequence with both a positive and negative preamble back to back (can be pos-neg or neg-pos)
-//  From empirical testing, the preamble is usually about 180 negative samples followed by 45-50 positive samples.
-//
-// At some frequencies the sign of the sample data becomes perfectly inverted.  When this happens,  frame data can still be decoded by keying off
-// negative pulse sequences instead of positive pulse sequences.  This inversion condition can be detected by looking at the sign of the first samples
-// received after the preamble.  If the first set of samples is negative, the data can get decoded from the positive sample pulses.  If the first set of
-//samples after the preamble is  greater than 0 then the data probably can be found by decoding negative samples using the same rules that are usually
-// used when decoding with the positive samples.  The analysis code automatically checks for this 'inverted' signal condition and decodes from either
-// the positive or negative pulse stream depending on that check.
-
-#define APPROX_SAMPLES_PER_BIT  19
-#define FRAMEBITCOUNT           (FRAMEBYTECOUNT*8)  /* bits for entire frame (not including preamble) */
-#define SAMPLE_STORE_SIZE       (FRAMEBITCOUNT*APPROX_SAMPLES_PER_BIT)
-
-int sample_storage[SAMPLE_STORE_SIZE];
-int sample_store_index;
-
-int decode_bytes_from_pulse_counts(int pulse_store[], int pulse_store_index, unsigned char bytes[]) {
-    int i;
-    int dbit = 0;
-    int bitpos = 0;
-    unsigned char bytedata = 0;
-    int bytecount = 0;
-
-    for (i = 0; i < FRAMEBYTECOUNT; i++)
-        bytes[i] = 0;
-    for (i = 0; i < pulse_store_index; i++) {
-        if (pulse_store[i] > MINLOWBITS) {
-            dbit++;
-            bitpos++;
-            bytedata = bytedata << 1;
-            if (pulse_store[i] > MINHIGHBITS)
-                bytedata = bytedata | 0x1;
-            if (bitpos > 7) {
-                bytes[bytecount] = bytedata;
-                bytedata = 0;
-                bitpos = 0;
-                bytecount++;
-                if (bytecount == FRAMEBYTECOUNT) {
-                    return bytecount;
-                }
-            }
-        }
-    }
-    return bytecount;
-}
-
-unsigned char compute_checksum(unsigned char bytes[], int bytecount) {
-    // Calculate simple 1 byte checksum on message bytes
-    unsigned char tbyte = 0x00;
-    int i;
-    for (i = 0; i < (bytecount - 1); i++) {
-        tbyte += bytes[i];
-    }
-    return tbyte;
-}
-
-uint16_t compute_crc(unsigned char bytes[], int bytecount) {
-    // Calculate  CRC-CCIT (Xmodem)  crc using 0x1021 polynomial
-    uint16_t crc = 0;
-    int i;
-    for (i = 0; i < bytecount - 2; i++) {
-        crc = crc ^ ((uint16_t) bytes[i] << 8);
-        int j;
-        for (j = 0; j < 8; j++) {
-            if (crc & 0x8000)
-                crc = (crc << 1) ^ 0x1021;
-            else
-                crc <<= 1;
-        }
-    }
-    return crc;
-}
-
-int calculate_wave_center(int *avg_positive_sample, int *avg_negative_sample) {
-    int i;
-    int64_t avg_neg = 0;
-    int64_t avg_pos = 0;
-    int pos_count = 0;
-    int neg_count = 0;
-    for (i = 0; i < sample_store_index; i++)
-        if (sample_storage[i] >= 0) {
-            avg_pos += sample_storage[i];
-            pos_count++;
-        } else {
-            avg_neg += sample_storage[i];
-            neg_count++;
-        }
-    if (pos_count != 0)
-        avg_pos /= pos_count;
-    if (neg_count != 0)
-        avg_neg /= neg_count;
-    *avg_positive_sample = avg_pos;
-    *avg_negative_sample = avg_neg;
-    int diff = (avg_neg + ((avg_pos - avg_neg) / 2));
-    return diff;
-}
-
-int generate_pulse_count_array(int display_pulse_details, int pulse_count_storage[]) {
-
-    // From empirical analysis with an Elite 3.0 TPM transmitter, sometimes the data can be decoded by counting negative pulses rather than positive
-    // pulses.  It seems that if the first sequence after the preamble is positive pulses, the data can be decoded by parsing using the negative pulse counts.
-    // This flag decoder automatically detect this.
-    int store_positive_pulses = (sample_storage[2] < analysis_wavecenter);
-
-    if (display_pulse_details) printf("\nPulse stream for this frame (P-Consecutive samples > center, N-Consecutive samples < center)\n");
-
-    int wrap_count = 0;
-    int pulse_count = 0;
-    int space_count = 0;
-    int pulse_store_index = 0;
-    int space_store_index = 0;
-    int display_pulse_info = 1;
-    int i;
-    for (i = 0; i < sample_store_index; i++) {
-        int samplec = sample_storage[i] - analysis_wavecenter;
-        if (samplec < 0) {
-            if (pulse_count > 0) {
-                if (store_positive_pulses)
-                    pulse_count_storage[pulse_store_index++] = pulse_count;
-                if (display_pulse_details) printf("%2dP ", pulse_count);
-                wrap_count++;
-            }
-            pulse_count = 0;
-            space_count++;
-        } else {
-            if (space_count > 0) {
-                if (store_positive_pulses == 0)
-                    pulse_count_storage[pulse_store_index++] = space_count;
-                if (display_pulse_details) printf("%2dN ", space_count);
-                wrap_count++;
-            }
-            space_count = 0;
-            pulse_count++;
-        }
-        if (wrap_count >= 16) {
-            if (display_pulse_details) printf("\n");
-            wrap_count = 0;
-        }
-    }
-    if (display_pulse_details) printf("\n\n");
-
-    return pulse_store_index;
-}
-
-void display_frame_data(int debug_level, char *msg, unsigned char bytes[], int bytecount) {
-
-#if TARGET_UID > 0
-    // only receive frames that has the targeted UID
-    if (bytecount < 3 || bytes[2] != TARGET_UID) {
-        return;
-    }
-#endif
-
-    time_t ltime;
-    char buffer[80];
-    time( &ltime );
-    struct tm *curtime = localtime( &ltime );
-    strftime(buffer, 80, "%x,%X", curtime);
-
-    // Some magic here to figure out whether the message has a 1 byte checksum or 2 byte crc
-    char *data_ok_str = (char *) 0;
-    unsigned char checksum = 0;
-    uint16_t crc = 0;
-
-    if (bytecount == EXPECTED_BYTECOUNT_IF_CHECKSUM_USED) {
-        checksum = compute_checksum(bytes, bytecount);
-        if (checksum == bytes[bytecount - 1])
-            data_ok_str = "chksum ok";
-    } else if (bytecount == EXPECTED_BYTECOUNT_IF_CRC_USED) {
-        crc = compute_crc(bytes, bytecount);
-        if (crc == ((bytes[bytecount - 2] << 8) | bytes[bytecount - 1]))
-            data_ok_str = "crc ok";
-    }
-
-    double current_adc = (bytes[4] * 256) + bytes[5];
-    double result  = (VOLTAGE * current_adc) / ((double) (32768) / (double) pow(2, (signed char) bytes[6]));
-    if (debug_level > 0) {
-        if (debug_level == 1)
-            printf("%s  %s ", buffer, msg);
-        else
-            printf("%s ", msg);
-
-        int i;
-        for (i = 0; i < bytecount; i++)
-            printf("%02x ", bytes[i]);
-
-        if (data_ok_str != (char *) 0)
-            printf(data_ok_str);
-        else {
-            checksum = compute_checksum(bytes, bytecount);
-            crc = compute_crc(bytes, bytecount);
-            printf(" cksum: %02x crc16: %04x ", checksum, crc);
-        }
-        if (result < 10000)
-            printf("  W: %4.3f\n", result);
-        else {
-            printf("  W: <out of range>\n");
-            if (data_ok_str != (char *) 0)
-                printf("*For Efergy True Power Moniter (TPM), set VOLTAGE=1 before compiling\n");
-        }
-    } else if (data_ok_str != (char *) 0) {
-        printf("%s,%f\n", buffer, result);
-        if (loggingok) {
-            if (LOGTYPE) {
-                fprintf(fp, "%s,%f\r\n", buffer, result);
-            } else {
-                fprintf(fp, "%s,%f\n", buffer, result);
-            }
-            samplecount++;
-            if (samplecount == SAMPLES_TO_FLUSH) {
-                samplecount = 0;
-                fflush(fp);
-            }
-        }
-        fflush(stdout);
-    } else
-        printf("Checksum/CEC Error.  Enable debug output with -d option\n");
-}
-
-void analyze_efergy_message(int debug_level) {
-
-    // See how balanced/centered the sample data is.  Best case is  diff close to 0
-    int avg_pos, avg_neg;
-    int difference = calculate_wave_center(&avg_pos, &avg_neg);
-
-    if (debug_level > 1) {
-        time_t ltime;
-        char buffer[80];
-        time( &ltime );
-        struct tm *curtime = localtime( &ltime );
-        strftime(buffer, 80, "%x,%X", curtime);
-        printf("\nAnalysis of rtl_fm sample data for frame received on %s\n", buffer);
-        printf("     Number of Samples: %6d\n", sample_store_index);
-        printf("    Avg. Sample Values: %6d (negative)   %6d (positive)\n", avg_neg, avg_pos);
-        printf("           Wave Center: %6d (this frame) %6d (last frame)\n", difference, analysis_wavecenter);
-    }
-    analysis_wavecenter = difference; // Use the calculated wave center from this sample to process next frame
-
-    if (debug_level == 4) { // Raw Sample Dump only in highest debug level
-        int wrap_count = 0;
-        printf("\nShowing raw rtl_fm sample data received between start of frame and end of frame\n");
-        int i;
-        for (i = 0; i < sample_store_index; i++) {
-            printf("%6d ", sample_storage[i] - analysis_wavecenter);
-            wrap_count++;
-            if (wrap_count >= 16) {
-                printf("\n");
-                wrap_count = 0;
-            }
-        }
-        printf("\n\n");
-    }
-
-    int display_pulse_details = (debug_level >= 3 ? 1 : 0);
-    int pulse_count_storage[SAMPLE_STORE_SIZE];
-    int pulse_store_index = generate_pulse_count_array(display_pulse_details, pulse_count_storage);
-    unsigned char bytearray[FRAMEBYTECOUNT];
-    int bytecount = decode_bytes_from_pulse_counts(pulse_count_storage, pulse_store_index, bytearray);
-    char *frame_msg;
-    if (sample_storage[2] < analysis_wavecenter)
-        frame_msg = "Msg:";
-    else
-        frame_msg = "Msg (from negative pulses):";
-    display_frame_data(debug_level, frame_msg, bytearray, bytecount);
-
-    if (debug_level > 1) printf("\n");
-}
-
-void  main (int argc, char**argv)
-{
-    int debug_level = 0;
-
-    // Give rtl_fm program some time to get initialized so its startup messages don't interleave with ours
-    sleep(1);
-
-    if ((argc == 2) && (strncmp(argv[1], "-h", 2) == 0)) {
-        printf("\nUsage: %s              - Normal mode\n", argv[0]);
-        printf("       %s <filename>   - Normal mode plus log samples to output file\n", argv[0]);
-        printf("       %s -d [1,2,3,4] - Set debug/verbosity.  Default level 0 has minimum output\n", argv[0]);
-        exit(0);
-    } else if ((argc == 3) && (strncmp(argv[1], "-d", 2) == 0)) {
-        debug_level = strtol(argv[2], NULL, 0);
-        if ((debug_level < 1) || (debug_level > 4)) {
-            fprintf(stderr, "\nDebug level (-d option) must be between 1 and 4\n");
-            exit(EXIT_FAILURE);
-        }
-    } else if ((argc == 2) && (strcmp(argv[1], "-d") == 0))
-        debug_level = 3;
-    else if (argc == 2) {
-        fp = fopen(argv[1], "a"); // Log file opened in append mode to avoid destroying data
-        samplecount = 0; // Reset sample counter
-        loggingok = 1;
-        if (fp == NULL) {
-            fprintf(stderr, "\nFailed to open log file!\n");
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        loggingok = 0;
-    }
-
-    if (debug_level > 0)
-        printf("\nEfergy Power Monitor Decoder - (debug level %d)\n\n", debug_level);
-    else
-        printf("\nEfergy Energy Monitor Decoder\n\n");
-
-    int prvsamp;
-    analysis_wavecenter = 0;
-
-    while ( !feof(stdin) ) {
-
-        // Look for a valid Efergy Preamble sequence which we'll define as
-        // a sequence of at least MIN_PEAMBLE_SIZE positive and negative or negative and positive pulses. eg 50N+50P or 50P+50N
-        int negative_preamble_count = 0;
-        int positive_preamble_count = 0;
-        prvsamp = 0;
-        while ( !feof(stdin) ) {
-            int cursamp  = (int16_t) (fgetc(stdin) | fgetc(stdin) << 8);
-            // Check for preamble
-            if ((prvsamp >= analysis_wavecenter) && (cursamp >= analysis_wavecenter)) {
-                positive_preamble_count++;
-            } else if ((prvsamp < analysis_wavecenter) && (cursamp < analysis_wavecenter)) {
-                negative_preamble_count++;
-            } else if ((prvsamp >= analysis_wavecenter) && (cursamp < analysis_wavecenter)) {
-                if ((positive_preamble_count > MIN_POSITIVE_PREAMBLE_SAMPLES) &&
-                        (negative_preamble_count > MIN_NEGATIVE_PREAMBLE_SAMPLES))
-                    break;
-                negative_preamble_count = 0;
-            } else if ((prvsamp < analysis_wavecenter) && (cursamp >= analysis_wavecenter)) {
-                if ((positive_preamble_count > MIN_POSITIVE_PREAMBLE_SAMPLES) &&
-                        (negative_preamble_count > MIN_NEGATIVE_PREAMBLE_SAMPLES))
-                    break;
-                positive_preamble_count = 0;
-            }
-            prvsamp = cursamp;
-        } // end of find preamble while loop
-
-        sample_store_index = 0;
-        while ( !feof(stdin) ) {
-            int cursamp  = (int16_t) (fgetc(stdin) | fgetc(stdin) << 8);
-            sample_storage[sample_store_index] = cursamp;
-            if (sample_store_index < (SAMPLE_STORE_SIZE - 1))
-                sample_store_index++;
-            else {
-                analyze_efergy_message(debug_level);
-                break;
-            }
-        } // Frame processing while
-    } // outermost while
-
-    if (loggingok) {
-        fclose(fp); // If rtl-fm gives EOF and program terminates, close file gracefully.
-    }
+// EFERGY ENERGY SENSOR RTL-SDR DECODER via rtl_fm
+//
+// Compile:
+//  gcc -O3 -o EfergyRPI_log EfergyRPI_log.c -lm -lpthread
+//
+// Run:
+//  rtl_fm -f 433.25M -s 200000 -r 96000 -A fast -g 19.7 | ./EfergyRPI_log
+//
+// Or run rtl_fm from the decoder, which restarts it when it stalls (no samples for 10 seconds) or exits:
+//  ./EfergyRPI_log --spawn "rtl_fm -f 433.25M -s 200000 -r 96000 -A fast -g 19.7"
+//
+// Several receivers in one process (FIFOs, captures, unix sockets or tcp:host:port):
+//  ./EfergyRPI_log -i /tmp/efergy0 -i /tmp/efergy1 -i tcp:pi2:1234
+//
+// Several transmitters on different frequencies from one wideband rtl_sdr, a channel per offset from its center:
+//  rtl_sdr -f 433500000 -s 1920000 -g 19.7 - | ./EfergyRPI_log --iq 1920000 --channels -300k,0,250k
+//
+// Publish readings to an MQTT broker (user name and password from $MQTT_USER and $MQTT_PASS):
+//  rtl_fm -f 433.25M -s 200000 -r 96000 -A fast -g 19.7 | ./EfergyRPI_log --mqtt mqtt.host --mqtt-topic house/energy
+// and keep what the broker hasn't taken yet on disk, through outages and restarts:
+//  ... | ./EfergyRPI_log --mqtt mqtt.host --mqtt-qos 1 --mqtt-store /var/lib/efergy/mqtt.queue
+//
+// Report kWh and min/mean/max watts per transmitter every minute, 5 minutes and hour instead of every reading
+// (on stdout, and with --mqtt on house/energy/1m, house/energy/5m and house/energy/1h):
+//  ... | ./EfergyRPI_log --windows 1m,5m,1h --mqtt mqtt.host
+//
+// Serve counters and histograms (samples, preambles, frames, checksum/crc results, per transmitter frames, stage
+// times) for Prometheus to scrape, or rewrite them to a file every 10 seconds:
+//  ... | ./EfergyRPI_log --stats tcp:9105
+//  ... | ./EfergyRPI_log --stats /var/lib/node_exporter/efergy.prom
+//
+// Readings as JSON lines instead of CSV, on stdout and to any number of local consumers of a unix socket:
+//  ... | ./EfergyRPI_log --format json --socket /run/efergy.sock
+//
+// Log to a compact binary file instead of CSV, and query it (efergy_logtool.c, built by make):
+//  ... | ./EfergyRPI_log --log-format binary /var/lib/efergy/energy.log
+//  ./efergy_logtool stats --from 2026-10-01 --interval 3600 /var/lib/efergy/energy.log
+// or backfill it from a recorded capture, with each reading timed from when the capture began:
+//  ./EfergyRPI_log --start 2026-10-01T08:00 --log-format binary /var/lib/efergy/energy.log < capture.raw
+//
+// Benchmark without a radio (builds efergy_synth too, see efergy_bench.sh):
+//  make bench
+//
+//------------------------------------------------------------------------------
+// Originally Authored by Nathaniel Elijah
+//
+// (Formerly named EfergyRPI_001.c )
+// Copyright 2013 Nathaniel Elijah
+// Permission is hereby granted to use this Software for any purpose
+// including combining with commercial products, creating derivative
+// works, and redistribution of source or binary code, without
+// limitation or consideration. Any redistributed copies of this
+// Software must include the above Copyright Notice.
+// THIS SOFTWARE IS PROVIDED "AS IS". THE AUTHOR OF THIS CODE MAKES NO
+// WARRANTIES REGARDING THIS SOFTWARE, EXPRESS OR IMPLIED, AS TO ITS
+// SUITABILITY OR FITNESS FOR A PARTICULAR PURPOSE.
+//------------------------------------------------------------------------------
+// Changes by Gough (me@goughlui.com)
+//
+// Suggested compilation command is:
+// gcc -O3 -o EfergyRPI_001 EfergyRPI_001.c -lm
+// Note: -lm coming last avoids error from compiler which complains of
+// undefined reference to function `pow'. The addition of -O3 turns on
+// compiler optimizations which may or may not improve performance.
+//
+// Logging filename defined by additional command line argument.
+//
+// Added logging to file by append, with adjustable "samples to flush".
+// This can avoid SSD wear while also avoiding too much lost data in case
+// of power loss or crash.
+//
+// Also have ability to change line endings to DOS \r\n format.
+//
+// Consider changing the Voltage to match your local line voltage for
+// best results.
+//
+// Poor signals seem to cause rtl_fm and this code to consume CPU and slow
+// down. Best results for me seem to be with the E4000 tuner. My R820T
+// requires higher gain but sees some decode issues. Sometimes it stops
+// altogether, but that's because rtl_fm seems to starve in providing
+// samples.
+//
+// Should build and run on anything where rtl-fm works. You'll need to grab
+// build, and install rtl-sdr from http://sdr.osmocom.org/trac/wiki/rtl-sdr
+// first.
+//
+// Execute similarly
+// rtl_fm -f 433550000 -s 200000 -r 96000 -g 19.7 2>/dev/null | ./EfergyRPI_log
+// but play with the value for gain (in this case, 19.7) to achieve best result.
+// -----------------------------------------------------------------------------
+// Changes by github user magellannh
+//
+// 08-14-2014 - Changed logic to support different Efergy sensor types without 
+// changing settings logic uses message size to determine if checksum or crc 
+// should be used. Also, changed code so instead of doing bit by bit processing 
+// when samples arrive, a frame's worth of samples is saved after a valid 
+// preamble and then processed. One advantage of this approach is that the 
+// center is recalculated for each frame for more reliable decoding, especially 
+// if there's lots of 433Mhz noise, which for me was throwing off the old center 
+// calculation (noise from weather sensors). This is less efficient, but still 
+// uses < 7% of cpu on raspberry pi (plus another 25% for rtl_fm w/ -A fast 
+// option)
+// 08-13-2014 - Added code to check the CRC-CCIT (Xmodem)  crc used by Elite 3.0
+// TPM
+// 08/12/2014 - Some debugging and sample analysis code added
+//
+// Bug Fix - Changed frame bytearray to unsigned char and added cast on  byte 
+// used in pow() function to explicitly make it signed char.  Default 
+// signed/unsigned for char is compiler dependent and this resulted in various 
+// problems.
+//
+// New Feature  - Added frame analysis feature that dumps debug information to 
+// help characterize the FSK sample data received by rtl_fm.  The feature is 
+// invoked using a "-d" option followed by an optional debug level (1..4). The 
+// output is sent to stdout.
+//
+// Usage Examples: (original examples above still work as before plus these new 
+// options)
+//
+//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 1
+//      This mode shows the least information which is just the best guess at 
+//      the decoded frame and a KW calculation using bytes 4, 5, and 6.  The 
+//      checksum is computed and displayed, but not validated.
+//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 2
+//      This  level shows average plus and minus sample values and centering 
+//      which can help with finding the best frequency. Adjust frequency to get 
+//      wave center close to  0 .  If center is too high, lower frequency, 
+//      otherwise increase it.
+//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 3
+//      This mode outputs a summary with counts of consecutive positive or 
+//      negative samples.  These consecutive pulse counts are what the main code 
+//      uses to decode 0 and 1 data bits.  See comments below for more details 
+//      on expected pulse counts.
+//  rtl_fm -f 433.51e6 -s 200000 -r 96000 -A fast  | ./EfergyRPI_log -d 4
+//      This mode shows everything in modes 1..3 plus a raw dump of the sample 
+//      data received from rtl_fm.
+//
+//  *Notice the "-A fast" option on  rtl_fm.  This cut Raspberry Pi cpu load 
+//  from 50% to 25% and decode still worked fine. Also, with an R820T USB 
+//  dongle, leaving  rtl_fm gain in 'auto' mode  produced the best results.
+// -----------------------------------------------------------------------------
+// Changes by github user guiguan (root@guiguan.net)
+//
+// 18/09/2015 - Added TARGET_UID setting to only capture frames with the
+// targeted unique identifier and drop the rest. This is necessary when your 
+// neighbours are using the same kind of sensors.
+// Changed the unit from kW to W in debugging output. Also, the threshold from 
+// 10 to 10000, which means 10kW.
+// Included unistd.h for sleep in linux environment
+// Slightly formatted the source code.
+// -----------------------------------------------------------------------------
+// Input handling
+//
+// Samples are no longer pulled from stdin two bytes at a time with fgetc().
+// stdin is read in large blocks with read(), or mmap'ed whole when it is a
+// regular file (a recorded capture), and the preamble search and frame capture
+// work directly on an int16_t view of that block.  An odd trailing byte is
+// carried over to the next block so sample alignment survives short reads.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <math.h>
+#include <stdlib.h> // For exit function
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#define VOLTAGE         240 /* For non-TPM type sensors, set to line voltage, 
+such as 240; For Efergy Elite 3.0 TPM,  set to 1 */
+#define TARGET_UID     -1 /* The 3rd byte of the frame received is used to
+uniquely identify the transmitter. If set, only frames match this UID will be
+captured; otherwise, set to -1 to disable this feature.  The -u option does the
+same at run time, for any number of UIDs */
+
+// The sample counts below are for rtl_fm's -r 96000.  Other rates (--rate) use the decoder_timing values instead.
+#define FRAMEBYTECOUNT          9  /* Attempt to decode up to this many bytes.   */
+#define MINLOWBITS              3  /* Min number of positive samples for a logic 0 */
+#define MINHIGHBITS             9  /* Min number of positive samples for a logic 1 */
+#define MIN_POSITIVE_PREAMBLE_SAMPLES       40 /* Number of positive samples in  an efergy  preamble */
+#define MIN_NEGATIVE_PREAMBLE_SAMPLES       40 /* Number of negative samples for a valid preamble  */
+#define EXPECTED_BYTECOUNT_IF_CHECKSUM_USED 8
+#define EXPECTED_BYTECOUNT_IF_CRC_USED      9
+#define MAX_WATTS               10000   /* Readings this high are bad decodes, not published or added up */
+
+#define LOGTYPE         1   // Allows changing line-endings - 0 is for Unix /n, 1 for Windows /r/n
+#define SAMPLES_TO_FLUSH    10  // Number of samples taken before writing to file.
+// Setting this too low will cause excessive wear to flash due to updates to
+// filesystem! You have been warned! Set to 10 samples for 6 seconds = every min.
+
+// Instead of processing frames bit by bit as samples arrive from rtl_fm, all samples are stored once a preamble is detected until
+// enough samples have been saved to cover the expected maximum frame size.  This maximum number of samples needed for a frame
+// is an estimate with padding which will hopefully be enough to store a full frame with some extra.
+//
+// It seems that with most Efergy formats, each data bit is encoded  using some combination of about 18-20 rtl_fm samples.
+// zero bits are usually received as 10-13 negative samples followed by 4-7 positive samples, while 1 bits
+// come in as 4-7 negative samples followed by 10-13 positive samples ( these #s may have wide tolerences)
+// If the signal has excessive noise, it's theoretically possible to fill up this storage and still have more frame data coming in.
+// The code handles this overflow by trunkating the frame, but when this happens, it usually means the data is  junk anyway.
+//
+// To skip over noise frames, the code checks for a sequence with both a positive and negative preamble back to back (can be pos-neg or neg-pos)
+//  From empirical testing, the preamble is usually about 180 negative samples followed by 45-50 positive samples.
+//
+// At some frequencies the sign of the sample data becomes perfectly inverted.  When this happens,  frame data can still be decoded by keying off
+// negative pulse sequences instead of positive pulse sequences.  This inversion condition can be detected by looking at the sign of the first samples
+// received after the preamble.  If the first set of samples is negative, the data can get decoded from the positive sample pulses.  If the first set of
+//samples after the preamble is  greater than 0 then the data probably can be found by decoding negative samples using the same rules that are usually
+// used when decoding with the positive samples.  The analysis code automatically checks for this 'inverted' signal condition and decodes from either
+// the positive or negative pulse stream depending on that check.
+
+#define APPROX_SAMPLES_PER_BIT  19
+#define FRAMEBITCOUNT           (FRAMEBYTECOUNT*8)  /* bits for entire frame (not including preamble) */
+#define SAMPLE_STORE_SIZE       (FRAMEBITCOUNT*APPROX_SAMPLES_PER_BIT)
+
+// Sample rate
+//
+// A few kbit/s of FSK doesn't need 96000 samples/s.  With --rate, rtl_fm can run at a fraction of that (-r 24000
+// cuts the work in both processes by about 4), and all the sample counts above are rescaled to the new rate.  The
+// common rates have values checked on synthetic captures in tuned_timings; anything else in MIN_SAMPLE_RATE..
+// MAX_SAMPLE_RATE is derived by scaling the 96000 boundaries (3.5, 9.5 and 40.5 samples) and rounding up.
+#define DEFAULT_SAMPLE_RATE     96000
+#define MIN_SAMPLE_RATE         24000   /* Below this, zero and one pulses are only a sample or two apart */
+#define MAX_SAMPLE_RATE         192000
+#define MAX_SAMPLE_STORE_SIZE   (FRAMEBITCOUNT * (APPROX_SAMPLES_PER_BIT * MAX_SAMPLE_RATE / DEFAULT_SAMPLE_RATE + 1))
+
+struct decoder_timing {
+    int sample_rate;
+    int samples_per_bit;
+    int min_low_bits;           // MINLOWBITS
+    int min_high_bits;          // MINHIGHBITS
+    int min_positive_preamble;  // MIN_POSITIVE_PREAMBLE_SAMPLES
+    int min_negative_preamble;  // MIN_NEGATIVE_PREAMBLE_SAMPLES
+    int sample_store_size;      // SAMPLE_STORE_SIZE
+    int polarity_sample;        // Frame sample that decides between positive and negative pulses, 2 at 96000
+};
+
+// 48000 and 24000 are what scaling gives.  A 0 min_low_bits turns off the filter for short runs, which at 24000 is
+// also what scaling gives: the 3.5 sample limit at 96000 is under one sample there.  At 32000 scaling gives 1, but
+// a zero pulse is only 1 to 3 samples long, and noise cuts enough of them to 1 sample that 0 decodes more: 289
+// against 278 of 300 frames on a clean synthetic capture and 254 against 228 at 10 dB (1 at 24000 gets 52 frames
+// instead of 108).  polarity_sample is sample 2 at 96000, scaled, so the first sample at 32000 and below.  What
+// still holds 24000 back is that the run between two pulses can be under a sample long and vanish, merging them.
+// Frames then come out a byte or two short, and no threshold here brings them back.
+static const struct decoder_timing tuned_timings[] = {
+    { 96000, APPROX_SAMPLES_PER_BIT, MINLOWBITS, MINHIGHBITS, MIN_POSITIVE_PREAMBLE_SAMPLES, MIN_NEGATIVE_PREAMBLE_SAMPLES,
+      SAMPLE_STORE_SIZE, 2 },
+    { 48000, 10, 1, 4, 20, 20, FRAMEBITCOUNT * 10, 1 },
+    { 32000,  7, 0, 3, 13, 13, FRAMEBITCOUNT * 7, 0 },
+    { 24000,  5, 0, 2, 10, 10, FRAMEBITCOUNT * 5, 0 },
+};
+
+// Timing for the --rate given on the command line.  Each decoder works from its own copy.
+struct decoder_timing configured_timing = { 96000, APPROX_SAMPLES_PER_BIT, MINLOWBITS, MINHIGHBITS, MIN_POSITIVE_PREAMBLE_SAMPLES,
+                                            MIN_NEGATIVE_PREAMBLE_SAMPLES, SAMPLE_STORE_SIZE, 2 };
+
+// Smallest whole threshold t so that "count > t" matches "count >= boundary" at the 96000 rate, scaled to rate
+static int scaled_threshold(double boundary_at_96000, int rate) {
+    return (int) ceil(boundary_at_96000 * rate / DEFAULT_SAMPLE_RATE) - 1;
+}
+
+// Returns 0 when the rate is out of range
+int set_sample_rate(struct decoder_timing *timing, int rate) {
+    unsigned int i;
+    if ((rate < MIN_SAMPLE_RATE) || (rate > MAX_SAMPLE_RATE))
+        return 0;
+    for (i = 0; i < sizeof(tuned_timings) / sizeof(tuned_timings[0]); i++)
+        if (tuned_timings[i].sample_rate == rate) {
+            *timing = tuned_timings[i];
+            return 1;
+        }
+    timing->sample_rate = rate;
+    timing->samples_per_bit = (APPROX_SAMPLES_PER_BIT * rate + DEFAULT_SAMPLE_RATE - 1) / DEFAULT_SAMPLE_RATE;
+    timing->min_low_bits = scaled_threshold(MINLOWBITS + 0.5, rate);
+    timing->min_high_bits = scaled_threshold(MINHIGHBITS + 0.5, rate);
+    timing->min_positive_preamble = scaled_threshold(MIN_POSITIVE_PREAMBLE_SAMPLES + 0.5, rate);
+    timing->min_negative_preamble = scaled_threshold(MIN_NEGATIVE_PREAMBLE_SAMPLES + 0.5, rate);
+    timing->sample_store_size = FRAMEBITCOUNT * timing->samples_per_bit;
+    timing->polarity_sample = 2 * rate / DEFAULT_SAMPLE_RATE;
+    return 1;
+}
+
+#define INPUT_BLOCK_SAMPLES     32768  /* Samples handed to the decoder per read() or per mmap window */
+
+// IQ front end
+//
+// With --iq, stdin carries the raw unsigned 8 bit I/Q pairs from rtl_sdr (or a recording of them) instead of
+// rtl_fm's demodulated output, and this does the little FM demodulation Efergy's FSK actually needs, in fixed
+// point: a boxcar decimation to at least 96000 samples/s, a polar discriminator (the phase step between
+// consecutive decimated samples, from the same fast atan2 approximation rtl_fm -A fast uses), a one pole low pass
+// and, for --rate below 96000, a second boxcar decimation down to the decoder's rate.  The discriminator has to
+// run at 96000 or more because Efergy's deviation would wrap the phase step at lower rates.  The result is scaled
+// like rtl_fm's output (pi == 1 << 14), so the decoder can't tell the difference.
+//
+//  rtl_sdr -f 433510000 -s 288000 -g 19.7 - | ./EfergyRPI_log --iq 288000
+#define DEFAULT_IQ_SAMPLE_RATE  288000  /* Lowest multiple of DEFAULT_SAMPLE_RATE that rtl_sdr supports */
+#define IQ_DISCRIMINATOR_RATE   96000   /* Minimum rate for the discriminator */
+#define IQ_LOWPASS_SHIFT        1       /* One pole low pass, y += (x - y) >> shift.  About 10kHz at 96000/s */
+
+struct iq_frontend {
+    int decimation;             // IQ pairs per discriminator sample, 0 when the input is rtl_fm samples
+    int post_decimation;        // Discriminator samples per output sample
+    int phase;                  // IQ pairs summed into i_sum/q_sum so far
+    int i_sum;
+    int q_sum;
+    int prev_i;
+    int prev_q;
+    int lowpass;
+    int post_phase;             // Discriminator samples summed into post_sum so far
+    int post_sum;
+    int16_t out[INPUT_BLOCK_SAMPLES];
+};
+
+// Splits the overall decimation (IQ rate / decoder rate) into the two stages
+void iq_frontend_init(struct iq_frontend *fe, int iq_decimation, int sample_rate) {
+    int first;
+    memset(fe, 0, offsetof(struct iq_frontend, out));
+    if (iq_decimation == 0)
+        return;
+    for (first = iq_decimation; first > 1; first--)
+        if ((iq_decimation % first == 0) &&
+                ((int64_t) sample_rate * iq_decimation / first >= IQ_DISCRIMINATOR_RATE))
+            break;
+    fe->decimation = first;
+    fe->post_decimation = iq_decimation / first;
+}
+
+// Angle of x + jy with pi == 1 << 14
+static int fast_atan2(int64_t y, int64_t x) {
+    const int64_t pi4 = 1 << 12, pi34 = 3 << 12;
+    int64_t yabs = (y < 0) ? -y : y;
+    int64_t angle;
+    if ((x == 0) && (y == 0))
+        return 0;
+    if (x >= 0)
+        angle = pi4 - pi4 * (x - yabs) / (x + yabs);
+    else
+        angle = pi34 - pi4 * (x + yabs) / (yabs - x);
+    return (y < 0) ? -angle : angle;
+}
+
+// Runs one decimated IQ sample through the discriminator, the low pass and the second decimation.  Returns 1 when
+// that completes an output sample, in *out.
+static inline int iq_discriminate(struct iq_frontend *fe, int i, int q, int16_t *out) {
+    // Phase step is the angle of current * conj(previous)
+    int64_t re = (int64_t) i * fe->prev_i + (int64_t) q * fe->prev_q;
+    int64_t im = (int64_t) q * fe->prev_i - (int64_t) i * fe->prev_q;
+    fe->lowpass += (fast_atan2(im, re) - fe->lowpass) >> IQ_LOWPASS_SHIFT;
+    fe->prev_i = i;
+    fe->prev_q = q;
+
+    fe->post_sum += fe->lowpass;
+    if (++fe->post_phase < fe->post_decimation)
+        return 0;
+    *out = fe->post_sum / fe->post_decimation;
+    fe->post_sum = fe->post_phase = 0;
+    return 1;
+}
+
+// Demodulates pairs IQ pairs into out.  Returns the number of samples produced, at most
+// pairs / (decimation * post_decimation) + 1.
+size_t iq_demodulate(struct iq_frontend *fe, const uint8_t *iq, size_t pairs, int16_t *out) {
+    size_t produced = 0;
+    size_t i;
+    for (i = 0; i < pairs; i++) {
+        fe->i_sum += iq[2 * i] - 128;
+        fe->q_sum += iq[2 * i + 1] - 128;
+        if (++fe->phase < fe->decimation)
+            continue;
+        produced += iq_discriminate(fe, fe->i_sum, fe->q_sum, &out[produced]);
+        fe->i_sum = fe->q_sum = fe->phase = 0;
+    }
+    return produced;
+}
+
+// Block reader for the little-endian 16 bit samples produced by rtl_fm.  Regular files are mapped
+// and walked in INPUT_BLOCK_SAMPLES windows, anything else (pipes, FIFOs, sockets) is read into
+// read_buffer.  When a read() ends on an odd byte, that byte is kept in carry_byte and becomes the
+// low byte of the first sample of the next block.  IQ input is read the same way, a 16 bit word per
+// IQ pair, and run through the front end.
+struct sample_input {
+    int fd;
+    const int16_t *map;     // Whole file when mmap'ed, otherwise NULL
+    size_t map_samples;
+    size_t map_offset;
+    size_t map_bytes;
+    int has_carry;
+    unsigned char carry_byte;
+    int eof;
+    int16_t read_buffer[INPUT_BLOCK_SAMPLES];
+    struct iq_frontend iq;
+};
+
+// iq_decimation is the number of IQ pairs per sample for raw IQ input, or 0 for rtl_fm samples
+void input_open(struct sample_input *in, int fd, int iq_decimation, int sample_rate) {
+    struct stat st;
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    iq_frontend_init(&in->iq, iq_decimation, sample_rate);
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size >= 2)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->map_bytes = st.st_size;
+            in->map_samples = st.st_size / 2;   // A trailing odd byte can never complete a sample
+        }
+    }
+}
+
+// Carries on from a new pipe (a restarted --spawn command) as if its data followed on from the old one's
+void input_reopen(struct sample_input *in, int fd) {
+    in->fd = fd;
+    in->eof = 0;
+    in->has_carry = 0;
+}
+
+void input_close(struct sample_input *in) {
+    if (in->map)
+        munmap((void *) in->map, in->map_bytes);
+    in->map = NULL;
+}
+
+static void input_to_host_order(int16_t *samples, size_t count) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    size_t i;
+    for (i = 0; i < count; i++)
+        samples[i] = (int16_t) __builtin_bswap16((uint16_t) samples[i]);
+#else
+    (void) samples;
+    (void) count;
+#endif
+}
+
+// Next block of raw 16 bit words from the file or pipe, in file byte order
+static size_t input_next_words(struct sample_input *in, int16_t **words) {
+    if (in->map) {
+        size_t count = in->map_samples - in->map_offset;
+        if (count > INPUT_BLOCK_SAMPLES)
+            count = INPUT_BLOCK_SAMPLES;
+        *words = (int16_t *) in->map + in->map_offset;
+        in->map_offset += count;
+        if (count == 0)
+            in->eof = 1;
+        return count;
+    }
+
+    unsigned char *buf = (unsigned char *) in->read_buffer;
+    size_t have = 0;
+    if (in->has_carry) {
+        buf[0] = in->carry_byte;
+        have = 1;
+        in->has_carry = 0;
+    }
+    while (!in->eof && (have < 2)) {
+        ssize_t got = read(in->fd, buf + have, sizeof(in->read_buffer) - have);
+        if (got > 0)
+            have += got;
+        else if ((got < 0) && (errno == EINTR))
+            continue;
+        else if ((got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            break;          // Non-blocking input with nothing more to read for now
+        else
+            in->eof = 1;    // EOF, or a read error which ends the input just the same
+    }
+    if (have & 1) {
+        in->carry_byte = buf[have - 1];
+        in->has_carry = 1;
+    }
+    *words = in->read_buffer;
+    return have / 2;
+}
+
+// Returns the number of samples available at *samples, or 0 once the input is exhausted (in->eof) or, for a
+// non-blocking descriptor, has nothing more to read right now.  The view is only valid until the next call.
+size_t input_next_block(struct sample_input *in, const int16_t **samples) {
+    int16_t *words;
+    size_t count;
+    while ((count = input_next_words(in, &words)) > 0) {
+        if (in->iq.decimation == 0) {
+            input_to_host_order(words, count);
+            *samples = words;
+            return count;
+        }
+        count = iq_demodulate(&in->iq, (const uint8_t *) words, count, in->iq.out);
+        if (count > 0) {
+            *samples = in->iq.out;
+            return count;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Sample kernels
+//
+// The preamble search, the wave center calculation and the pulse counting all compare every sample against
+// a center value.  Rather than branching per sample, sign_mask() turns a run of samples into a bit mask
+// (bit set when sample >= center) and the run lengths are then read off the transitions in that mask with
+// count-trailing-zeros, so the work is per transition instead of per sample.  wave_sums() adds up the positive
+// and negative samples in bulk.  Both have scalar, SSE2, AVX2 and NEON versions; the best one the CPU supports is
+// picked once at startup by select_sample_kernels().
+
+#define MASK_WORDS(n)   (((n) + 63) / 64)
+
+struct wave_sums {
+    int64_t pos_sum;
+    int64_t neg_sum;
+    int pos_count;
+    int neg_count;
+};
+
+struct sample_kernels {
+    const char *name;
+    // Sets bit (i % 64) of mask[i / 64] when samples[i] >= center.  Bits past count are left clear.
+    void (*sign_mask)(const int16_t *samples, int count, int center, uint64_t *mask);
+    // Sums samples >= 0 and samples < 0 separately, with their counts.
+    void (*wave_sums)(const int16_t *samples, int count, struct wave_sums *sums);
+};
+
+static int16_t clamp_center(int center) {
+    return (center > INT16_MAX) ? INT16_MAX : (center < INT16_MIN) ? INT16_MIN : center;
+}
+
+static void sign_mask_scalar(const int16_t *samples, int count, int center, uint64_t *mask) {
+    int i;
+    memset(mask, 0, MASK_WORDS(count) * sizeof(uint64_t));
+    for (i = 0; i < count; i++)
+        if (samples[i] >= center)
+            mask[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static void wave_sums_scalar(const int16_t *samples, int count, struct wave_sums *sums) {
+    int i;
+    memset(sums, 0, sizeof(*sums));
+    for (i = 0; i < count; i++)
+        if (samples[i] >= 0) {
+            sums->pos_sum += samples[i];
+            sums->pos_count++;
+        } else {
+            sums->neg_sum += samples[i];
+            sums->neg_count++;
+        }
+}
+
+// The vector versions handle whole 64 sample words and leave any tail to this helper
+static void sign_mask_tail(const int16_t *samples, int start, int count, int center, uint64_t *mask) {
+    int i;
+    if (start < count)
+        mask[start / 64] = 0;
+    for (i = start; i < count; i++)
+        if (samples[i] >= center)
+            mask[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static void wave_sums_tail(const int16_t *samples, int start, int count, struct wave_sums *sums) {
+    int i;
+    for (i = start; i < count; i++)
+        if (samples[i] >= 0) {
+            sums->pos_sum += samples[i];
+            sums->pos_count++;
+        } else {
+            sums->neg_sum += samples[i];
+            sums->neg_count++;
+        }
+}
+
+// 32 bit lane accumulators are flushed to the 64 bit totals at least this often (in vector iterations)
+#define WAVE_SUMS_FLUSH_INTERVAL    1024
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void sign_mask_sse2(const int16_t *samples, int count, int center, uint64_t *mask) {
+    const __m128i c = _mm_set1_epi16(clamp_center(center));
+    int i;
+    for (i = 0; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        int j;
+        for (j = 0; j < 64; j += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) &samples[i + j]);
+            __m128i b = _mm_loadu_si128((const __m128i *) &samples[i + j + 8]);
+            __m128i below = _mm_packs_epi16(_mm_cmplt_epi16(a, c), _mm_cmplt_epi16(b, c));
+            word |= (uint64_t) (uint16_t) ~_mm_movemask_epi8(below) << j;
+        }
+        mask[i / 64] = word;
+    }
+    sign_mask_tail(samples, i, count, center, mask);
+}
+
+__attribute__((target("sse2")))
+static void wave_sums_sse2(const int16_t *samples, int count, struct wave_sums *sums) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i pos_acc = zero, neg_acc = zero;
+    int neg_count = 0;
+    int i, iterations = 0;
+    memset(sums, 0, sizeof(*sums));
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *) &samples[i]);
+        __m128i neg = _mm_cmplt_epi16(x, zero);
+        pos_acc = _mm_add_epi32(pos_acc, _mm_madd_epi16(_mm_andnot_si128(neg, x), ones));
+        neg_acc = _mm_add_epi32(neg_acc, _mm_madd_epi16(_mm_and_si128(neg, x), ones));
+        neg_count += __builtin_popcount(_mm_movemask_epi8(neg)) / 2;
+        if ((++iterations == WAVE_SUMS_FLUSH_INTERVAL) || (i + 16 > count)) {
+            int32_t lanes[4];
+            int k;
+            _mm_storeu_si128((__m128i *) lanes, pos_acc);
+            for (k = 0; k < 4; k++)
+                sums->pos_sum += lanes[k];
+            _mm_storeu_si128((__m128i *) lanes, neg_acc);
+            for (k = 0; k < 4; k++)
+                sums->neg_sum += lanes[k];
+            pos_acc = neg_acc = zero;
+            iterations = 0;
+        }
+    }
+    sums->neg_count = neg_count;
+    sums->pos_count = i - neg_count;
+    wave_sums_tail(samples, i, count, sums);
+}
+
+__attribute__((target("avx2")))
+static void sign_mask_avx2(const int16_t *samples, int count, int center, uint64_t *mask) {
+    const __m256i c = _mm256_set1_epi16(clamp_center(center));
+    int i;
+    for (i = 0; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        int j;
+        for (j = 0; j < 64; j += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) &samples[i + j]);
+            __m256i b = _mm256_loadu_si256((const __m256i *) &samples[i + j + 16]);
+            // packs works within 128 bit lanes, so put the quadwords back in sample order before the movemask
+            __m256i below = _mm256_packs_epi16(_mm256_cmpgt_epi16(c, a), _mm256_cmpgt_epi16(c, b));
+            below = _mm256_permute4x64_epi64(below, 0xD8);
+            word |= (uint64_t) (uint32_t) ~_mm256_movemask_epi8(below) << j;
+        }
+        mask[i / 64] = word;
+    }
+    sign_mask_tail(samples, i, count, center, mask);
+}
+
+__attribute__((target("avx2")))
+static void wave_sums_avx2(const int16_t *samples, int count, struct wave_sums *sums) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i pos_acc = zero, neg_acc = zero;
+    int neg_count = 0;
+    int i, iterations = 0;
+    memset(sums, 0, sizeof(*sums));
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) &samples[i]);
+        __m256i neg = _mm256_cmpgt_epi16(zero, x);
+        pos_acc = _mm256_add_epi32(pos_acc, _mm256_madd_epi16(_mm256_andnot_si256(neg, x), ones));
+        neg_acc = _mm256_add_epi32(neg_acc, _mm256_madd_epi16(_mm256_and_si256(neg, x), ones));
+        neg_count += __builtin_popcount(_mm256_movemask_epi8(neg)) / 2;
+        if ((++iterations == WAVE_SUMS_FLUSH_INTERVAL) || (i + 32 > count)) {
+            int32_t lanes[8];
+            int k;
+            _mm256_storeu_si256((__m256i *) lanes, pos_acc);
+            for (k = 0; k < 8; k++)
+                sums->pos_sum += lanes[k];
+            _mm256_storeu_si256((__m256i *) lanes, neg_acc);
+            for (k = 0; k < 8; k++)
+                sums->neg_sum += lanes[k];
+            pos_acc = neg_acc = zero;
+            iterations = 0;
+        }
+    }
+    sums->neg_count = neg_count;
+    sums->pos_count = i - neg_count;
+    wave_sums_tail(samples, i, count, sums);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static inline uint16_t neon_movemask_u8(uint8x16_t bytes) {
+    // Each byte is 0x00 or 0xFF; weight them by bit position and add up each half
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(bytes, vld1q_u8(weights));
+#ifdef __aarch64__
+    return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
+#else
+    uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+    sum = vpadd_u8(sum, sum);
+    sum = vpadd_u8(sum, sum);
+    return vget_lane_u8(sum, 0) | (vget_lane_u8(sum, 1) << 8);
+#endif
+}
+
+static void sign_mask_neon(const int16_t *samples, int count, int center, uint64_t *mask) {
+    const int16x8_t c = vdupq_n_s16(clamp_center(center));
+    int i;
+    for (i = 0; i + 64 <= count; i += 64) {
+        uint64_t word = 0;
+        int j;
+        for (j = 0; j < 64; j += 16) {
+            uint16x8_t a = vcgeq_s16(vld1q_s16(&samples[i + j]), c);
+            uint16x8_t b = vcgeq_s16(vld1q_s16(&samples[i + j + 8]), c);
+            word |= (uint64_t) neon_movemask_u8(vcombine_u8(vmovn_u16(a), vmovn_u16(b))) << j;
+        }
+        mask[i / 64] = word;
+    }
+    sign_mask_tail(samples, i, count, center, mask);
+}
+
+static void wave_sums_neon(const int16_t *samples, int count, struct wave_sums *sums) {
+    const int16x8_t zero = vdupq_n_s16(0);
+    int32x4_t pos_acc = vdupq_n_s32(0), neg_acc = vdupq_n_s32(0);
+    uint32x4_t neg_counts = vdupq_n_u32(0);
+    int i, iterations = 0;
+    memset(sums, 0, sizeof(*sums));
+    for (i = 0; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(&samples[i]);
+        uint16x8_t neg = vcltq_s16(x, zero);
+        pos_acc = vpadalq_s16(pos_acc, vbicq_s16(x, vreinterpretq_s16_u16(neg)));
+        neg_acc = vpadalq_s16(neg_acc, vandq_s16(x, vreinterpretq_s16_u16(neg)));
+        neg_counts = vpadalq_u16(neg_counts, vshrq_n_u16(neg, 15));
+        if ((++iterations == WAVE_SUMS_FLUSH_INTERVAL) || (i + 16 > count)) {
+            int32_t lanes[4];
+            int k;
+            vst1q_s32(lanes, pos_acc);
+            for (k = 0; k < 4; k++)
+                sums->pos_sum += lanes[k];
+            vst1q_s32(lanes, neg_acc);
+            for (k = 0; k < 4; k++)
+                sums->neg_sum += lanes[k];
+            pos_acc = neg_acc = vdupq_n_s32(0);
+            iterations = 0;
+        }
+    }
+    uint32_t counts[4];
+    vst1q_u32(counts, neg_counts);
+    sums->neg_count = counts[0] + counts[1] + counts[2] + counts[3];
+    sums->pos_count = i - sums->neg_count;
+    wave_sums_tail(samples, i, count, sums);
+}
+#endif
+
+static const struct sample_kernels available_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", sign_mask_avx2, wave_sums_avx2 },
+    { "sse2", sign_mask_sse2, wave_sums_sse2 },
+#endif
+#ifdef HAVE_NEON_KERNELS
+    { "neon", sign_mask_neon, wave_sums_neon },
+#endif
+    { "scalar", sign_mask_scalar, wave_sums_scalar },
+};
+#define AVAILABLE_KERNEL_COUNT  ((int) (sizeof(available_kernels) / sizeof(available_kernels[0])))
+
+const struct sample_kernels *kernels = &available_kernels[AVAILABLE_KERNEL_COUNT - 1];
+
+static int kernels_supported(const struct sample_kernels *k) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(k->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(k->name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    (void) k;
+    return 1;   // NEON kernels are only compiled in when the target guarantees NEON
+}
+
+// Picks the fastest supported kernels.  EFERGY_KERNELS=<name> in the environment forces a specific set.
+void select_sample_kernels(void) {
+    const char *forced = getenv("EFERGY_KERNELS");
+    int i;
+    for (i = 0; i < AVAILABLE_KERNEL_COUNT; i++) {
+        if (forced && strcmp(forced, available_kernels[i].name) != 0)
+            continue;
+        if (kernels_supported(&available_kernels[i])) {
+            kernels = &available_kernels[i];
+            return;
+        }
+    }
+    if (forced)
+        fprintf(stderr, "EFERGY_KERNELS=%s is not available, using %s\n", forced, kernels->name);
+}
+
+// Preamble search state.  positive/negative_count are the number of consecutive sample pairs on each side
+// of the center, exactly as the original per-sample loop counted them.
+struct preamble_state {
+    int prev_positive;
+    int positive_count;
+    int negative_count;
+    uint64_t gated_samples;     // Samples the gate let through without a look at their transitions, for --stats
+};
+
+void preamble_reset(struct preamble_state *st, int center) {
+    st->prev_positive = (0 >= center);  // The search has always started from a previous sample of 0
+    st->positive_count = 0;
+    st->negative_count = 0;
+    st->gated_samples = 0;
+}
+
+#define PREAMBLE_CHUNK_SAMPLES  1024
+
+// Noise gate.  Between the preambles, rtl_fm's output is noise that crosses the center every few samples, and
+// walking its transitions one at a time is most of the preamble search's work.  A preamble can only complete at
+// a transition that ends a run longer than the shorter of the two preamble halves, so once a 64 sample word's
+// first transition has been checked (it ends the run carried in from before), the rest of the word only matters
+// if there is a gap of that length between its first and last transitions.  Without one, the counts at the end of
+// the word follow from its last two transitions.  The result is exactly the same as the transition walk: nothing
+// is missed, --no-gate is only there for comparisons.
+int preamble_gate = 1;
+
+// Whether zeros (a mask of the sample positions with no transition) holds a run of length set bits
+static inline int has_run(uint64_t zeros, int length) {
+    int have = 1;
+    if (length > 64)
+        return 0;
+    while ((have < length) && zeros) {
+        int shift = (2 * have <= length) ? have : length - have;
+        zeros &= zeros >> shift;
+        have += shift;
+    }
+    return zeros != 0;
+}
+
+// Looks for a valid Efergy Preamble sequence which we'll define as a sequence of at least MIN_PEAMBLE_SIZE
+// positive and negative or negative and positive pulses. eg 50N+50P or 50P+50N.  Returns the index of the
+// sample that completes the preamble (the first sample after it), or count if there is none in this block.
+size_t find_preamble(const int16_t *samples, size_t count, int center, struct preamble_state *st,
+                     const struct decoder_timing *timing) {
+    uint64_t mask[MASK_WORDS(PREAMBLE_CHUNK_SAMPLES)];
+    int shortest_run = ((timing->min_positive_preamble < timing->min_negative_preamble) ?
+                        timing->min_positive_preamble : timing->min_negative_preamble) + 1;
+    size_t base;
+    for (base = 0; base < count; base += PREAMBLE_CHUNK_SAMPLES) {
+        int n = (count - base < PREAMBLE_CHUNK_SAMPLES) ? (int) (count - base) : PREAMBLE_CHUNK_SAMPLES;
+        int w;
+        kernels->sign_mask(samples + base, n, center, mask);
+        for (w = 0; w < MASK_WORDS(n); w++) {
+            int valid = (n - w * 64 < 64) ? n - w * 64 : 64;
+            uint64_t bits = mask[w];
+            uint64_t transitions = bits ^ ((bits << 1) | (uint64_t) st->prev_positive);
+            int run_start = 0;
+            int gate = preamble_gate;
+            if (valid < 64)
+                transitions &= ((uint64_t) 1 << valid) - 1;
+            while (transitions) {
+                int t = __builtin_ctzll(transitions);
+                // Samples run_start..t-1 continue the current run
+                if (st->prev_positive)
+                    st->positive_count += t - run_start;
+                else
+                    st->negative_count += t - run_start;
+                if ((st->positive_count > timing->min_positive_preamble) &&
+                        (st->negative_count > timing->min_negative_preamble))
+                    return base + w * 64 + t;
+                st->prev_positive = !st->prev_positive;
+                if (st->prev_positive)
+                    st->positive_count = 0;
+                else
+                    st->negative_count = 0;
+                run_start = t + 1;
+                transitions &= transitions - 1;
+                if (gate && (transitions & (transitions - 1))) {
+                    // At least two transitions to go: skip to the last one if no run in between is long enough
+                    int last = 63 - __builtin_clzll(transitions);
+                    int before = 63 - __builtin_clzll(transitions & ~((uint64_t) 1 << last));
+                    uint64_t between = ~transitions & (((uint64_t) 1 << last) - ((uint64_t) 1 << run_start));
+                    if (!has_run(between, shortest_run)) {
+                        st->prev_positive = (bits >> last) & 1;
+                        if (st->prev_positive)
+                            st->negative_count = last - before - 1;
+                        else
+                            st->positive_count = last - before - 1;
+                        st->gated_samples += last + 1 - run_start;
+                        run_start = last + 1;
+                        if (st->prev_positive)
+                            st->positive_count = 0;
+                        else
+                            st->negative_count = 0;
+                        break;
+                    }
+                    gate = 0;
+                }
+            }
+            if (st->prev_positive)
+                st->positive_count += valid - run_start;
+            else
+                st->negative_count += valid - run_start;
+        }
+    }
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Transmitters
+//
+// Every Efergy transmitter sends its id in the 3rd byte of the frame.  -u builds an allow-list of ids at run time
+// (TARGET_UID still seeds it at compile time), each with an optional sensor type and line voltage, so a checksum
+// sensor, a TPM and the neighbours' sensors can all be in range at once.  With an allow-list, a frame from any
+// other id is dropped as soon as its 3rd byte is decoded.
+//
+// Each decoder also tracks the wave center, polarity and frame type of every id from its valid frames.  Each
+// transmitter sits at its own offset from the tuned frequency, so once the streaming decoder has a frame's id it
+// starts the frame over on that transmitter's center if the preamble gave a noticeably different one.  A known
+// frame type lets it finish checksum frames without waiting for a 9th byte, and a configured crc type stops CRC
+// frames passing as checksum frames.
+#define UID_BYTE                2   /* Frame byte holding the transmitter id */
+#define UID_COUNT               256
+#define UID_CENTER_WEIGHT       4   /* Each valid frame moves its transmitter's center 1/4 of the way to its own */
+#define UID_RECENTER_THRESHOLD  100 /* Center difference (in rtl_fm sample units) worth starting a frame over for */
+
+enum sensor_type {
+    SENSOR_ANY,         // Not known, the frame length decides (the original rule)
+    SENSOR_CHECKSUM,    // 8 byte frames ending in a 1 byte checksum
+    SENSOR_CRC          // 9 byte frames ending in a CRC-CCIT (Xmodem) crc, as sent by the Elite 3.0 TPM
+};
+
+struct uid_config {
+    unsigned char allowed;
+    unsigned char type;         // enum sensor_type
+    short voltage;              // Line voltage for the W calculation, 0 for VOLTAGE
+};
+
+struct uid_table {
+    int filter;                 // Non zero when only allowed ids are decoded
+    struct uid_config uids[UID_COUNT];
+};
+
+struct uid_table transmitter_config;
+
+// Parses -u uid[:type[:voltage]], type being checksum, crc or tpm (a crc sensor reporting at voltage 1).
+// Returns 0 when spec is malformed.
+int add_allowed_uid(struct uid_table *table, const char *spec) {
+    char *end;
+    long uid = strtol(spec, &end, 0);
+    long voltage = 0;
+    int type = SENSOR_ANY;
+    if ((end == spec) || (uid < 0) || (uid >= UID_COUNT))
+        return 0;
+    if (*end == ':') {
+        const char *name = end + 1;
+        size_t length = strcspn(name, ":");
+        if ((length == 8) && (strncmp(name, "checksum", length) == 0))
+            type = SENSOR_CHECKSUM;
+        else if ((length == 3) && (strncmp(name, "crc", length) == 0))
+            type = SENSOR_CRC;
+        else if ((length == 3) && (strncmp(name, "tpm", length) == 0)) {
+            type = SENSOR_CRC;
+            voltage = 1;
+        } else if ((length != 3) || (strncmp(name, "any", length) != 0))
+            return 0;
+        end = (char *) name + length;
+    }
+    if (*end == ':') {
+        const char *number = end + 1;
+        voltage = strtol(number, &end, 0);
+        if ((end == number) || (voltage < 1) || (voltage > 1000))
+            return 0;
+    }
+    if (*end != '\0')
+        return 0;
+    table->filter = 1;
+    table->uids[uid].allowed = 1;
+    table->uids[uid].type = type;
+    table->uids[uid].voltage = voltage;
+    return 1;
+}
+
+// What a decoder has learned about one transmitter from its valid frames
+struct transmitter_state {
+    int frames;
+    int center;                 // Running average of their wave centers
+    unsigned char positive_pulses;
+    unsigned char type;         // enum sensor_type
+};
+
+// -----------------------------------------------------------------------------
+// Statistics
+//
+// Always on counters and histograms, cheap enough to leave in the hot path: unlike -d they change nothing about
+// the timing they describe.  Every decoder keeps its own struct decoder_stats, written only by the thread running
+// that decoder, so counting is a relaxed load and store (a plain add, no locked instruction) and the stats thread
+// reads the figures while decoding carries on.  Stage times come from CLOCK_MONOTONIC read around each stage, a
+// handful of times per input block or frame rather than per sample.  Histograms have power of 2 buckets.
+//
+// --stats file rewrites file every STATS_FILE_SECONDS (through a rename, so a reader never sees half of it), for
+// node_exporter's textfile collector, say.  --stats unix:path and --stats tcp:[host:]port serve the same
+// Prometheus text to whatever connects, as an HTTP response when it asks with GET, so Prometheus can scrape it
+// directly (tcp binds to 127.0.0.1 unless given a host, an IPv6 one in brackets).  efergy_frames_total against efergy_preambles_total, or
+// the per transmitter rates, is what shows the decode yield dropping.
+#define STATS_FILE_SECONDS      10
+#define STATS_REQUEST_TIMEOUT_MS 200
+#define STATS_SEND_TIMEOUT_MS   1000    /* A client that stops reading is given up on after this */
+#define HISTOGRAM_BUCKETS       32      /* Upper bounds 1, 2, 4 ... 2^31, then +Inf */
+
+enum decoder_stage {
+    STAGE_PREAMBLE,             // Searching for a preamble
+    STAGE_WAVE_CENTER,
+    STAGE_PULSE_COUNT,          // Samples to pulses (and, in the streaming decoder, on to bits and bytes)
+    STAGE_DECODE,               // Pulses to bytes, checking the frame and alternate decodes
+    STAGE_COUNT
+};
+
+static const char *const stage_names[STAGE_COUNT] = { "preamble", "wave_center", "pulse_count", "decode" };
+
+struct histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS + 1];
+    _Atomic uint64_t sum;
+};
+
+struct decoder_stats {
+    const char *name;           // input="..." label
+    _Atomic uint64_t samples;
+    _Atomic uint64_t samples_lost;      // To sample ring overruns
+    _Atomic uint64_t samples_gated;     // Passed over by the preamble search's noise gate
+    _Atomic uint64_t preambles;
+    _Atomic uint64_t frames;            // Captured and checked, whatever the outcome
+    _Atomic uint64_t rejected;          // From transmitters not on the -u list
+    _Atomic uint64_t checksum_ok;
+    _Atomic uint64_t checksum_failed;
+    _Atomic uint64_t crc_ok;
+    _Atomic uint64_t crc_failed;
+    _Atomic uint64_t short_frames;      // Too few bytes for either
+    _Atomic uint64_t rescued;
+    _Atomic int64_t wave_center;
+    int channel;                        // Decodes a --channels channel
+    _Atomic int64_t channel_hz;         // Where that channel is tuned now, from the IQ center frequency
+    struct histogram wave_center_drift; // Change in the wave center from one preamble (frame) to the next
+    struct histogram stage_ns[STAGE_COUNT];
+    _Atomic uint64_t uid_frames[UID_COUNT];     // Valid frames
+    _Atomic int64_t uid_last_frame[UID_COUNT];  // Unix time
+    _Atomic uint64_t *frames_dropped;   // The frame ring's count of frames the output stage had no room for
+    struct decoder_stats *next;
+};
+
+struct decoder_stats *_Atomic stats_sources;
+struct histogram output_ns;     // Only written by the thread displaying frames
+_Atomic uint64_t subscribers;   // Connected to --socket
+_Atomic uint64_t subscriber_records_dropped;    // Records that didn't fit a slow subscriber's buffer
+_Atomic uint64_t command_restarts;      // Of the --spawn command
+time_t stats_start_time;
+
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void stat_set(_Atomic int64_t *gauge, int64_t value) {
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline void histogram_observe(struct histogram *h, uint64_t value) {
+    int bucket = (value <= 1) ? 0 : 64 - __builtin_clzll(value - 1);   // Smallest k with value <= 2^k
+    if (bucket > HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS;
+    stat_add(&h->buckets[bucket], 1);
+    stat_add(&h->sum, value);
+}
+
+static inline uint64_t stats_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Times one stage: adds the time since *start to its histogram and moves *start on to now
+static inline void stage_done(struct decoder_stats *stats, enum decoder_stage stage, uint64_t *start) {
+    uint64_t now = stats_clock_ns();
+    histogram_observe(&stats->stage_ns[stage], now - *start);
+    *start = now;
+}
+
+// Only called before the decoder's thread starts, and only from the main thread
+void stats_register(struct decoder_stats *stats, const char *name) {
+    stats->name = name;
+    stats->next = atomic_load_explicit(&stats_sources, memory_order_relaxed);
+    atomic_store_explicit(&stats_sources, stats, memory_order_release);
+}
+
+static uint64_t stat_get(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Buckets 2^first .. 2^last as le="...", in units of scale, then +Inf.  labels is empty or ends in a comma.
+static void stats_histogram(FILE *f, const char *name, const char *labels, struct histogram *h, int first, int last,
+                            double scale) {
+    uint64_t cumulative = 0;
+    int k;
+    for (k = 0; k < first; k++)
+        cumulative += stat_get(&h->buckets[k]);
+    for (k = first; k <= last; k++) {
+        cumulative += stat_get(&h->buckets[k]);
+        fprintf(f, "%s_bucket{%sle=\"%.9g\"} %llu\n", name, labels, (double) (1ULL << k) * scale,
+                (unsigned long long) cumulative);
+    }
+    for (; k <= HISTOGRAM_BUCKETS; k++)
+        cumulative += stat_get(&h->buckets[k]);
+    fprintf(f, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels, (unsigned long long) cumulative);
+    int length = strlen(labels);
+    if (length) {
+        fprintf(f, "%s_sum{%.*s} %.9g\n", name, length - 1, labels, stat_get(&h->sum) * scale);
+        fprintf(f, "%s_count{%.*s} %llu\n", name, length - 1, labels, (unsigned long long) cumulative);
+    } else {
+        fprintf(f, "%s_sum %.9g\n", name, stat_get(&h->sum) * scale);
+        fprintf(f, "%s_count %llu\n", name, (unsigned long long) cumulative);
+    }
+}
+
+// One counter per input
+static void stats_counter(FILE *f, const char *name, const char *help, size_t offset) {
+    struct decoder_stats *s;
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (s = atomic_load_explicit(&stats_sources, memory_order_acquire); s != NULL; s = s->next)
+        fprintf(f, "%s{input=\"%s\"} %llu\n", name, s->name,
+                (unsigned long long) stat_get((_Atomic uint64_t *) ((char *) s + offset)));
+}
+
+// Everything, in the Prometheus text format
+void stats_write(FILE *f) {
+    struct decoder_stats *first = atomic_load_explicit(&stats_sources, memory_order_acquire), *s;
+    char labels[160];
+    int stage, uid;
+
+    fprintf(f, "# HELP efergy_start_time_seconds When the decoder started.\n# TYPE efergy_start_time_seconds gauge\n");
+    fprintf(f, "efergy_start_time_seconds %lld\n", (long long) stats_start_time);
+    stats_counter(f, "efergy_samples_total", "Samples decoded.", offsetof(struct decoder_stats, samples));
+    stats_counter(f, "efergy_samples_lost_total", "Samples lost to sample ring overruns.",
+                  offsetof(struct decoder_stats, samples_lost));
+    stats_counter(f, "efergy_samples_gated_total", "Samples the preamble search's noise gate passed over.",
+                  offsetof(struct decoder_stats, samples_gated));
+    stats_counter(f, "efergy_preambles_total", "Preambles detected.", offsetof(struct decoder_stats, preambles));
+    stats_counter(f, "efergy_frames_total", "Frames captured and checked.", offsetof(struct decoder_stats, frames));
+    stats_counter(f, "efergy_frames_rejected_total", "Frames from transmitters not on the -u list.",
+                  offsetof(struct decoder_stats, rejected));
+    stats_counter(f, "efergy_frames_rescued_total", "Frames only valid thanks to an alternate decode.",
+                  offsetof(struct decoder_stats, rescued));
+    stats_counter(f, "efergy_frames_short_total", "Frames too short for a checksum or crc.",
+                  offsetof(struct decoder_stats, short_frames));
+
+    fprintf(f, "# HELP efergy_frames_checked_total Frames by check and outcome.\n"
+               "# TYPE efergy_frames_checked_total counter\n");
+    for (s = first; s != NULL; s = s->next) {
+        fprintf(f, "efergy_frames_checked_total{input=\"%s\",check=\"checksum\",result=\"ok\"} %llu\n", s->name,
+                (unsigned long long) stat_get(&s->checksum_ok));
+        fprintf(f, "efergy_frames_checked_total{input=\"%s\",check=\"checksum\",result=\"failed\"} %llu\n", s->name,
+                (unsigned long long) stat_get(&s->checksum_failed));
+        fprintf(f, "efergy_frames_checked_total{input=\"%s\",check=\"crc\",result=\"ok\"} %llu\n", s->name,
+                (unsigned long long) stat_get(&s->crc_ok));
+        fprintf(f, "efergy_frames_checked_total{input=\"%s\",check=\"crc\",result=\"failed\"} %llu\n", s->name,
+                (unsigned long long) stat_get(&s->crc_failed));
+    }
+
+    fprintf(f, "# HELP efergy_frames_dropped_total Frames the output stage had no room for.\n"
+               "# TYPE efergy_frames_dropped_total counter\n");
+    for (s = first; s != NULL; s = s->next)
+        fprintf(f, "efergy_frames_dropped_total{input=\"%s\"} %llu\n", s->name,
+                (unsigned long long) (s->frames_dropped ? stat_get(s->frames_dropped) : 0));
+
+    fprintf(f, "# HELP efergy_transmitter_frames_total Valid frames by transmitter.\n"
+               "# TYPE efergy_transmitter_frames_total counter\n");
+    for (s = first; s != NULL; s = s->next)
+        for (uid = 0; uid < UID_COUNT; uid++)
+            if (stat_get(&s->uid_frames[uid]))
+                fprintf(f, "efergy_transmitter_frames_total{input=\"%s\",uid=\"%d\"} %llu\n", s->name, uid,
+                        (unsigned long long) stat_get(&s->uid_frames[uid]));
+    fprintf(f, "# HELP efergy_transmitter_last_frame_seconds When the transmitter's last valid frame arrived.\n"
+               "# TYPE efergy_transmitter_last_frame_seconds gauge\n");
+    for (s = first; s != NULL; s = s->next)
+        for (uid = 0; uid < UID_COUNT; uid++)
+            if (stat_get(&s->uid_frames[uid]))
+                fprintf(f, "efergy_transmitter_last_frame_seconds{input=\"%s\",uid=\"%d\"} %lld\n", s->name, uid,
+                        (long long) atomic_load_explicit(&s->uid_last_frame[uid], memory_order_relaxed));
+
+    fprintf(f, "# HELP efergy_wave_center Wave center (sample value) of the last frame.\n"
+               "# TYPE efergy_wave_center gauge\n");
+    for (s = first; s != NULL; s = s->next)
+        fprintf(f, "efergy_wave_center{input=\"%s\"} %lld\n", s->name,
+                (long long) atomic_load_explicit(&s->wave_center, memory_order_relaxed));
+    fprintf(f, "# HELP efergy_channel_offset_hz Where each --channels channel is tuned, from the IQ center.\n"
+               "# TYPE efergy_channel_offset_hz gauge\n");
+    for (s = first; s != NULL; s = s->next)
+        if (s->channel)
+            fprintf(f, "efergy_channel_offset_hz{input=\"%s\"} %lld\n", s->name,
+                    (long long) atomic_load_explicit(&s->channel_hz, memory_order_relaxed));
+    fprintf(f, "# HELP efergy_wave_center_drift Change in the wave center from one preamble to the next.\n"
+               "# TYPE efergy_wave_center_drift histogram\n");
+    for (s = first; s != NULL; s = s->next) {
+        snprintf(labels, sizeof(labels), "input=\"%s\",", s->name);
+        stats_histogram(f, "efergy_wave_center_drift", labels, &s->wave_center_drift, 0, 14, 1);
+    }
+
+    fprintf(f, "# HELP efergy_stage_duration_seconds Time spent in each decoder stage, per call.\n"
+               "# TYPE efergy_stage_duration_seconds histogram\n");
+    for (s = first; s != NULL; s = s->next)
+        for (stage = 0; stage < STAGE_COUNT; stage++) {
+            snprintf(labels, sizeof(labels), "input=\"%s\",stage=\"%s\",", s->name, stage_names[stage]);
+            stats_histogram(f, "efergy_stage_duration_seconds", labels, &s->stage_ns[stage], 7, 27, 1e-9);
+        }
+    fprintf(f, "# HELP efergy_output_duration_seconds Time spent displaying, logging and queueing each frame.\n"
+               "# TYPE efergy_output_duration_seconds histogram\n");
+    stats_histogram(f, "efergy_output_duration_seconds", "", &output_ns, 7, 27, 1e-9);
+    fprintf(f, "# HELP efergy_subscribers Consumers connected to the --socket stream.\n"
+               "# TYPE efergy_subscribers gauge\n");
+    fprintf(f, "efergy_subscribers %llu\n", (unsigned long long) stat_get(&subscribers));
+    fprintf(f, "# HELP efergy_subscriber_records_dropped_total Stream records slow subscribers had no room for.\n"
+               "# TYPE efergy_subscriber_records_dropped_total counter\n");
+    fprintf(f, "efergy_subscriber_records_dropped_total %llu\n",
+            (unsigned long long) stat_get(&subscriber_records_dropped));
+    fprintf(f, "# HELP efergy_command_restarts_total Restarts of the --spawn command.\n"
+               "# TYPE efergy_command_restarts_total counter\n");
+    fprintf(f, "efergy_command_restarts_total %llu\n", (unsigned long long) stat_get(&command_restarts));
+}
+
+struct stats_server {
+    const char *path;           // File to rewrite, or NULL when serving a socket
+    const char *unix_path;      // Socket to remove at exit
+    int listen_fd;
+    pthread_mutex_t lock;       // Around rewriting the file
+    pthread_t thread;
+};
+
+struct stats_server stats_server;
+
+static void stats_write_file(struct stats_server *server) {
+    char temporary[PATH_MAX];
+    FILE *f;
+    snprintf(temporary, sizeof(temporary), "%s.tmp", server->path);
+    pthread_mutex_lock(&server->lock);
+    if ((f = fopen(temporary, "w")) != NULL) {
+        stats_write(f);
+        if ((fclose(f) != 0) || (rename(temporary, server->path) != 0))
+            unlink(temporary);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Answers one connection: the bare text, or an HTTP response to a GET
+static void stats_answer(int fd) {
+    char request[512];
+    char *text = NULL;
+    size_t length = 0, done = 0;
+    ssize_t n = 0;
+    struct pollfd p = { fd, POLLIN, 0 };
+    FILE *f = open_memstream(&text, &length);
+    if (f == NULL)
+        return;
+    stats_write(f);
+    fclose(f);
+    // Whatever the client says straight away is enough to see a GET
+    if (poll(&p, 1, STATS_REQUEST_TIMEOUT_MS) > 0)
+        n = read(fd, request, sizeof(request));
+    if ((n >= 4) && (memcmp(request, "GET ", 4) == 0))
+        dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                    "Connection: close\r\n\r\n", length);
+    while (done < length) {
+        n = write(fd, text + done, length - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    free(text);
+}
+
+void *stats_thread(void *arg) {
+    struct stats_server *server = arg;
+    for (;;) {
+        if (server->path) {
+            sleep(STATS_FILE_SECONDS);
+            stats_write_file(server);
+        } else {
+            int fd = accept(server->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                // One thread answers everybody, so a client that sends or reads nothing mustn't hold it up
+                struct timeval receive = { 0, STATS_REQUEST_TIMEOUT_MS * 1000 };
+                struct timeval send = { STATS_SEND_TIMEOUT_MS / 1000, STATS_SEND_TIMEOUT_MS % 1000 * 1000 };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receive, sizeof(receive));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send));
+                stats_answer(fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int stats_listen(const char *spec, struct stats_server *server) {
+    int fd;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof(addr.sun_path))
+            return -1;
+        strcpy(addr.sun_path, spec + 5);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ((fd < 0) || (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) {
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        server->unix_path = spec + 5;
+    } else {
+        char host[256] = "127.0.0.1";
+        const char *port = strrchr(spec + 4, ':');
+        struct addrinfo hints, *addrs;
+        if (port) {
+            if (port - (spec + 4) >= (int) sizeof(host))
+                return -1;
+            memcpy(host, spec + 4, port - (spec + 4));
+            host[port - (spec + 4)] = '\0';
+            port++;
+        } else
+            port = spec + 4;
+        // An IPv6 address comes in brackets, as in tcp:[::1]:9105, which getaddrinfo() doesn't take
+        size_t host_length = strlen(host);
+        if ((host[0] == '[') && (host_length >= 2) && (host[host_length - 1] == ']')) {
+            memmove(host, host + 1, host_length - 2);
+            host[host_length - 2] = '\0';
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host, port, &hints, &addrs) != 0)
+            return -1;
+        int on = 1;
+        fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_CLOEXEC, addrs->ai_protocol);
+        if ((fd < 0) || (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) ||
+                (bind(fd, addrs->ai_addr, addrs->ai_addrlen) != 0)) {
+            if (fd >= 0)
+                close(fd);
+            freeaddrinfo(addrs);
+            return -1;
+        }
+        freeaddrinfo(addrs);
+    }
+    if (listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Starts serving (or writing) the statistics as --stats spec says.  Returns zero if it can't.
+int stats_start(const char *spec) {
+    struct stats_server *server = &stats_server;
+    memset(server, 0, sizeof(*server));
+    pthread_mutex_init(&server->lock, NULL);
+    if ((strncmp(spec, "unix:", 5) == 0) || (strncmp(spec, "tcp:", 4) == 0)) {
+        if ((server->listen_fd = stats_listen(spec, server)) < 0)
+            return 0;
+    } else
+        server->path = spec;
+    if (pthread_create(&server->thread, NULL, stats_thread, server) != 0)
+        return 0;
+    pthread_detach(server->thread);
+    return 1;
+}
+
+// Writes the final figures, or removes the socket
+void stats_stop(void) {
+    if (stats_server.path)
+        stats_write_file(&stats_server);
+    else if (stats_server.unix_path)
+        unlink(stats_server.unix_path);
+}
+
+// -----------------------------------------------------------------------------
+// Decoder context
+//
+// Everything one decoder needs between blocks lives in a struct efergy_decoder, so several receivers can be
+// decoded in one process (see run_inputs()) and the decoder can be driven from other code: initialize it with
+// efergy_decoder_init(), hand it samples with efergy_decoder_push() in blocks of any size, and it calls its frame
+// sink for every frame it decodes.
+
+// A decoded (not necessarily valid) frame on its way to the output stage
+struct efergy_frame {
+    time_t received;
+    long received_nsec;
+    struct timespec validated;  // CLOCK_MONOTONIC, when the decoder checked it
+    const char *msg;
+    int positive_pulses;
+    int rescued;                // Only checked out with an alternate decode
+    int input;                  // Index of the input it was received on
+    int valid_type;             // enum sensor_type it checked out as, SENSOR_ANY when it didn't
+    unsigned char checksum;     // compute_checksum() and compute_crc() of the bytes, as they were checked
+    uint16_t crc;
+    int bytecount;
+    unsigned char bytes[FRAMEBYTECOUNT];
+};
+
+typedef void (*efergy_frame_sink)(void *arg, const struct efergy_frame *frame);
+
+// Streaming decoder state for the frame being captured, see stream_frame_decode()
+struct frame_stream {
+    int last_center;            // analysis_wavecenter before this frame, for the debug output
+    int decoded_index;          // Samples in sample_storage already turned into pulses
+    int run_start;              // First sample of the run in progress
+    int store_positive_pulses;
+    int bitpos;
+    unsigned char bytedata;
+    int bytecount;
+    unsigned char bytes[FRAMEBYTECOUNT];
+    int checksum_frame_end;     // Non zero when the first 8 bytes passed the checksum
+    int resume_index;           // Where the preamble search picks up again once the frame is complete
+    int type;                   // enum sensor_type, once the transmitter id is known
+    int rejected;               // The transmitter id isn't on the allow-list
+    int recentred;              // Started over on the transmitter's center
+    int rescued;                // Only checked out with an alternate decode
+};
+
+// The streaming decoder centers each frame on its own preamble, so the samples just before the end of the
+// preamble are needed even when the preamble started in an earlier input block.  sample_history keeps the tail
+// of the previous blocks for that.
+#define PREAMBLE_WINDOW_SAMPLES 512
+
+struct sample_history {
+    int16_t samples[PREAMBLE_WINDOW_SAMPLES];
+    int count;
+};
+
+// Decoder settings from the command line
+struct decoder_options {
+    int debug_level;
+    int batch_decoder;          // Use the original batch decoder
+    int alternate_decodes;      // Try alternate decodes of failed frames, see stream_frame_rescue()
+    int64_t start_ns;           // --start: when the first sample was received, 0 for when it is decoded
+};
+
+// Frame times come from the sample count rather than a clock call per frame: input sample n was received at
+// anchor_ns + (n - anchor_sample) / rate.  A live input is anchored to the wall clock as each block is decoded,
+// so the times stay right through sample rate error and lost samples.  A capture (--replay, a file, or anything
+// with --start) is anchored once, so its frames are timed as they were recorded and the same capture always
+// gives the same output, however fast it is decoded.
+struct sample_clock {
+    int live;
+    int64_t anchor_ns;          // CLOCK_REALTIME, 0 until the first block
+    uint64_t anchor_sample;
+};
+
+// Decoder loop: search for a preamble, then capture the frame that follows it.  Both steps carry their state
+// across blocks.  The streaming decoder may finish a frame part way through a block; the samples after it go
+// straight back to the preamble search.  The batch decoder always captures SAMPLE_STORE_SIZE samples.
+struct efergy_decoder {
+    struct decoder_timing timing;
+    int debug_level;
+    int batch_decoder;
+    int alternate_decodes;
+    int input;                  // Copied into every frame
+    struct sample_clock clock;
+    uint64_t position;          // Input samples before the current block, lost ones included
+    uint64_t frame_position;    // Input sample the current frame's preamble ended on
+    efergy_frame_sink sink;
+    void *sink_arg;
+    const struct uid_table *uid_table;
+    int analysis_wavecenter;
+    int capturing_frame;
+    struct preamble_state preamble;
+    struct sample_history history;
+    struct frame_stream stream;
+    struct transmitter_state transmitters[UID_COUNT];
+    uint64_t valid_frames;
+    uint64_t rescued_frames;    // Valid only thanks to an alternate decode
+    struct decoder_stats stats;
+    uint64_t stage_start;       // stats_clock_ns() when the stage in progress began
+    int sample_store_index;
+    int16_t sample_storage[MAX_SAMPLE_STORE_SIZE];
+};
+
+// Non zero when a frame with these bytes (so far) comes from a transmitter that isn't on the allow-list.  Frames
+// too short to have an id don't get through an allow-list either.
+static int uid_rejected(const struct uid_table *table, const unsigned char bytes[], int bytecount) {
+    return table->filter && ((bytecount <= UID_BYTE) || !table->uids[bytes[UID_BYTE]].allowed);
+}
+
+int decode_bytes_from_pulse_counts(const struct efergy_decoder *dec, int pulse_store[], int pulse_store_index,
+                                   unsigned char bytes[]) {
+    int i;
+    int dbit = 0;
+    int bitpos = 0;
+    unsigned char bytedata = 0;
+    int bytecount = 0;
+
+    for (i = 0; i < FRAMEBYTECOUNT; i++)
+        bytes[i] = 0;
+    for (i = 0; i < pulse_store_index; i++) {
+        if (pulse_store[i] > dec->timing.min_low_bits) {
+            dbit++;
+            bitpos++;
+            bytedata = bytedata << 1;
+            if (pulse_store[i] > dec->timing.min_high_bits)
+                bytedata = bytedata | 0x1;
+            if (bitpos > 7) {
+                bytes[bytecount] = bytedata;
+                bytedata = 0;
+                bitpos = 0;
+                bytecount++;
+                if (bytecount == FRAMEBYTECOUNT) {
+                    return bytecount;
+                }
+                if ((bytecount == UID_BYTE + 1) && uid_rejected(dec->uid_table, bytes, bytecount))
+                    return bytecount;   // Not wanted, no need to decode the rest
+            }
+        }
+    }
+    return bytecount;
+}
+
+unsigned char compute_checksum(const unsigned char bytes[], int bytecount) {
+    // Calculate simple 1 byte checksum on message bytes
+    unsigned char tbyte = 0x00;
+    int i;
+    for (i = 0; i < (bytecount - 1); i++) {
+        tbyte += bytes[i];
+    }
+    return tbyte;
+}
+
+// CRC-CCITT (xmodem, polynomial 0x1021) a byte at a time: crc_table[n] is the crc of byte n
+uint16_t crc_table[256];
+
+// Called from main() before any thread starts
+void init_crc_table(void) {
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        crc_table[i] = crc;
+    }
+}
+
+// Of all but the last two bytes, where the crc goes
+uint16_t compute_crc(const unsigned char bytes[], int bytecount) {
+    uint16_t crc = 0;
+    int i;
+    for (i = 0; i < bytecount - 2; i++)
+        crc = (crc << 8) ^ crc_table[(crc >> 8) ^ bytes[i]];
+    return crc;
+}
+
+// Sensor type a frame with these sums (compute_checksum() and compute_crc() of its bytes) checks out as, or
+// SENSOR_ANY when it fails.  A type other than SENSOR_ANY only accepts frames of that type.
+static int check_sums(const unsigned char bytes[], int bytecount, int type, unsigned char checksum, uint16_t crc) {
+    if ((bytecount == EXPECTED_BYTECOUNT_IF_CHECKSUM_USED) && (type != SENSOR_CRC) &&
+            (checksum == bytes[bytecount - 1]))
+        return SENSOR_CHECKSUM;
+    if ((bytecount == EXPECTED_BYTECOUNT_IF_CRC_USED) && (type != SENSOR_CHECKSUM) &&
+            (crc == ((bytes[bytecount - 2] << 8) | bytes[bytecount - 1])))
+        return SENSOR_CRC;
+    return SENSOR_ANY;
+}
+
+int check_frame(const unsigned char bytes[], int bytecount, int type) {
+    if (bytecount == EXPECTED_BYTECOUNT_IF_CHECKSUM_USED)
+        return check_sums(bytes, bytecount, type, compute_checksum(bytes, bytecount), 0);
+    if (bytecount == EXPECTED_BYTECOUNT_IF_CRC_USED)
+        return check_sums(bytes, bytecount, type, 0, compute_crc(bytes, bytecount));
+    return SENSOR_ANY;
+}
+
+int calculate_wave_center(const struct efergy_decoder *dec, int *avg_positive_sample, int *avg_negative_sample) {
+    struct wave_sums sums;
+    kernels->wave_sums(dec->sample_storage, dec->sample_store_index, &sums);
+    int64_t avg_pos = sums.pos_sum;
+    int64_t avg_neg = sums.neg_sum;
+    if (sums.pos_count != 0)
+        avg_pos /= sums.pos_count;
+    if (sums.neg_count != 0)
+        avg_neg /= sums.neg_count;
+    *avg_positive_sample = avg_pos;
+    *avg_negative_sample = avg_neg;
+    int diff = (avg_neg + ((avg_pos - avg_neg) / 2));
+    return diff;
+}
+
+int generate_pulse_count_array(const struct efergy_decoder *dec, int display_pulse_details, int pulse_count_storage[]) {
+    const int16_t *sample_storage = dec->sample_storage;
+    int sample_store_index = dec->sample_store_index;
+    int analysis_wavecenter = dec->analysis_wavecenter;
+
+    // From empirical analysis with an Elite 3.0 TPM transmitter, sometimes the data can be decoded by counting negative pulses rather than positive
+    // pulses.  It seems that if the first sequence after the preamble is positive pulses, the data can be decoded by parsing using the negative pulse counts.
+    // This flag decoder automatically detect this.
+    int store_positive_pulses = (sample_storage[dec->timing.polarity_sample] < analysis_wavecenter);
+
+    if (display_pulse_details) printf("\nPulse stream for this frame (P-Consecutive samples > center, N-Consecutive samples < center)\n");
+
+    // Every run of samples on one side of the center that is ended by a sample on the other side is a pulse.
+    // The run still open at the end of the frame isn't counted.
+    uint64_t mask[MASK_WORDS(MAX_SAMPLE_STORE_SIZE)];
+    kernels->sign_mask(sample_storage, sample_store_index, analysis_wavecenter, mask);
+
+    int wrap_count = 0;
+    int pulse_store_index = 0;
+    int run_start = 0;
+    int w;
+    for (w = 0; w < MASK_WORDS(sample_store_index); w++) {
+        uint64_t bits = mask[w];
+        int prev_bit = (w == 0) ? (int) (bits & 1) : (int) (mask[w - 1] >> 63);
+        uint64_t transitions = bits ^ ((bits << 1) | (uint64_t) prev_bit);
+        int valid = sample_store_index - w * 64;
+        if (valid < 64)
+            transitions &= ((uint64_t) 1 << valid) - 1;
+        while (transitions) {
+            int t = w * 64 + __builtin_ctzll(transitions);
+            int run_length = t - run_start;
+            int run_positive = (sample_storage[t] < analysis_wavecenter);   // The run ended by sample t has the opposite sign
+            if (run_positive == store_positive_pulses)
+                pulse_count_storage[pulse_store_index++] = run_length;
+            if (display_pulse_details) {
+                printf("%2d%c ", run_length, run_positive ? 'P' : 'N');
+                if (++wrap_count >= 16) {
+                    printf("\n");
+                    wrap_count = 0;
+                }
+            }
+            run_start = t;
+            transitions &= transitions - 1;
+        }
+    }
+    if (display_pulse_details) printf("\n\n");
+
+    return pulse_store_index;
+}
+
+// -----------------------------------------------------------------------------
+// MQTT publisher
+//
+// With --mqtt host[:port] every valid reading is published from here, over one long lived MQTT 3.1.1 connection,
+// instead of through run.py (which connected and authenticated all over again for every reading).  The payload is
+// run.py's plus the transmitter id and the (unix) time of the reading, which matters for readings that waited out
+// a broker outage:
+//  house/energy {"consumption_watts": 1320.00, "uid": 34, "time": 1760665123}
+// and --windows reports go to topic/<window>, house/energy/1m say (see output_energy_report()).
+// The output stage only queues the message in a single producer / single consumer lock-free ring, like
+// frame_ring, and mqtt_thread() owns the connection.  It connects (and reconnects, backing off from 1 to 60
+// seconds), sends PINGREQ when the connection has been idle for the keepalive time, and gives up on a connection
+// that hasn't answered a PINGREQ or PUBLISH within it.  Messages go out in batches, as many PUBLISH packets per
+// write() as fit MQTT_BATCH_SIZE, and at QoS 1 up to MQTT_MAX_INFLIGHT of them wait for their PUBACKs at once, so
+// a backlog drains at the broker's pace rather than a round trip per message.  At QoS 1 a message stays queued
+// until its PUBACK, and whatever is unacknowledged when a connection drops is sent again on the next one.  When
+// the queue is full new readings are dropped and counted.  Latency is measured from the frame check to the write
+// (QoS 0) or to the PUBACK (QoS 1), which brackets the broker receiving it.
+//
+// The queue normally lives in memory and holds MQTT_QUEUE_ENTRIES messages.  With --mqtt-store file it is a
+// memory mapped ring file instead, --mqtt-store-size messages long, so readings survive both a long broker
+// outage and a restart.  Every record carries its sequence number and a crc, and the header says how far the
+// broker has acknowledged: opening the file finds the newest intact record and carries on from there, sending
+// whatever hadn't been acknowledged (again, perhaps, since the header is only a hint; QoS 1 is at least once
+// anyway).  A record torn by a power cut fails its crc and is skipped.  The file never grows, and it is only
+// msync()'ed every MQTT_STORE_SYNC_SECONDS, so an SD card sees a few page writes a minute however busy it gets.
+#define MQTT_DEFAULT_PORT       "1883"
+#define MQTT_DEFAULT_TOPIC      "house/energy"
+#define MQTT_DEFAULT_KEEPALIVE  60
+#define MQTT_QUEUE_ENTRIES      4096    /* Without --mqtt-store */
+#define MQTT_DEFAULT_STORE_SIZE 65536   /* Messages in a new --mqtt-store file: 16MB, 4.5 days of one transmitter */
+#define MQTT_STORE_SYNC_SECONDS 60
+#define MQTT_STORE_MAGIC        "EfergyQ1"
+#define MQTT_PAYLOAD_SIZE       206     /* Makes a message 256 bytes */
+#define MQTT_SUBTOPIC_SIZE      12
+#define MQTT_TOPIC_SIZE         256
+#define MQTT_BATCH_SIZE         16384
+#define MQTT_MAX_INFLIGHT       256     /* Unacknowledged QoS 1 messages */
+#define MQTT_BACKOFF_MIN        1.0     /* Seconds before the first reconnect, doubling up to the max */
+#define MQTT_BACKOFF_MAX        60.0
+#define MQTT_CONNACK_TIMEOUT_MS 10000
+#define MQTT_SEND_TIMEOUT       10      /* Seconds a blocked write may take before the connection counts as lost */
+#define MQTT_DRAIN_TIMEOUT      5.0     /* Seconds allowed at exit for the queue to empty */
+#define MQTT_IN_SIZE            64
+
+// Control packet types, the high nibble of the first byte
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_PUBACK             0x40
+#define MQTT_PINGREQ            0xc0
+#define MQTT_PINGRESP           0xd0
+#define MQTT_DISCONNECT         0xe0
+
+// One queued message, and one record of the --mqtt-store file
+struct mqtt_message {
+    uint64_t seq;
+    int64_t received;           // Unix time of the reading
+    struct timespec validated;  // CLOCK_MONOTONIC, only meaningful to the run that queued it
+    int32_t length;             // Payload bytes, -1 for a record that was found torn and is skipped
+    char subtopic[MQTT_SUBTOPIC_SIZE];  // Published to topic/subtopic, or just topic if empty
+    char payload[MQTT_PAYLOAD_SIZE];
+    uint16_t crc;               // compute_crc() of everything before it, see mqtt_record_crc()
+};
+
+struct mqtt_store_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t capacity;
+    uint64_t acked;             // Messages before this sequence number have been acknowledged
+};
+
+struct mqtt_client {
+    char host[256];
+    const char *port;
+    const char *topic;
+    const char *user;           // NULL for none
+    const char *password;       // NULL for none
+    int qos;                    // 0 or 1
+    int keepalive;              // Seconds
+
+    struct mqtt_message *queue;
+    uint64_t capacity;
+    struct mqtt_store_header *store;    // NULL without --mqtt-store
+    size_t store_length;
+    uint64_t first_seq;         // First message queued by this run
+    _Atomic uint64_t head;      // Only written by mqtt_publish()
+    _Atomic uint64_t tail;      // Only written by mqtt_thread().  Messages before it are done with.
+    _Atomic uint64_t dropped;
+    _Atomic int done;
+    int wake[2];                // Pipe that mqtt_publish() and mqtt_stop() nudge mqtt_thread() through
+    pthread_t thread;
+
+    // mqtt_thread() only
+    char client_id[32];
+    int fd;                     // -1 while disconnected
+    uint64_t sent;              // Messages before it have been written to the connection
+    uint64_t written;           // Messages before it have been written to some connection, so resends are DUP
+    int failing;                // Connecting has failed since the last connection
+    int connections;
+    struct timespec last_sent;
+    struct timespec last_sync;
+    int waiting;                // For a PINGRESP or PUBACK, since waiting_since
+    struct timespec waiting_since;
+    int ping_outstanding;
+    unsigned char in[MQTT_IN_SIZE];
+    int in_length;
+    unsigned char batch[MQTT_BATCH_SIZE];
+    size_t batch_length;
+    uint64_t published;
+    uint64_t reconnects;
+    uint64_t latency_count;
+    double latency_sum;
+    double latency_max;
+    struct timespec first_published;    // Validation time of the first message, or when it was sent from the store
+    struct timespec last_published;
+};
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int connect_tcp(const char *host, const char *port) {
+    struct addrinfo hints, *addrs, *a;
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0)
+        return -1;
+    for (a = addrs; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+// Sets up the client from --mqtt's host[:port]; everything else has its default
+void mqtt_init(struct mqtt_client *c, const char *server) {
+    const char *colon = strrchr(server, ':');
+    size_t length = colon ? (size_t) (colon - server) : strlen(server);
+    memset(c, 0, sizeof(*c));
+    if (length >= sizeof(c->host))
+        length = sizeof(c->host) - 1;
+    memcpy(c->host, server, length);
+    c->host[length] = '\0';
+    c->port = colon ? colon + 1 : MQTT_DEFAULT_PORT;
+    c->topic = MQTT_DEFAULT_TOPIC;
+    c->user = getenv("MQTT_USER");
+    c->password = getenv("MQTT_PASS");
+    c->keepalive = MQTT_DEFAULT_KEEPALIVE;
+    c->fd = -1;
+}
+
+// compute_crc() leaves out the last two bytes it is given, so those have to be the crc itself
+static uint16_t mqtt_record_crc(const struct mqtt_message *m) {
+    return compute_crc((const unsigned char *) m, offsetof(struct mqtt_message, crc) + sizeof(m->crc));
+}
+
+// Maps the --mqtt-store file, creating it with capacity records if it doesn't exist, and picks up where the last
+// run left off
+void mqtt_store_open(struct mqtt_client *c, const char *path, uint64_t capacity) {
+    struct mqtt_store_header header;
+    struct stat st;
+    uint64_t head = 0, tail, seq, i, torn = 0;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        fprintf(stderr, "\nFailed to open MQTT store %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MQTT_STORE_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(struct mqtt_message);
+        header.capacity = capacity;
+        if ((ftruncate(fd, sizeof(header) + capacity * sizeof(struct mqtt_message)) != 0) ||
+                (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))) {
+            fprintf(stderr, "\nFailed to create MQTT store %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    } else if ((pread(fd, &header, sizeof(header), 0) != sizeof(header)) ||
+               (memcmp(header.magic, MQTT_STORE_MAGIC, sizeof(header.magic)) != 0) ||
+               (header.record_size != sizeof(struct mqtt_message)) || (header.capacity == 0) ||
+               (st.st_size != (off_t) (sizeof(header) + (uint64_t) header.capacity * sizeof(struct mqtt_message)))) {
+        fprintf(stderr, "\n%s isn't an MQTT store written by this version\n", path);
+        exit(EXIT_FAILURE);
+    }
+    c->capacity = header.capacity;
+    c->store_length = sizeof(header) + c->capacity * sizeof(struct mqtt_message);
+    c->store = mmap(NULL, c->store_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c->store == MAP_FAILED) {
+        fprintf(stderr, "\nFailed to map MQTT store %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    c->queue = (struct mqtt_message *) (c->store + 1);
+
+    // The newest intact record is the last one written.  Never written ones are all zeros, crc included.
+    for (i = 0; i < c->capacity; i++) {
+        const struct mqtt_message *m = &c->queue[i];
+        if ((m->seq % c->capacity == i) && (m->seq + 1 > head) && (m->length != 0) && (mqtt_record_crc(m) == m->crc))
+            head = m->seq + 1;
+    }
+    tail = c->store->acked;
+    if (tail > head)
+        tail = head;
+    if (head - tail > c->capacity)
+        tail = head - c->capacity;
+    for (seq = tail; seq < head; seq++) {
+        struct mqtt_message *m = &c->queue[seq % c->capacity];
+        if ((m->seq != seq) || (m->length == 0) || (mqtt_record_crc(m) != m->crc)) {
+            m->seq = seq;
+            m->length = -1;
+            m->crc = mqtt_record_crc(m);
+            torn++;
+        }
+    }
+    c->store->acked = tail;
+    atomic_store(&c->head, head);
+    atomic_store(&c->tail, tail);
+    c->first_seq = head;
+    if (head != tail)
+        fprintf(stderr, "%llu unsent MQTT messages in %s\n", (unsigned long long) (head - tail), path);
+    if (torn)
+        fprintf(stderr, "%llu of them torn, and skipped\n", (unsigned long long) torn);
+}
+
+static size_t mqtt_put_length(unsigned char *p, size_t length) {
+    size_t n = 0;
+    do {
+        p[n] = length & 0x7f;
+        length >>= 7;
+        if (length)
+            p[n] |= 0x80;
+        n++;
+    } while (length);
+    return n;
+}
+
+static size_t mqtt_put_string(unsigned char *p, const char *s) {
+    size_t length = strlen(s);
+    p[0] = length >> 8;
+    p[1] = length & 0xff;
+    memcpy(p + 2, s, length);
+    return length + 2;
+}
+
+static int mqtt_write(struct mqtt_client *c, const unsigned char *p, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(c->fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        length -= n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &c->last_sent);
+    return 1;
+}
+
+static void mqtt_wait_for_reply(struct mqtt_client *c) {
+    if (!c->waiting) {
+        c->waiting = 1;
+        clock_gettime(CLOCK_MONOTONIC, &c->waiting_since);
+    }
+}
+
+static void mqtt_disconnect(struct mqtt_client *c, const char *why) {
+    char buffer[80];
+    time_t now = time(NULL);
+    strftime(buffer, 80, "%x,%X", localtime(&now));
+    fprintf(stderr, "%s MQTT connection to %s:%s lost (%s)\n", buffer, c->host, c->port, why);
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Connects and waits for the CONNACK.  Returns non zero once the broker has accepted the connection.
+static int mqtt_connect(struct mqtt_client *c) {
+    static const char *const refusals[] = { "", "protocol version", "client id", "server unavailable",
+                                            "bad user name or password", "not authorized" };
+    unsigned char packet[1024];
+    unsigned char reply[4];
+    size_t body = 10 + 2 + strlen(c->client_id);
+    size_t n = 0;
+    int got = 0;
+    struct timeval timeout = { MQTT_SEND_TIMEOUT, 0 };
+    int one = 1;
+
+    if (c->user)
+        body += 2 + strlen(c->user);
+    if (c->user && c->password)
+        body += 2 + strlen(c->password);
+    if (body > sizeof(packet) - 5) {
+        fprintf(stderr, "\nMQTT user name and password are too long\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((c->fd = connect_tcp(c->host, c->port)) < 0)
+        return 0;
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    packet[n++] = MQTT_CONNECT;
+    n += mqtt_put_length(packet + n, body);
+    n += mqtt_put_string(packet + n, "MQTT");
+    packet[n++] = 4;                                    // Protocol level 3.1.1
+    packet[n++] = 0x02 | (c->user ? 0x80 : 0) | ((c->user && c->password) ? 0x40 : 0);  // Clean session
+    packet[n++] = c->keepalive >> 8;
+    packet[n++] = c->keepalive & 0xff;
+    n += mqtt_put_string(packet + n, c->client_id);
+    if (c->user)
+        n += mqtt_put_string(packet + n, c->user);
+    if (c->user && c->password)
+        n += mqtt_put_string(packet + n, c->password);
+    if (!mqtt_write(c, packet, n)) {
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+
+    while (got < (int) sizeof(reply)) {
+        struct pollfd p = { c->fd, POLLIN, 0 };
+        ssize_t r;
+        if (poll(&p, 1, MQTT_CONNACK_TIMEOUT_MS) <= 0)
+            break;
+        if ((r = read(c->fd, reply + got, sizeof(reply) - got)) <= 0)
+            break;
+        got += r;
+    }
+    if ((got < (int) sizeof(reply)) || (reply[0] != MQTT_CONNACK) || (reply[3] != 0)) {
+        if ((got == (int) sizeof(reply)) && (reply[0] == MQTT_CONNACK) && (reply[3] < 6))
+            fprintf(stderr, "MQTT broker %s:%s refused the connection: %s\n", c->host, c->port, refusals[reply[3]]);
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+    c->in_length = 0;
+    c->batch_length = 0;
+    c->waiting = 0;
+    c->ping_outstanding = 0;
+    return 1;
+}
+
+static void mqtt_published(struct mqtt_client *c, const struct mqtt_message *m) {
+    double latency;
+    clock_gettime(CLOCK_MONOTONIC, &c->last_published);
+    if (c->published++ == 0)
+        c->first_published = (m->seq < c->first_seq) ? c->last_published : m->validated;
+    if (m->seq < c->first_seq)
+        return;                         // From an earlier run, its validated time means nothing now
+    latency = elapsed_seconds(&m->validated);
+    c->latency_count++;
+    c->latency_sum += latency;
+    if (latency > c->latency_max)
+        c->latency_max = latency;
+}
+
+// Moves the tail to tail, past any torn records after it
+static void mqtt_set_tail(struct mqtt_client *c, uint64_t tail) {
+    while ((tail != c->sent) && (c->queue[tail % c->capacity].length < 0))
+        tail++;
+    atomic_store_explicit(&c->tail, tail, memory_order_release);
+    if (c->store)
+        c->store->acked = tail;
+}
+
+// Writes out the batch.  At QoS 0 that is as far as a message goes, so everything sent is done with.
+static int mqtt_flush(struct mqtt_client *c) {
+    uint64_t seq;
+    if ((c->batch_length > 0) && !mqtt_write(c, c->batch, c->batch_length))
+        return 0;
+    c->batch_length = 0;
+    if (!c->qos) {
+        for (seq = atomic_load_explicit(&c->tail, memory_order_relaxed); seq != c->sent; seq++)
+            if (c->queue[seq % c->capacity].length >= 0)
+                mqtt_published(c, &c->queue[seq % c->capacity]);
+        mqtt_set_tail(c, c->sent);
+    }
+    return 1;
+}
+
+// Adds message seq to the batch, with packet id seq % 65535 + 1 (0 isn't allowed) so that PUBACKs, which come
+// back in order, can be matched against the tail
+static int mqtt_batch_publish(struct mqtt_client *c, uint64_t seq, int dup) {
+    const struct mqtt_message *m = &c->queue[seq % c->capacity];
+    unsigned char *packet;
+    size_t base_length = strlen(c->topic);
+    size_t subtopic_length = strnlen(m->subtopic, sizeof(m->subtopic));
+    size_t topic_length = base_length + (subtopic_length ? 1 + subtopic_length : 0);
+    size_t n = 0;
+    if (m->length < 0)
+        return 1;
+    if ((c->batch_length + 5 + 2 + topic_length + 2 + m->length > sizeof(c->batch)) && !mqtt_flush(c))
+        return 0;
+    packet = c->batch + c->batch_length;
+    packet[n++] = MQTT_PUBLISH | (dup ? 0x08 : 0) | (c->qos << 1);
+    n += mqtt_put_length(packet + n, 2 + topic_length + (c->qos ? 2 : 0) + m->length);
+    packet[n++] = topic_length >> 8;
+    packet[n++] = topic_length & 0xff;
+    memcpy(packet + n, c->topic, base_length);
+    n += base_length;
+    if (subtopic_length) {
+        packet[n++] = '/';
+        memcpy(packet + n, m->subtopic, subtopic_length);
+        n += subtopic_length;
+    }
+    if (c->qos) {
+        uint16_t id = seq % 65535 + 1;
+        packet[n++] = id >> 8;
+        packet[n++] = id & 0xff;
+        mqtt_wait_for_reply(c);
+    }
+    memcpy(packet + n, m->payload, m->length);
+    c->batch_length += n + m->length;
+    return 1;
+}
+
+// Reads whatever the broker sent.  Returns zero when the connection is gone.
+static int mqtt_read(struct mqtt_client *c) {
+    ssize_t n = read(c->fd, c->in + c->in_length, sizeof(c->in) - c->in_length);
+    if (n <= 0)
+        return (n < 0) && ((errno == EINTR) || (errno == EAGAIN));
+    c->in_length += n;
+    // PUBACK and PINGRESP are all a publisher gets, and both are short enough for the length to be one byte
+    while ((c->in_length >= 2) && (c->in_length >= 2 + c->in[1])) {
+        int length = 2 + c->in[1];
+        uint64_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+        if (((c->in[0] & 0xf0) == MQTT_PUBACK) && (length == 4) && (tail != c->sent) &&
+                (((c->in[2] << 8) | c->in[3]) == (int) (tail % 65535 + 1))) {
+            mqtt_published(c, &c->queue[tail % c->capacity]);
+            mqtt_set_tail(c, tail + 1);
+        } else if ((c->in[0] & 0xf0) == MQTT_PINGRESP)
+            c->ping_outstanding = 0;
+        memmove(c->in, c->in + length, c->in_length - length);
+        c->in_length -= length;
+        c->waiting = c->ping_outstanding || (atomic_load_explicit(&c->tail, memory_order_relaxed) != c->sent);
+        clock_gettime(CLOCK_MONOTONIC, &c->waiting_since);
+    }
+    if (c->in_length == sizeof(c->in))
+        return 0;                       // Not something a broker sends a publisher
+    return 1;
+}
+
+// Waits up to seconds for mqtt_publish() or mqtt_stop(), and for the broker when connected.  Returns zero when the
+// connection failed.
+static int mqtt_wait(struct mqtt_client *c, double seconds) {
+    struct pollfd p[2] = { { c->wake[0], POLLIN, 0 }, { c->fd, POLLIN, 0 } };
+    char drain[64];
+    int ready = poll(p, (c->fd < 0) ? 1 : 2, (seconds > 0) ? (int) (seconds * 1000) + 1 : 0);
+    if (ready <= 0)
+        return 1;
+    if (p[0].revents)
+        while (read(c->wake[0], drain, sizeof(drain)) > 0)
+            ;
+    if ((c->fd >= 0) && p[1].revents && !mqtt_read(c)) {
+        mqtt_disconnect(c, "closed by the broker");
+        return 0;
+    }
+    return 1;
+}
+
+static void mqtt_store_sync(struct mqtt_client *c) {
+    if (c->store)
+        msync(c->store, c->store_length, MS_SYNC);
+    clock_gettime(CLOCK_MONOTONIC, &c->last_sync);
+}
+
+void *mqtt_thread(void *arg) {
+    struct mqtt_client *c = arg;
+    double backoff = MQTT_BACKOFF_MIN;
+    struct timespec stopping;
+    int draining = 0;
+
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&c->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+        if (!draining && atomic_load(&c->done)) {
+            draining = 1;
+            clock_gettime(CLOCK_MONOTONIC, &stopping);
+        }
+        if (draining && ((tail == head) || (elapsed_seconds(&stopping) > MQTT_DRAIN_TIMEOUT)))
+            break;
+        if (elapsed_seconds(&c->last_sync) >= MQTT_STORE_SYNC_SECONDS)
+            mqtt_store_sync(c);
+
+        if (c->fd < 0) {
+            if (!mqtt_connect(c)) {
+                double wait = backoff;
+                if (draining)
+                    break;
+                if (!c->failing)
+                    fprintf(stderr, "Can't connect to MQTT broker %s:%s, retrying\n", c->host, c->port);
+                c->failing = 1;
+                backoff = (backoff * 2 < MQTT_BACKOFF_MAX) ? backoff * 2 : MQTT_BACKOFF_MAX;
+                // Wait out the backoff, but not for the queue: it can hold on until there's a connection
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                while (!atomic_load(&c->done) && (elapsed_seconds(&start) < wait))
+                    mqtt_wait(c, wait - elapsed_seconds(&start));
+                continue;
+            }
+            if (c->failing)
+                fprintf(stderr, "Connected to MQTT broker %s:%s\n", c->host, c->port);
+            if (c->connections++ > 0)
+                c->reconnects++;
+            c->failing = 0;
+            backoff = MQTT_BACKOFF_MIN;
+            c->sent = tail;             // Anything unacknowledged goes again
+        }
+
+        while ((c->sent != head) && (!c->qos || (c->sent - tail < MQTT_MAX_INFLIGHT))) {
+            if (!mqtt_batch_publish(c, c->sent, c->sent < c->written))
+                break;
+            if (++c->sent > c->written)
+                c->written = c->sent;
+        }
+        if (!mqtt_flush(c)) {
+            mqtt_disconnect(c, "write failed");
+            continue;
+        }
+        if (c->qos)
+            mqtt_set_tail(c, tail);     // Past torn records that nothing will acknowledge
+
+        if (c->waiting && (elapsed_seconds(&c->waiting_since) >= c->keepalive)) {
+            mqtt_disconnect(c, "no reply from the broker");
+            continue;
+        }
+        double idle = elapsed_seconds(&c->last_sent);
+        if (idle >= c->keepalive) {
+            unsigned char ping[2] = { MQTT_PINGREQ, 0 };
+            if (!mqtt_write(c, ping, sizeof(ping))) {
+                mqtt_disconnect(c, "write failed");
+                continue;
+            }
+            c->ping_outstanding = 1;
+            mqtt_wait_for_reply(c);
+            idle = 0;
+        }
+        double until = c->keepalive - idle;
+        if (c->waiting && (c->keepalive - elapsed_seconds(&c->waiting_since) < until))
+            until = c->keepalive - elapsed_seconds(&c->waiting_since);
+        if (draining && (until > 0.1))
+            until = 0.1;
+        mqtt_wait(c, until);
+    }
+
+    if (c->fd >= 0) {
+        unsigned char disconnect[2] = { MQTT_DISCONNECT, 0 };
+        mqtt_write(c, disconnect, sizeof(disconnect));
+        close(c->fd);
+        c->fd = -1;
+    }
+    mqtt_store_sync(c);
+    return NULL;
+}
+
+// Queues a message for topic/subtopic (just topic if subtopic is empty), from the output stage.  received is the
+// unix time it is about, validated when it was ready to go, for the latency.
+void mqtt_queue(struct mqtt_client *c, const char *subtopic, time_t received, const struct timespec *validated,
+                const char *payload) {
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    struct mqtt_message *m;
+    if (head - atomic_load_explicit(&c->tail, memory_order_acquire) == c->capacity) {
+        atomic_fetch_add_explicit(&c->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    m = &c->queue[head % c->capacity];
+    memset(m, 0, sizeof(*m));
+    m->seq = head;
+    m->received = received;
+    m->validated = *validated;
+    strncpy(m->subtopic, subtopic, sizeof(m->subtopic) - 1);
+    m->length = snprintf(m->payload, sizeof(m->payload), "%s", payload);
+    if (m->length >= (int) sizeof(m->payload))
+        m->length = sizeof(m->payload) - 1;
+    m->crc = mqtt_record_crc(m);
+    atomic_store_explicit(&c->head, head + 1, memory_order_release);
+    if (write(c->wake[1], "", 1) < 0) {
+        // Pipe full: mqtt_thread() has wakeups pending already
+    }
+}
+
+// Queues a reading
+void mqtt_publish(struct mqtt_client *c, const struct efergy_frame *frame, double watts) {
+    char payload[MQTT_PAYLOAD_SIZE];
+    snprintf(payload, sizeof(payload), "{\"consumption_watts\": %.2f, \"uid\": %d, \"time\": %lld}",
+             watts, frame->bytes[UID_BYTE], (long long) frame->received);
+    mqtt_queue(c, "", frame->received, &frame->validated, payload);
+}
+
+void mqtt_start(struct mqtt_client *c) {
+    if (c->queue == NULL) {
+        c->capacity = MQTT_QUEUE_ENTRIES;
+        if ((c->queue = calloc(c->capacity, sizeof(struct mqtt_message))) == NULL) {
+            fprintf(stderr, "\nOut of memory for the MQTT queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(c->client_id, sizeof(c->client_id), "EfergyRPI_log-%d", (int) getpid());
+    if ((pipe(c->wake) != 0) || (fcntl(c->wake[0], F_SETFL, O_NONBLOCK) != 0) ||
+            (fcntl(c->wake[1], F_SETFL, O_NONBLOCK) != 0)) {
+        fprintf(stderr, "\nFailed to create the MQTT wakeup pipe\n");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &c->last_sent);
+    c->last_sync = c->last_sent;
+    if (pthread_create(&c->thread, NULL, mqtt_thread, c) != 0) {
+        fprintf(stderr, "\nFailed to start the MQTT thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Gives the queue up to MQTT_DRAIN_TIMEOUT seconds to empty (what doesn't stays in the store, if there is one),
+// disconnects and, with report set, puts the statistics on stderr in --replay's key=value form
+void mqtt_stop(struct mqtt_client *c, int report) {
+    atomic_store(&c->done, 1);
+    if (write(c->wake[1], "", 1) < 0) {
+        // Pipe full: mqtt_thread() will see done anyway
+    }
+    pthread_join(c->thread, NULL);
+    close(c->wake[0]);
+    close(c->wake[1]);
+    if (report) {
+        double seconds = c->published ? (c->last_published.tv_sec - c->first_published.tv_sec) +
+                         (c->last_published.tv_nsec - c->first_published.tv_nsec) / 1e9 : 0;
+        uint64_t unsent = atomic_load(&c->head) - atomic_load(&c->tail);
+        fprintf(stderr, "mqtt: published=%llu dropped=%llu unsent=%llu reconnects=%llu messages_per_s=%.1f "
+                "latency_mean_us=%.1f latency_max_us=%.1f\n", (unsigned long long) c->published,
+                (unsigned long long) atomic_load(&c->dropped), (unsigned long long) unsent,
+                (unsigned long long) c->reconnects, (seconds > 0) ? c->published / seconds : 0.0,
+                c->latency_count ? c->latency_sum / c->latency_count * 1e6 : 0.0, c->latency_max * 1e6);
+    }
+    if (c->store)
+        munmap(c->store, c->store_length);
+    else
+        free(c->queue);
+}
+
+// -----------------------------------------------------------------------------
+// Binary log
+//
+// With --log-format binary the <filename> log is written as fixed width 64 byte records instead of CSV lines:
+// UTC and monotonic nanosecond timestamps, the transmitter id, the raw frame bytes, the watts and how the frame
+// checked out.  The UTC time is the sample clock's (see struct sample_clock), so a backfilled capture logs when its
+// frames were received.  No localtime()/strftime() per frame, no locale or DST ambiguity, and efergy_logtool can
+// mmap years of it and answer range and aggregate queries, or turn it back into CSV, at disk speed.
+//
+// The file is a BINLOG_BLOCK_SIZE header block followed by blocks of BINLOG_BLOCK_RECORDS records.  Records are
+// gathered in the block being filled, and the whole block is written (pwrite at its own offset, so the file only
+// ever grows a block at a time) every SAMPLES_TO_FLUSH records and when it fills: a group commit in place of the
+// CSV logger's fflush.  The unfilled end of a block is zeros, and a record only counts if its crc checks out, so a
+// reader stops cleanly at the end of the data or at a block torn by a crash.  Reopening the file carries on in its
+// last block.  efergy_logtool.c has its own copy of these structs, and the two must match.
+#define BINLOG_MAGIC            "EfergyL1"
+#define BINLOG_BLOCK_SIZE       4096
+#define BINLOG_RECORD_SIZE      64
+#define BINLOG_BLOCK_RECORDS    (BINLOG_BLOCK_SIZE / BINLOG_RECORD_SIZE)
+
+#define BINLOG_RESCUED          0x01    /* Checked out with an alternate decode */
+#define BINLOG_NEGATIVE_PULSES  0x02
+
+struct binlog_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t record_size;
+    int64_t created_utc_ns;
+};
+
+struct binlog_record {
+    int64_t utc_ns;             // Sample clock time of the preamble, anchored to the wall clock or --start
+    int64_t monotonic_ns;       // CLOCK_MONOTONIC when it was checked, orders records across clock steps (per boot)
+    double watts;
+    uint64_t seq;               // Record number in the file
+    uint16_t input;             // Index of the -i input
+    uint8_t uid;
+    uint8_t valid_type;         // enum sensor_type
+    uint8_t flags;              // BINLOG_RESCUED, BINLOG_NEGATIVE_PULSES
+    uint8_t bytecount;
+    uint8_t bytes[FRAMEBYTECOUNT];
+    uint8_t reserved[15];
+    uint16_t crc;               // compute_crc() of the record, which leaves out its last two bytes: this
+};
+
+_Static_assert(sizeof(struct binlog_record) == BINLOG_RECORD_SIZE, "binlog_record must be 64 bytes");
+
+struct binary_log {
+    int fd;
+    off_t block_offset;         // Where the block being filled goes in the file
+    int count;                  // Records in it
+    int unwritten;              // Records added since it was last written
+    uint64_t seq;
+    struct binlog_record block[BINLOG_BLOCK_RECORDS];
+};
+
+static int binlog_record_ok(const struct binlog_record *r) {
+    return (r->valid_type != SENSOR_ANY) &&
+           (r->crc == compute_crc((const unsigned char *) r, sizeof(*r)));
+}
+
+// Opens path for appending, creating it if need be.  Returns NULL if it can't, or if it isn't a binary log.
+struct binary_log *binlog_open(const char *path) {
+    struct binary_log *log = calloc(1, sizeof(*log));
+    struct stat st;
+    if ((log == NULL) || ((log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) ||
+            (fstat(log->fd, &st) != 0)) {
+        free(log);
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        unsigned char block[BINLOG_BLOCK_SIZE];
+        struct binlog_header *header = (struct binlog_header *) block;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        memset(block, 0, sizeof(block));
+        memcpy(header->magic, BINLOG_MAGIC, sizeof(header->magic));
+        header->block_size = BINLOG_BLOCK_SIZE;
+        header->record_size = BINLOG_RECORD_SIZE;
+        header->created_utc_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+        if (pwrite(log->fd, block, sizeof(block), 0) != sizeof(block)) {
+            close(log->fd);
+            free(log);
+            return NULL;
+        }
+        log->block_offset = BINLOG_BLOCK_SIZE;
+        return log;
+    }
+
+    struct binlog_header header;
+    if ((pread(log->fd, &header, sizeof(header), 0) != sizeof(header)) ||
+            (memcmp(header.magic, BINLOG_MAGIC, sizeof(header.magic)) != 0) ||
+            (header.block_size != BINLOG_BLOCK_SIZE) || (header.record_size != BINLOG_RECORD_SIZE)) {
+        close(log->fd);
+        free(log);
+        return NULL;
+    }
+    // Carry on in the last block, after its last good record.  A partial block (a crash while the file grew)
+    // reads as zeros past what made it.
+    log->block_offset = (st.st_size - 1) / BINLOG_BLOCK_SIZE * BINLOG_BLOCK_SIZE;
+    if (log->block_offset < BINLOG_BLOCK_SIZE)
+        log->block_offset = BINLOG_BLOCK_SIZE;
+    if (pread(log->fd, log->block, sizeof(log->block), log->block_offset) < 0)
+        memset(log->block, 0, sizeof(log->block));
+    while ((log->count < BINLOG_BLOCK_RECORDS) && binlog_record_ok(&log->block[log->count]))
+        log->count++;
+    memset(&log->block[log->count], 0, (BINLOG_BLOCK_RECORDS - log->count) * sizeof(struct binlog_record));
+    // block_offset is at least BINLOG_BLOCK_SIZE here, so the record count before this block can't be negative
+    log->seq = (log->count > 0) ? log->block[log->count - 1].seq + 1 :
+               (uint64_t) (log->block_offset - BINLOG_BLOCK_SIZE) / BINLOG_RECORD_SIZE;
+    if (log->count == BINLOG_BLOCK_RECORDS) {
+        log->block_offset += BINLOG_BLOCK_SIZE;
+        log->count = 0;
+        memset(log->block, 0, sizeof(log->block));
+    }
+    return log;
+}
+
+// Writes the block being filled, and moves on to the next one once it is full
+void binlog_flush(struct binary_log *log) {
+    if (log->unwritten == 0)
+        return;
+    if (pwrite(log->fd, log->block, sizeof(log->block), log->block_offset) != sizeof(log->block))
+        fprintf(stderr, "Failed to write to the binary log: %s\n", strerror(errno));
+    log->unwritten = 0;
+    if (log->count == BINLOG_BLOCK_RECORDS) {
+        log->block_offset += BINLOG_BLOCK_SIZE;
+        log->count = 0;
+        memset(log->block, 0, sizeof(log->block));
+    }
+}
+
+// Also the record of --format binary
+void binlog_fill(struct binlog_record *r, const struct efergy_frame *frame, double watts, uint64_t seq) {
+    memset(r, 0, sizeof(*r));
+    r->utc_ns = (int64_t) frame->received * 1000000000 + frame->received_nsec;
+    r->monotonic_ns = (int64_t) frame->validated.tv_sec * 1000000000 + frame->validated.tv_nsec;
+    r->watts = watts;
+    r->seq = seq;
+    r->input = frame->input;
+    r->uid = frame->bytes[UID_BYTE];
+    r->valid_type = frame->valid_type;
+    r->flags = (frame->rescued ? BINLOG_RESCUED : 0) | (frame->positive_pulses ? 0 : BINLOG_NEGATIVE_PULSES);
+    r->bytecount = frame->bytecount;
+    memcpy(r->bytes, frame->bytes, sizeof(r->bytes));
+    r->crc = compute_crc((const unsigned char *) r, sizeof(*r));
+}
+
+void binlog_append(struct binary_log *log, const struct efergy_frame *frame, double watts) {
+    binlog_fill(&log->block[log->count++], frame, watts, log->seq++);
+    if ((++log->unwritten == SAMPLES_TO_FLUSH) || (log->count == BINLOG_BLOCK_RECORDS))
+        binlog_flush(log);
+}
+
+void binlog_close(struct binary_log *log) {
+    binlog_flush(log);
+    close(log->fd);
+    free(log);
+}
+
+// -----------------------------------------------------------------------------
+// Energy aggregation
+//
+// With --windows every transmitter's readings are reduced in the decoder, for sites that can't run InfluxDB and
+// Grafana to do it: energy (kWh) by trapezoidal integration, and the count, minimum, mean and maximum watts over
+// fixed windows (1 minute, 5 minutes and an hour by default) aligned to UTC.  Each reading costs O(1) per window:
+// a window's figures are running sums, reported and reset when the window closes.
+//
+// Energy joins successive readings of a transmitter with straight lines, so a missed frame or two (transmitters
+// send every 6 to 20 seconds) is bridged by interpolation.  A gap longer than ENERGY_MAX_GAP_SECONDS (the
+// transmitter out of range, the decoder stopped) counts as nothing rather than being guessed at.  Windows close as
+// soon as any reading past their end arrives, rather than waiting to see how each transmitter's line carries on:
+// each transmitter's energy up to the boundary is its last reading held, and the next reading carries on from
+// there.  Nothing closes while no readings arrive at all, and windows still open at exit are not reported.
+#define ENERGY_MAX_WINDOWS      4
+#define ENERGY_DEFAULT_WINDOWS  "1m,5m,1h"
+#define ENERGY_MAX_GAP_SECONDS  60
+
+struct energy_window {
+    uint32_t count;
+    double min, max, sum;
+    double joules;
+};
+
+struct energy_transmitter {
+    int64_t last_ns;            // UTC of the last reading, 0 before the first
+    double last_watts;
+    int64_t integrated_ns;      // Energy is counted up to here
+    double integrated_watts;    // ... where the line stood at
+    double total_joules;        // Since the decoder started
+    struct energy_window windows[ENERGY_MAX_WINDOWS];
+};
+
+// A closed window, as reported
+struct energy_report {
+    const char *label;          // "1m", "5m", "1h" ...
+    int seconds;
+    int uid;
+    time_t start;               // Unix time the window began
+    uint32_t count;
+    double min, mean, max;      // Watts, 0 if there were no readings (only energy carried over a gap)
+    double kwh;
+    double total_kwh;
+};
+
+typedef void (*energy_report_sink)(void *arg, const struct energy_report *report);
+
+struct energy_aggregates {
+    int window_count;
+    int seconds[ENERGY_MAX_WINDOWS];
+    char labels[ENERGY_MAX_WINDOWS][8];
+    int64_t window_end_ns[ENERGY_MAX_WINDOWS];  // Of the window open now, 0 before the first reading
+    int64_t latest_ns;                          // Latest reading of any transmitter
+    energy_report_sink sink;
+    void *sink_arg;
+    struct energy_transmitter transmitters[256];
+};
+
+// Sets up the windows from --windows' list, like 1m,5m,1h.  Returns zero if the list doesn't parse.
+int energy_init(struct energy_aggregates *e, const char *list, energy_report_sink sink, void *sink_arg) {
+    memset(e, 0, sizeof(*e));
+    e->sink = sink;
+    e->sink_arg = sink_arg;
+    while (*list) {
+        char *end;
+        long seconds = strtol(list, &end, 10);
+        if (*end == 'm')
+            seconds *= 60;
+        else if (*end == 'h')
+            seconds *= 3600;
+        else if (*end == 'd')
+            seconds *= 86400;
+        else if (*end != 's')
+            return 0;
+        if ((end == list) || (seconds < 1) || (seconds > 86400) || (e->window_count == ENERGY_MAX_WINDOWS))
+            return 0;
+        e->seconds[e->window_count] = seconds;
+        snprintf(e->labels[e->window_count], sizeof(e->labels[0]), "%.*s", (int) (end + 1 - list), list);
+        e->window_count++;
+        list = end + 1;
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return 0;
+    }
+    return e->window_count > 0;
+}
+
+static void energy_add_joules(struct energy_transmitter *t, int window_count, int64_t to_ns, double to_watts) {
+    double joules = (t->integrated_watts + to_watts) / 2 * ((to_ns - t->integrated_ns) / 1e9);
+    int w;
+    for (w = 0; w < window_count; w++)
+        t->windows[w].joules += joules;
+    t->total_joules += joules;
+    t->integrated_ns = to_ns;
+    t->integrated_watts = to_watts;
+}
+
+// Closes windows w ending at boundary_ns: brings every transmitter's energy up to the boundary, reports the
+// windows with something in them and starts the next ones
+static void energy_close(struct energy_aggregates *e, int w, int64_t boundary_ns) {
+    int64_t max_gap_ns = (int64_t) ENERGY_MAX_GAP_SECONDS * 1000000000;
+    int uid;
+    for (uid = 0; uid < 256; uid++) {
+        struct energy_transmitter *t = &e->transmitters[uid];
+        struct energy_window *window = &t->windows[w];
+        if (t->last_ns && (boundary_ns - t->last_ns <= max_gap_ns) && (t->integrated_ns < boundary_ns))
+            energy_add_joules(t, e->window_count, boundary_ns, t->last_watts);
+        if ((window->count == 0) && (window->joules == 0))
+            continue;
+        struct energy_report report;
+        report.label = e->labels[w];
+        report.seconds = e->seconds[w];
+        report.uid = uid;
+        report.start = boundary_ns / 1000000000 - e->seconds[w];
+        report.count = window->count;
+        report.min = window->min;
+        report.mean = window->count ? window->sum / window->count : 0;
+        report.max = window->max;
+        report.kwh = window->joules / 3.6e6;
+        report.total_kwh = t->total_joules / 3.6e6;
+        e->sink(e->sink_arg, &report);
+        memset(window, 0, sizeof(*window));
+    }
+}
+
+// Adds a transmitter's reading, taken at utc_ns, closing (and reporting) any windows that ended before it
+void energy_add(struct energy_aggregates *e, int uid, int64_t utc_ns, double watts) {
+    int64_t max_gap_ns = (int64_t) ENERGY_MAX_GAP_SECONDS * 1000000000;
+    struct energy_transmitter *t = &e->transmitters[uid];
+    int w;
+
+    // Boundaries passed since the last reading, in time order.  A window that comes and goes with nobody's
+    // energy still running (a long silence) is skipped over.
+    for (;;) {
+        int64_t boundary_ns = INT64_MAX;
+        for (w = 0; w < e->window_count; w++)
+            if (e->window_end_ns[w] && (e->window_end_ns[w] < boundary_ns))
+                boundary_ns = e->window_end_ns[w];
+        if (boundary_ns > utc_ns)
+            break;
+        for (w = 0; w < e->window_count; w++) {
+            if (e->window_end_ns[w] != boundary_ns)
+                continue;
+            energy_close(e, w, boundary_ns);
+            e->window_end_ns[w] += (int64_t) e->seconds[w] * 1000000000;
+            if (e->window_end_ns[w] - max_gap_ns > e->latest_ns)
+                e->window_end_ns[w] = 0;
+        }
+    }
+    for (w = 0; w < e->window_count; w++) {
+        int64_t length_ns = (int64_t) e->seconds[w] * 1000000000;
+        if (e->window_end_ns[w] == 0)
+            e->window_end_ns[w] = (utc_ns / length_ns + 1) * length_ns;
+    }
+
+    // Readings out of order (several inputs, or the clock stepped back) still count, just not for energy
+    int64_t gap_ns = utc_ns - t->last_ns;
+    if (t->last_ns && (gap_ns > 0) && (gap_ns <= max_gap_ns) && (utc_ns > t->integrated_ns))
+        energy_add_joules(t, e->window_count, utc_ns, watts);
+    else if (!t->last_ns || (gap_ns > max_gap_ns)) {
+        t->integrated_ns = utc_ns;
+        t->integrated_watts = watts;
+    }
+    for (w = 0; w < e->window_count; w++) {
+        struct energy_window *window = &t->windows[w];
+        if ((window->count == 0) || (watts < window->min))
+            window->min = watts;
+        if ((window->count == 0) || (watts > window->max))
+            window->max = watts;
+        window->sum += watts;
+        window->count++;
+    }
+    if (utc_ns > t->last_ns) {
+        t->last_ns = utc_ns;
+        t->last_watts = watts;
+    }
+    if (utc_ns > e->latest_ns)
+        e->latest_ns = utc_ns;
+}
+
+// -----------------------------------------------------------------------------
+// Output stream
+//
+// At debug level 0 stdout carries one record per valid reading, in --format:
+//  text    the original "date,time,watts" line (plus the input with -i), whose date follows the locale
+//  json    one JSON object per line: {"utc_ns": ..., "uid": 34, "watts": 1320.000, "check": "crc", ...}
+//  binary  a native byte order uint32_t length followed by a struct binlog_record (see Binary log), with seq
+//          counting the records on the stream
+// Consumers can then take readings as they are instead of scraping and re-parsing the text.  With --windows the
+// text stream carries the window reports instead of the readings, as it always has, the json stream carries both
+// (window reports have a "window" member) and the binary stream only the readings.
+//
+// --socket path serves the same stream (at any debug level) on a unix socket, to as many as SUBSCRIBER_MAX local
+// consumers at once: an MQTT bridge, a logger and a dashboard can share one decoder.  Each subscriber has its own
+// SUBSCRIBER_BUFFER_SIZE buffer.  The output stage appends each record to every buffer and sends what it can
+// without waiting, fanout_thread() sends the rest as the sockets drain and looks after connections.  A subscriber
+// too slow to keep up loses whole records, counted in --stats, and never holds up the others or the decoder.
+#define SUBSCRIBER_MAX          16
+#define SUBSCRIBER_BUFFER_SIZE  65536
+#define STREAM_RECORD_SIZE      512
+
+enum output_format {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_BINARY
+};
+
+static const char *const format_names[] = { "text", "json", "binary" };
+
+struct subscriber {
+    int fd;                     // -1 for a free slot
+    int broken;                 // Send failed, for fanout_thread() to close
+    size_t length;              // Bytes waiting in buffer
+    char buffer[SUBSCRIBER_BUFFER_SIZE];
+};
+
+struct fanout {
+    const char *path;
+    int listen_fd;
+    int wake[2];                // Pipe that fanout_publish() and fanout_stop() nudge fanout_thread() through
+    int done;
+    pthread_mutex_t lock;       // Around the subscribers
+    pthread_t thread;
+    struct subscriber subscribers[SUBSCRIBER_MAX];
+};
+
+static void fanout_wake(struct fanout *f) {
+    if (write(f->wake[1], "", 1) < 0) {
+        // Pipe full: fanout_thread() is awake anyway
+    }
+}
+
+// Sends as much of the subscriber's buffer as its socket takes without blocking.  Call with the lock held.
+static void subscriber_send(struct subscriber *s) {
+    size_t sent = 0;
+    while ((sent < s->length) && !s->broken) {
+        ssize_t n = send(s->fd, s->buffer + sent, s->length - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0)
+            sent += n;
+        else if ((n < 0) && (errno == EINTR))
+            continue;
+        else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            break;
+        else
+            s->broken = 1;
+    }
+    if (s->broken)
+        s->length = 0;
+    else {
+        memmove(s->buffer, s->buffer + sent, s->length - sent);
+        s->length -= sent;
+    }
+}
+
+static void subscriber_close(struct subscriber *s) {
+    close(s->fd);
+    s->fd = -1;
+    s->broken = 0;
+    s->length = 0;
+    atomic_fetch_sub(&subscribers, 1);
+}
+
+// Hands a record to every subscriber, or counts it dropped for those with no room for it
+void fanout_publish(struct fanout *f, const void *record, size_t length) {
+    int i, pending = 0;
+    pthread_mutex_lock(&f->lock);
+    for (i = 0; i < SUBSCRIBER_MAX; i++) {
+        struct subscriber *s = &f->subscribers[i];
+        if ((s->fd < 0) || s->broken)
+            continue;
+        if (length > sizeof(s->buffer) - s->length) {
+            stat_add(&subscriber_records_dropped, 1);
+            pending = 1;
+            continue;
+        }
+        memcpy(s->buffer + s->length, record, length);
+        s->length += length;
+        subscriber_send(s);
+        if (s->length || s->broken)
+            pending = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    if (pending)
+        fanout_wake(f);
+}
+
+void *fanout_thread(void *arg) {
+    struct fanout *f = arg;
+    struct pollfd p[SUBSCRIBER_MAX + 2];
+    int slot[SUBSCRIBER_MAX + 2];
+    for (;;) {
+        int count = 2, i, done;
+        pthread_mutex_lock(&f->lock);
+        for (i = 0; i < SUBSCRIBER_MAX; i++) {
+            struct subscriber *s = &f->subscribers[i];
+            if ((s->fd >= 0) && s->broken)
+                subscriber_close(s);
+            if (s->fd < 0)
+                continue;
+            p[count].fd = s->fd;
+            p[count].events = POLLIN | (s->length ? POLLOUT : 0);
+            slot[count++] = i;
+        }
+        done = f->done;
+        if (done)
+            for (i = 2; i < count; i++)
+                subscriber_send(&f->subscribers[slot[i]]);  // One last go, without waiting
+        pthread_mutex_unlock(&f->lock);
+        if (done)
+            break;
+        p[0].fd = f->wake[0];
+        p[0].events = POLLIN;
+        p[1].fd = f->listen_fd;
+        p[1].events = POLLIN;
+        if (poll(p, count, -1) < 0)
+            continue;
+        if (p[0].revents) {
+            char drain[64];
+            while (read(f->wake[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+
+        pthread_mutex_lock(&f->lock);
+        for (i = 2; i < count; i++) {
+            struct subscriber *s = &f->subscribers[slot[i]];
+            if (p[i].revents & POLLIN) {
+                // Subscribers have nothing to say, so this is them going away (or saying something anyway)
+                char discard[256];
+                ssize_t n = recv(s->fd, discard, sizeof(discard), MSG_DONTWAIT);
+                if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+                    s->broken = 1;
+            }
+            if (p[i].revents & (POLLERR | POLLHUP))
+                s->broken = 1;
+            if ((p[i].revents & POLLOUT) && !s->broken)
+                subscriber_send(s);
+        }
+        if (p[1].revents & POLLIN) {
+            int fd = accept(f->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                for (i = 0; (i < SUBSCRIBER_MAX) && (f->subscribers[i].fd >= 0); i++)
+                    ;
+                if (i == SUBSCRIBER_MAX)
+                    close(fd);
+                else {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    f->subscribers[i].fd = fd;
+                    atomic_fetch_add(&subscribers, 1);
+                }
+            }
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    return NULL;
+}
+
+// Starts serving the stream on the unix socket path.  Returns NULL if it can't.
+struct fanout *fanout_start(const char *path) {
+    struct sockaddr_un addr;
+    struct fanout *f;
+    int i;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if ((strlen(path) >= sizeof(addr.sun_path)) || ((f = calloc(1, sizeof(*f))) == NULL))
+        return NULL;
+    strcpy(addr.sun_path, path);
+    f->path = path;
+    for (i = 0; i < SUBSCRIBER_MAX; i++)
+        f->subscribers[i].fd = -1;
+    pthread_mutex_init(&f->lock, NULL);
+    unlink(path);
+    f->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((f->listen_fd < 0) || (bind(f->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+            (listen(f->listen_fd, SUBSCRIBER_MAX) != 0) || (pipe(f->wake) != 0) ||
+            (fcntl(f->wake[0], F_SETFL, O_NONBLOCK) != 0) || (fcntl(f->wake[1], F_SETFL, O_NONBLOCK) != 0) ||
+            (pthread_create(&f->thread, NULL, fanout_thread, f) != 0)) {
+        if (f->listen_fd >= 0)
+            close(f->listen_fd);
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Sends subscribers what they will take straight away, and hangs up on them
+void fanout_stop(struct fanout *f) {
+    int i;
+    pthread_mutex_lock(&f->lock);
+    f->done = 1;
+    pthread_mutex_unlock(&f->lock);
+    fanout_wake(f);
+    pthread_join(f->thread, NULL);
+    for (i = 0; i < SUBSCRIBER_MAX; i++)
+        if (f->subscribers[i].fd >= 0)
+            subscriber_close(&f->subscribers[i]);
+    close(f->listen_fd);
+    close(f->wake[0]);
+    close(f->wake[1]);
+    unlink(f->path);
+    free(f);
+}
+
+// Writes s to buffer (at least 16 bytes) as a JSON string, quotes and all, cut short if it doesn't fit
+static void json_string(char *buffer, size_t size, const char *s) {
+    size_t length = 0;
+    buffer[length++] = '"';
+    for (; *s && (length + 9 < size); s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            buffer[length++] = '\\';
+            buffer[length++] = *s;
+        } else if ((unsigned char) *s < 0x20)
+            length += sprintf(buffer + length, "\\u%04x", (unsigned char) *s);
+        else
+            buffer[length++] = *s;
+    }
+    buffer[length++] = '"';
+    buffer[length] = '\0';
+}
+
+// Where frames are displayed and logged.  input_names is only set when there are several inputs, and then each
+// line also says which input the frame came from.
+struct frame_output {
+    int debug_level;
+    int loggingok;   // Logging on or off
+    int samplecount; // Counter for samples taken since last flush
+    FILE *fp;    // Log file handle
+    struct binary_log *binary;  // Instead of fp, with --log-format binary
+    const char *const *input_names;
+    const struct uid_table *uid_table;
+    struct mqtt_client *mqtt;   // NULL unless --mqtt
+    struct energy_aggregates *energy;   // NULL unless --windows
+    enum output_format format;
+    struct fanout *fanout;      // NULL unless --socket
+    uint64_t stream_seq;        // Records on the binary stream
+    time_t when_time;           // Second that when holds, as text
+    char when[80];
+};
+
+// The text format's date and time of t.  Frames come a few seconds apart at most, so only formatted again when
+// the second changes.
+static const char *output_when(struct frame_output *out, time_t t) {
+    if ((t != out->when_time) || (out->when[0] == '\0')) {
+        strftime(out->when, sizeof(out->when), "%x,%X", localtime(&t));
+        out->when_time = t;
+    }
+    return out->when;
+}
+
+// Puts a record of the stream on stdout (at debug level 0, where stdout is the stream) and to the subscribers
+void output_write(struct frame_output *out, const void *record, size_t length) {
+    if (out->debug_level == 0)
+        fwrite(record, 1, length, stdout);
+    if (out->fanout)
+        fanout_publish(out->fanout, record, length);
+}
+
+// Puts a valid reading on the stream
+void output_reading(struct frame_output *out, const struct efergy_frame *frame, double watts) {
+    char record[STREAM_RECORD_SIZE];
+    const char *input = out->input_names ? out->input_names[frame->input] : NULL;
+    int length;
+    if (out->format == FORMAT_BINARY) {
+        struct binlog_record r;
+        uint32_t size = sizeof(r);
+        binlog_fill(&r, frame, watts, out->stream_seq++);
+        memcpy(record, &size, sizeof(size));
+        memcpy(record + sizeof(size), &r, sizeof(r));
+        length = sizeof(size) + sizeof(r);
+    } else if (out->format == FORMAT_JSON) {
+        char hex[2 * FRAMEBYTECOUNT + 1] = "";
+        int i;
+        for (i = 0; (i < frame->bytecount) && (i < FRAMEBYTECOUNT); i++)
+            sprintf(hex + 2 * i, "%02x", frame->bytes[i]);
+        length = snprintf(record, sizeof(record), "{\"utc_ns\": %lld, \"uid\": %d, \"watts\": %.3f, \"check\": \"%s\", "
+                          "\"rescued\": %s, \"bytes\": \"%s\"",
+                          (long long) frame->received * 1000000000 + frame->received_nsec, frame->bytes[UID_BYTE], watts,
+                          (frame->valid_type == SENSOR_CRC) ? "crc" : "checksum", frame->rescued ? "true" : "false", hex);
+        if (input) {
+            char name[PATH_MAX / 16];
+            json_string(name, sizeof(name), input);
+            length += snprintf(record + length, sizeof(record) - length, ", \"input\": %s", name);
+        }
+        length += snprintf(record + length, sizeof(record) - length, "}\n");
+    } else if (out->energy)
+        return;     // The window reports instead
+    else if (input)
+        length = snprintf(record, sizeof(record), "%s,%f,%s\n", output_when(out, frame->received), watts, input);
+    else
+        length = snprintf(record, sizeof(record), "%s,%f\n", output_when(out, frame->received), watts);
+    if (length >= (int) sizeof(record))
+        length = sizeof(record) - 1;
+    output_write(out, record, length);
+}
+
+// Reports a closed energy window: on stdout as CSV (or text with -d), and with --mqtt on topic/<window>
+void output_energy_report(void *arg, const struct energy_report *r) {
+    struct frame_output *out = arg;
+    char buffer[80];
+    char record[STREAM_RECORD_SIZE];
+    int length = 0;
+    strftime(buffer, 80, "%x,%X", localtime(&r->start));
+    if (out->debug_level > 0)
+        printf("Window %s from %s  uid %d: %u readings  W min %.3f mean %.3f max %.3f  kWh %.6f, %.6f in all\n",
+               r->label, buffer, r->uid, r->count, r->min, r->mean, r->max, r->kwh, r->total_kwh);
+    if (out->format == FORMAT_TEXT)
+        length = snprintf(record, sizeof(record), "%s,%s,%d,%u,%f,%f,%f,%f,%f\n", buffer, r->label, r->uid, r->count,
+                          r->min, r->mean, r->max, r->kwh, r->total_kwh);
+    else if (out->format == FORMAT_JSON)
+        length = snprintf(record, sizeof(record), "{\"window\": \"%s\", \"uid\": %d, \"start\": %lld, \"seconds\": %d, "
+                          "\"count\": %u, \"min_watts\": %.3f, \"mean_watts\": %.3f, \"max_watts\": %.3f, \"kwh\": %.6f, "
+                          "\"total_kwh\": %.6f}\n", r->label, r->uid, (long long) r->start, r->seconds, r->count, r->min,
+                          r->mean, r->max, r->kwh, r->total_kwh);
+    if (length > 0)
+        output_write(out, record, (length < (int) sizeof(record)) ? length : (int) sizeof(record) - 1);
+    if (out->mqtt) {
+        char payload[MQTT_PAYLOAD_SIZE];
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        snprintf(payload, sizeof(payload), "{\"uid\": %d, \"start\": %lld, \"seconds\": %d, \"count\": %u, "
+                 "\"min_watts\": %.2f, \"mean_watts\": %.2f, \"max_watts\": %.2f, \"kwh\": %.6f, \"total_kwh\": %.6f}",
+                 r->uid, (long long) r->start, r->seconds, r->count, r->min, r->mean, r->max, r->kwh, r->total_kwh);
+        mqtt_queue(out->mqtt, r->label, r->start + r->seconds, &now, payload);
+    }
+}
+
+void display_frame_data(struct frame_output *out, const struct efergy_frame *frame) {
+    uint64_t start = stats_clock_ns();
+    const char *msg = frame->msg;
+    const unsigned char *bytes = frame->bytes;
+    int bytecount = frame->bytecount;
+    int debug_level = out->debug_level;
+    int voltage = VOLTAGE;
+    if ((bytecount > UID_BYTE) && out->uid_table->uids[bytes[UID_BYTE]].voltage)
+        voltage = out->uid_table->uids[bytes[UID_BYTE]].voltage;
+
+    // The decoder has already worked out whether the message has a 1 byte checksum or 2 byte crc
+    char *data_ok_str = (char *) 0;
+
+    if (frame->valid_type == SENSOR_CHECKSUM)
+        data_ok_str = "chksum ok";
+    else if (frame->valid_type == SENSOR_CRC)
+        data_ok_str = "crc ok";
+
+    // voltage * adc / (32768 / 2^exponent), with the power of 2 applied straight to the double's exponent
+    double current_adc = (bytes[4] * 256) + bytes[5];
+    double result = ldexp(voltage * current_adc, (signed char) bytes[6] - 15);
+    if (out->mqtt && (data_ok_str != (char *) 0) && (result < MAX_WATTS))
+        mqtt_publish(out->mqtt, frame, result);
+    if (out->energy && (data_ok_str != (char *) 0) && (result < MAX_WATTS))
+        energy_add(out->energy, bytes[UID_BYTE], (int64_t) frame->received * 1000000000 + frame->received_nsec, result);
+    if ((debug_level > 0) && out->fanout && (data_ok_str != (char *) 0))
+        output_reading(out, frame, result);    // Only to the subscribers, stdout has the debug output
+    if (debug_level > 0) {
+        if (debug_level == 1)
+            printf("%s  %s ", output_when(out, frame->received), msg);
+        else
+            printf("%s ", msg);
+        if (out->input_names)
+            printf("[%s] ", out->input_names[frame->input]);
+
+        int i;
+        for (i = 0; i < bytecount; i++)
+            printf("%02x ", bytes[i]);
+
+        if (data_ok_str != (char *) 0)
+            printf(data_ok_str);
+        else
+            printf(" cksum: %02x crc16: %04x ", frame->checksum, frame->crc);
+        if (result < MAX_WATTS)
+            printf("  W: %4.3f\n", result);
+        else {
+            printf("  W: <out of range>\n");
+            if (data_ok_str != (char *) 0)
+                printf("*For Efergy True Power Moniter (TPM), use -u %d:tpm\n", bytes[UID_BYTE]);
+        }
+    } else if (data_ok_str != (char *) 0) {
+        // With several inputs the input name becomes a third column
+        const char *input = out->input_names ? out->input_names[frame->input] : NULL;
+        output_reading(out, frame, result);
+        if (out->binary) {
+            binlog_append(out->binary, frame, result);
+        } else if (out->loggingok) {
+            const char *eol = LOGTYPE ? "\r\n" : "\n";
+            if (input)
+                fprintf(out->fp, "%s,%f,%s%s", output_when(out, frame->received), result, input, eol);
+            else
+                fprintf(out->fp, "%s,%f%s", output_when(out, frame->received), result, eol);
+            out->samplecount++;
+            if (out->samplecount == SAMPLES_TO_FLUSH) {
+                out->samplecount = 0;
+                fflush(out->fp);
+            }
+        }
+        fflush(stdout);
+    } else if (out->format == FORMAT_TEXT)
+        printf("Checksum/CEC Error.  Enable debug output with -d option\n");
+    histogram_observe(&output_ns, stats_clock_ns() - start);
+}
+
+// Frame sink that displays frames straight away, on the decoder's thread
+void display_frame_sink(void *arg, const struct efergy_frame *frame) {
+    display_frame_data(arg, frame);
+}
+
+// -----------------------------------------------------------------------------
+// Output stage
+//
+// With the reader/decoder pipeline running (see run_pipeline()), frames are not printed by the decoder.  They go
+// through frame_ring, a single producer / single consumer lock-free ring, to output_thread(), which does the
+// printf, the log file writes and the fflush calls.  A stalled stdout then only ever holds up that thread.  If
+// the ring fills anyway, frames are dropped and counted rather than blocking the decoder.  Debug levels above 1
+// print their analysis straight from the decoder, so their frames are displayed inline as before.  With several
+// inputs every decoder has its own frame_ring, and the one output thread serves all of them.
+
+#define FRAME_RING_ENTRIES  1024
+
+enum output_kind {
+    OUTPUT_FRAME,
+    OUTPUT_SAMPLE_GAP
+};
+
+// Samples lost to a full sample ring.  They went missing just before ring position position, which was input
+// sample input_position (counting the lost samples too).
+struct sample_gap {
+    uint64_t position;
+    uint64_t input_position;
+    uint64_t lost;
+    time_t when;
+};
+
+struct output_record {
+    enum output_kind kind;
+    struct efergy_frame frame;
+    struct sample_gap gap;
+};
+
+struct output_stage;
+
+struct frame_ring {
+    struct output_record records[FRAME_RING_ENTRIES];
+    _Atomic uint64_t head;      // Only written by the decoder
+    _Atomic uint64_t tail;      // Only written by output_thread()
+    _Atomic uint64_t dropped;
+    struct output_stage *stage;
+};
+
+struct output_stage {
+    struct frame_output *out;
+    struct frame_ring **rings;
+    int ring_count;
+    _Atomic int done;
+    sem_t ready;                // Posted for every record pushed to any of the rings
+};
+
+void output_push(struct frame_ring *ring, const struct output_record *record) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == FRAME_RING_ENTRIES) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring->records[head % FRAME_RING_ENTRIES] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    sem_post(&ring->stage->ready);
+}
+
+// Frame sink that hands frames to output_thread()
+void frame_ring_sink(void *arg, const struct efergy_frame *frame) {
+    struct output_record record;
+    record.kind = OUTPUT_FRAME;
+    record.frame = *frame;
+    output_push(arg, &record);
+}
+
+void display_sample_gap(const struct sample_gap *gap) {
+    char buffer[80];
+    strftime(buffer, 80, "%x,%X", localtime(&gap->when));
+    fprintf(stderr, "%s Sample ring overrun: %llu samples lost from input sample %llu\n", buffer,
+            (unsigned long long) gap->lost, (unsigned long long) gap->input_position);
+}
+
+void *output_thread(void *arg) {
+    struct output_stage *stage = arg;
+    for (;;) {
+        int done = atomic_load(&stage->done);   // Before the scan, so nothing pushed before done is missed
+        int handled = 0;
+        int r;
+        for (r = 0; r < stage->ring_count; r++) {
+            struct frame_ring *ring = stage->rings[r];
+            uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (tail != atomic_load_explicit(&ring->head, memory_order_acquire)) {
+                struct output_record *record = &ring->records[tail % FRAME_RING_ENTRIES];
+                if (record->kind == OUTPUT_FRAME)
+                    display_frame_data(stage->out, &record->frame);
+                else
+                    display_sample_gap(&record->gap);
+                atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+                handled++;
+            }
+        }
+        if (handled)
+            continue;
+        if (done)
+            break;
+        sem_wait(&stage->ready);
+    }
+    return NULL;
+}
+
+// Starts output_thread() on rings, which must stay valid until output_stage_stop()
+void output_stage_start(struct output_stage *stage, pthread_t *thread, struct frame_output *out,
+                        struct frame_ring **rings, int ring_count) {
+    int r;
+    stage->out = out;
+    stage->rings = rings;
+    stage->ring_count = ring_count;
+    atomic_store(&stage->done, 0);
+    sem_init(&stage->ready, 0, 0);
+    for (r = 0; r < ring_count; r++)
+        rings[r]->stage = stage;
+    if (pthread_create(thread, NULL, output_thread, stage) != 0) {
+        fprintf(stderr, "\nFailed to start the output thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits for everything already pushed to be displayed
+void output_stage_stop(struct output_stage *stage, pthread_t thread) {
+    atomic_store(&stage->done, 1);
+    sem_post(&stage->ready);
+    pthread_join(thread, NULL);
+    sem_destroy(&stage->ready);
+}
+
+// When the current frame's preamble was received, from the sample clock
+int64_t frame_time_ns(const struct efergy_decoder *dec) {
+    int64_t samples = (int64_t) (dec->frame_position - dec->clock.anchor_sample);
+    int rate = dec->timing.sample_rate;
+    return dec->clock.anchor_ns + samples / rate * 1000000000 + samples % rate * 1000000000 / rate;
+}
+
+// Checks the frame, remembers what a valid one says about its transmitter and passes it to the sink.  rescued is
+// non zero for a frame that only checked out with an alternate decode.
+void emit_frame(struct efergy_decoder *dec, int positive_pulses, int rescued, const unsigned char bytes[],
+                int bytecount) {
+    struct efergy_frame frame;
+    int configured_type = (bytecount > UID_BYTE) ? dec->uid_table->uids[bytes[UID_BYTE]].type : SENSOR_ANY;
+    int64_t received = frame_time_ns(dec);
+    frame.received = received / 1000000000;
+    frame.received_nsec = received % 1000000000;
+    clock_gettime(CLOCK_MONOTONIC, &frame.validated);
+    frame.positive_pulses = positive_pulses;
+    frame.rescued = rescued;
+    if (rescued)
+        frame.msg = positive_pulses ? "Msg (alternate decode):" : "Msg (alternate decode, negative pulses):";
+    else
+        frame.msg = positive_pulses ? "Msg:" : "Msg (from negative pulses):";
+    frame.input = dec->input;
+    frame.checksum = compute_checksum(bytes, bytecount);
+    frame.crc = compute_crc(bytes, bytecount);
+    frame.valid_type = check_sums(bytes, bytecount, configured_type, frame.checksum, frame.crc);
+    frame.bytecount = bytecount;
+    memcpy(frame.bytes, bytes, sizeof(frame.bytes));
+    stat_add(&dec->stats.frames, 1);
+    if (frame.valid_type == SENSOR_CHECKSUM)
+        stat_add(&dec->stats.checksum_ok, 1);
+    else if (frame.valid_type == SENSOR_CRC)
+        stat_add(&dec->stats.crc_ok, 1);
+    else if (bytecount == EXPECTED_BYTECOUNT_IF_CRC_USED)
+        stat_add(&dec->stats.crc_failed, 1);
+    else if (bytecount == EXPECTED_BYTECOUNT_IF_CHECKSUM_USED)
+        stat_add(&dec->stats.checksum_failed, 1);
+    else
+        stat_add(&dec->stats.short_frames, 1);
+    if (frame.valid_type != SENSOR_ANY) {
+        struct transmitter_state *t = &dec->transmitters[bytes[UID_BYTE]];
+        if (t->frames++ == 0)
+            t->center = dec->analysis_wavecenter;
+        else
+            t->center += (dec->analysis_wavecenter - t->center) / UID_CENTER_WEIGHT;
+        t->positive_pulses = positive_pulses;
+        t->type = frame.valid_type;
+        dec->valid_frames++;
+        stat_add(&dec->stats.uid_frames[bytes[UID_BYTE]], 1);
+        stat_set(&dec->stats.uid_last_frame[bytes[UID_BYTE]], frame.received);
+        if (rescued) {
+            dec->rescued_frames++;
+            stat_add(&dec->stats.rescued, 1);
+        }
+    }
+    dec->sink(dec->sink_arg, &frame);
+}
+
+static void stats_wave_center(struct efergy_decoder *dec, int last_center) {
+    stat_set(&dec->stats.wave_center, dec->analysis_wavecenter);
+    histogram_observe(&dec->stats.wave_center_drift, abs(dec->analysis_wavecenter - last_center));
+}
+
+void drop_rejected_frame(struct efergy_decoder *dec, const unsigned char bytes[], int bytecount) {
+    stat_add(&dec->stats.rejected, 1);
+    if (dec->debug_level > 1) {
+        if (bytecount > UID_BYTE)
+            printf("Frame from transmitter %02x dropped (not on the -u list)\n\n", bytes[UID_BYTE]);
+        else
+            printf("Frame dropped, only %d bytes decoded (no transmitter id)\n\n", bytecount);
+    }
+}
+
+// Debug levels 2..4: sample level summary of the frame in sample_storage, plus a raw sample dump at level 4.
+// Raw samples are shown relative to analysis_wavecenter, which must already hold this frame's center.
+void display_frame_analysis(const struct efergy_decoder *dec, int avg_pos, int avg_neg, int last_center) {
+    time_t ltime = frame_time_ns(dec) / 1000000000;
+    char buffer[80];
+    struct tm *curtime = localtime( &ltime );
+    strftime(buffer, 80, "%x,%X", curtime);
+    printf("\nAnalysis of rtl_fm sample data for frame received on %s\n", buffer);
+    printf("     Number of Samples: %6d\n", dec->sample_store_index);
+    printf("    Avg. Sample Values: %6d (negative)   %6d (positive)\n", avg_neg, avg_pos);
+    printf("           Wave Center: %6d (this frame) %6d (last frame)\n", dec->analysis_wavecenter, last_center);
+
+    if (dec->debug_level == 4) { // Raw Sample Dump only in highest debug level
+        int wrap_count = 0;
+        printf("\nShowing raw rtl_fm sample data received between start of frame and end of frame\n");
+        int i;
+        for (i = 0; i < dec->sample_store_index; i++) {
+            printf("%6d ", dec->sample_storage[i] - dec->analysis_wavecenter);
+            wrap_count++;
+            if (wrap_count >= 16) {
+                printf("\n");
+                wrap_count = 0;
+            }
+        }
+        printf("\n\n");
+    }
+}
+
+// Batch (reference) decoder: runs over a full SAMPLE_STORE_SIZE capture in three passes
+void analyze_efergy_message(struct efergy_decoder *dec) {
+
+    // See how balanced/centered the sample data is.  Best case is  diff close to 0
+    int avg_pos, avg_neg;
+    int last_center = dec->analysis_wavecenter;
+    dec->analysis_wavecenter = calculate_wave_center(dec, &avg_pos, &avg_neg); // Use the calculated wave center from this sample to process next frame
+    stage_done(&dec->stats, STAGE_WAVE_CENTER, &dec->stage_start);
+    stats_wave_center(dec, last_center);
+
+    if (dec->debug_level > 1)
+        display_frame_analysis(dec, avg_pos, avg_neg, last_center);
+
+    int display_pulse_details = (dec->debug_level >= 3 ? 1 : 0);
+    int pulse_count_storage[MAX_SAMPLE_STORE_SIZE];
+    int pulse_store_index = generate_pulse_count_array(dec, display_pulse_details, pulse_count_storage);
+    stage_done(&dec->stats, STAGE_PULSE_COUNT, &dec->stage_start);
+    unsigned char bytearray[FRAMEBYTECOUNT];
+    int bytecount = decode_bytes_from_pulse_counts(dec, pulse_count_storage, pulse_store_index, bytearray);
+    stage_done(&dec->stats, STAGE_DECODE, &dec->stage_start);
+    if (uid_rejected(dec->uid_table, bytearray, bytecount)) {
+        drop_rejected_frame(dec, bytearray, bytecount);
+        return;
+    }
+    emit_frame(dec, dec->sample_storage[dec->timing.polarity_sample] < dec->analysis_wavecenter, 0, bytearray, bytecount);
+
+    if (dec->debug_level > 1) printf("\n");
+}
+
+// Streaming decoder.  Instead of waiting for SAMPLE_STORE_SIZE samples and then making three passes over them,
+// pulses are turned into bits and bytes as the samples arrive, and the frame ends as soon as it validates.  The
+// samples are still kept in sample_storage for the debug output.  The center used for the frame comes from its
+// preamble, see preamble_center().
+//
+// Both frame types start the same way, so 8 bytes of a CRC frame pass the checksum test about one time in 256.
+// When 8 bytes check out, the decoder keeps going for up to CHECKSUM_LOOKAHEAD_SAMPLES more samples and only
+// settles on the checksum frame if no 9th byte turns up in that time.  Like the batch decoder, a frame that does
+// have a 9th byte is a CRC frame and stands or falls by its CRC.
+#define CHECKSUM_LOOKAHEAD_SAMPLES(timing)  ((8 + 1) * (timing)->samples_per_bit)
+
+void stream_frame_start(struct frame_stream *fs, int last_center) {
+    memset(fs, 0, sizeof(*fs));
+    fs->last_center = last_center;
+}
+
+// The samples looked at for a 9th byte are not searched for a preamble again.  They may well have arrived in an
+// earlier block, which has been handed back by now.
+static int stream_frame_settle_on_checksum(struct frame_stream *fs, const struct decoder_timing *timing,
+                                           int sample_store_index) {
+    int resume = fs->checksum_frame_end + CHECKSUM_LOOKAHEAD_SAMPLES(timing) + 1;
+    fs->bytecount = EXPECTED_BYTECOUNT_IF_CHECKSUM_USED;
+    fs->resume_index = (resume < sample_store_index) ? resume : sample_store_index;
+    return fs->checksum_frame_end;
+}
+
+// Same rules as decode_bytes_from_pulse_counts(), one pulse at a time.  The pulse is the run that ends at sample
+// end.  Returns the number of samples in the frame once it is complete (or rejected), otherwise -1.
+static int stream_frame_pulse(struct efergy_decoder *dec, int pulse_count, int end) {
+    struct frame_stream *fs = &dec->stream;
+    const struct decoder_timing *timing = &dec->timing;
+    if (pulse_count <= timing->min_low_bits)
+        return -1;
+    fs->bytedata = fs->bytedata << 1;
+    if (pulse_count > timing->min_high_bits)
+        fs->bytedata = fs->bytedata | 0x1;
+    if (++fs->bitpos <= 7)
+        return -1;
+
+    fs->bytes[fs->bytecount++] = fs->bytedata;
+    fs->bytedata = 0;
+    fs->bitpos = 0;
+    if (fs->bytecount == UID_BYTE + 1) {
+        const struct uid_config *uid = &dec->uid_table->uids[fs->bytes[UID_BYTE]];
+        if (uid_rejected(dec->uid_table, fs->bytes, fs->bytecount)) {
+            fs->rejected = 1;
+            return end;
+        }
+        // A configured type decides which frames are accepted, a learned one only which one is expected
+        fs->type = uid->type ? uid->type : dec->transmitters[fs->bytes[UID_BYTE]].type;
+    }
+    if ((fs->bytecount == EXPECTED_BYTECOUNT_IF_CHECKSUM_USED) &&
+            (dec->uid_table->uids[fs->bytes[UID_BYTE]].type != SENSOR_CRC) &&
+            (compute_checksum(fs->bytes, fs->bytecount) == fs->bytes[fs->bytecount - 1])) {
+        if (fs->type == SENSOR_CHECKSUM)
+            return end;     // No need to look for a 9th byte
+        fs->checksum_frame_end = end;
+    }
+    return (fs->bytecount == FRAMEBYTECOUNT) ? end : -1;
+}
+
+// Decodes the samples added to sample_storage since the last call.  Once the frame is complete, returns the
+// number of samples that belong to it (anything from resume_index on is left for the next preamble search);
+// otherwise returns -1 and waits for more samples.
+int stream_frame_decode(struct efergy_decoder *dec) {
+    struct frame_stream *fs = &dec->stream;
+    const struct decoder_timing *timing = &dec->timing;
+    const int16_t *sample_storage = dec->sample_storage;
+    int sample_store_index = dec->sample_store_index;
+    int analysis_wavecenter = dec->analysis_wavecenter;
+
+    if (sample_store_index <= timing->polarity_sample)
+        return -1;
+    if (fs->decoded_index == 0) // Same polarity rule as generate_pulse_count_array()
+        fs->store_positive_pulses = (sample_storage[timing->polarity_sample] < analysis_wavecenter);
+
+    uint64_t mask[MASK_WORDS(MAX_SAMPLE_STORE_SIZE)];
+    int start = fs->decoded_index;
+    int count = sample_store_index - start;
+    kernels->sign_mask(sample_storage + start, count, analysis_wavecenter, mask);
+    int prev_bit = (start == 0) ? (int) (mask[0] & 1) : (sample_storage[start - 1] >= analysis_wavecenter);
+    int w;
+    for (w = 0; w < MASK_WORDS(count); w++) {
+        uint64_t bits = mask[w];
+        uint64_t transitions = bits ^ ((bits << 1) | (uint64_t) prev_bit);
+        if (count - w * 64 < 64)
+            transitions &= ((uint64_t) 1 << (count - w * 64)) - 1;
+        while (transitions) {
+            int bit = __builtin_ctzll(transitions);
+            int t = start + w * 64 + bit;
+            int run_positive = !((bits >> bit) & 1);   // The run ended by sample t has the opposite sign
+            if (fs->checksum_frame_end && (t - fs->checksum_frame_end > CHECKSUM_LOOKAHEAD_SAMPLES(timing))) {
+                fs->decoded_index = t;
+                return stream_frame_settle_on_checksum(fs, timing, sample_store_index);
+            }
+            if (run_positive == fs->store_positive_pulses) {
+                int frame_samples = stream_frame_pulse(dec, t - fs->run_start, t);
+                if (frame_samples >= 0) {
+                    fs->decoded_index = t;
+                    fs->resume_index = t;
+                    return frame_samples;
+                }
+            }
+            fs->run_start = t;
+            transitions &= transitions - 1;
+        }
+        prev_bit = bits >> 63;
+    }
+    fs->decoded_index = sample_store_index;
+    if (fs->checksum_frame_end && (sample_store_index - fs->checksum_frame_end > CHECKSUM_LOOKAHEAD_SAMPLES(timing)))
+        return stream_frame_settle_on_checksum(fs, timing, sample_store_index);
+    if (sample_store_index == timing->sample_store_size) {
+        if (fs->checksum_frame_end)
+            return stream_frame_settle_on_checksum(fs, timing, sample_store_index);
+        fs->resume_index = sample_store_index;
+        return sample_store_index;
+    }
+    return -1;
+}
+
+// A frame from a known transmitter that fails on its preamble's center is decoded again, from the start, on the
+// transmitter's own center.  Returns non zero when that is under way.
+int stream_frame_recenter(struct efergy_decoder *dec) {
+    struct frame_stream *fs = &dec->stream;
+    if (fs->recentred || fs->rejected || (fs->bytecount <= UID_BYTE))
+        return 0;
+    const struct transmitter_state *known = &dec->transmitters[fs->bytes[UID_BYTE]];
+    int last_center = fs->last_center;
+    if (!known->frames || (abs(known->center - dec->analysis_wavecenter) <= UID_RECENTER_THRESHOLD) ||
+            (check_frame(fs->bytes, fs->bytecount, dec->uid_table->uids[fs->bytes[UID_BYTE]].type) != SENSOR_ANY))
+        return 0;
+    dec->analysis_wavecenter = known->center;
+    stream_frame_start(fs, last_center);
+    fs->recentred = 1;
+    return 1;
+}
+
+// Alternate decodes
+//
+// A frame that fails its checksum or crc has often only been read slightly wrong: a noisy preamble put the center
+// a little off, the polarity sample landed on a spike, or a few pulses fell just the wrong side of MINLOWBITS or
+// MINHIGHBITS.  Before giving up on such a frame, the streaming decoder tries its samples again under each
+// combination of RESCUE_CENTERS centers, both polarities and the rescue_thresholds adjustments, and takes the
+// first decode that checks out.  One sign mask per center gives the runs for both polarities, and every decode
+// stops at FRAMEBYTECOUNT bytes, so the whole set costs about as much as a few batch decodes, and only for failed
+// frames.  An 8 bit checksum lets one junk frame in 256 through, so a checksum frame only counts when it comes
+// from a transmitter that has already sent a valid frame (or is on the -u list).  CRC frames always count.
+#define RESCUE_CENTERS          4   /* Preamble center, whole frame center, and the preamble center +/- spread/8 */
+#define RESCUE_CENTER_SPREAD    8
+
+static const struct {
+    int low;                    // Added to min_low_bits
+    int high;                   // Added to min_high_bits
+} rescue_thresholds[] = { { 0, 0 }, { 0, -1 }, { 0, 1 }, { 1, 0 } };
+
+// Lengths of the runs of samples on either side of center in sample_storage, the first starting at sample 0.
+// As in generate_pulse_count_array(), the run still open at the end isn't counted.
+static int frame_runs(const struct efergy_decoder *dec, int center, int runs[], int *first_positive) {
+    uint64_t mask[MASK_WORDS(MAX_SAMPLE_STORE_SIZE)];
+    int count = dec->sample_store_index;
+    int run_count = 0;
+    int run_start = 0;
+    int w;
+    kernels->sign_mask(dec->sample_storage, count, center, mask);
+    *first_positive = (int) (mask[0] & 1);
+    for (w = 0; w < MASK_WORDS(count); w++) {
+        uint64_t bits = mask[w];
+        int prev_bit = (w == 0) ? (int) (bits & 1) : (int) (mask[w - 1] >> 63);
+        uint64_t transitions = bits ^ ((bits << 1) | (uint64_t) prev_bit);
+        if (count - w * 64 < 64)
+            transitions &= ((uint64_t) 1 << (count - w * 64)) - 1;
+        while (transitions) {
+            int t = w * 64 + __builtin_ctzll(transitions);
+            runs[run_count++] = t - run_start;
+            run_start = t;
+            transitions &= transitions - 1;
+        }
+    }
+    return run_count;
+}
+
+// decode_bytes_from_pulse_counts() on every other run from first, with the given thresholds
+static int decode_runs(const int runs[], int run_count, int first, int min_low_bits, int min_high_bits,
+                       unsigned char bytes[]) {
+    unsigned char bytedata = 0;
+    int bitpos = 0;
+    int bytecount = 0;
+    int i;
+    for (i = first; i < run_count; i += 2) {
+        if (runs[i] <= min_low_bits)
+            continue;
+        bytedata = (bytedata << 1) | (runs[i] > min_high_bits);
+        if (++bitpos > 7) {
+            bytes[bytecount++] = bytedata;
+            bytedata = 0;
+            bitpos = 0;
+            if (bytecount == FRAMEBYTECOUNT)
+                break;
+        }
+    }
+    return bytecount;
+}
+
+// Frame length an alternate decode checks out at, or 0.  With this many attempts a checksum will pass on
+// noise now and then, so the decode must keep the UID the failed frame was read with, and a checksum pass
+// only counts for a transmitter known to send checksums.
+static int rescue_check(const struct efergy_decoder *dec, const unsigned char bytes[], int bytecount) {
+    const struct uid_config *uid;
+    if ((bytecount < EXPECTED_BYTECOUNT_IF_CHECKSUM_USED) || (bytes[UID_BYTE] != dec->stream.bytes[UID_BYTE]))
+        return 0;
+    uid = &dec->uid_table->uids[bytes[UID_BYTE]];
+    if (uid_rejected(dec->uid_table, bytes, bytecount))
+        return 0;
+    if ((bytecount == EXPECTED_BYTECOUNT_IF_CRC_USED) &&
+            (check_frame(bytes, EXPECTED_BYTECOUNT_IF_CRC_USED, uid->type) == SENSOR_CRC))
+        return EXPECTED_BYTECOUNT_IF_CRC_USED;
+    // Pulses after the end of a checksum frame can make up a 9th byte, so only the first 8 are checked
+    if ((check_frame(bytes, EXPECTED_BYTECOUNT_IF_CHECKSUM_USED, uid->type) == SENSOR_CHECKSUM) &&
+            ((dec->transmitters[bytes[UID_BYTE]].type == SENSOR_CHECKSUM) || (uid->type == SENSOR_CHECKSUM)))
+        return EXPECTED_BYTECOUNT_IF_CHECKSUM_USED;
+    return 0;
+}
+
+// Tries the alternate decodes on a frame that failed.  Returns non zero, with the frame updated, when one
+// checks out.
+int stream_frame_rescue(struct efergy_decoder *dec) {
+    struct frame_stream *fs = &dec->stream;
+    int runs[MAX_SAMPLE_STORE_SIZE];
+    unsigned char bytes[FRAMEBYTECOUNT];
+    int avg_pos, avg_neg;
+    int wave_center = calculate_wave_center(dec, &avg_pos, &avg_neg);
+    int spread = (avg_pos - avg_neg) / RESCUE_CENTER_SPREAD;
+    int centers[RESCUE_CENTERS] = { dec->analysis_wavecenter, wave_center,
+                                    dec->analysis_wavecenter + spread, dec->analysis_wavecenter - spread };
+    int c, p, h;
+
+    for (c = 0; c < RESCUE_CENTERS; c++) {
+        int first_positive;
+        int run_count = frame_runs(dec, centers[c], runs, &first_positive);
+        for (p = 0; p < 2; p++) {
+            int positive = p ? !fs->store_positive_pulses : fs->store_positive_pulses;
+            int first = (first_positive == positive) ? 0 : 1;
+            for (h = 0; h < (int) (sizeof(rescue_thresholds) / sizeof(rescue_thresholds[0])); h++) {
+                int bytecount = decode_runs(runs, run_count, first, dec->timing.min_low_bits + rescue_thresholds[h].low,
+                                            dec->timing.min_high_bits + rescue_thresholds[h].high, bytes);
+                int length = rescue_check(dec, bytes, bytecount);
+                if (length == 0)
+                    continue;
+                memcpy(fs->bytes, bytes, sizeof(fs->bytes));
+                fs->bytecount = length;
+                fs->store_positive_pulses = positive;
+                fs->rescued = 1;
+                dec->analysis_wavecenter = centers[c];
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void stream_frame_finish(struct efergy_decoder *dec) {
+    struct frame_stream *fs = &dec->stream;
+    if (fs->rejected || uid_rejected(dec->uid_table, fs->bytes, fs->bytecount)) {
+        stage_done(&dec->stats, STAGE_DECODE, &dec->stage_start);
+        drop_rejected_frame(dec, fs->bytes, fs->bytecount);
+        return;
+    }
+    if (dec->alternate_decodes && (fs->bytecount > UID_BYTE) &&
+            (check_frame(fs->bytes, fs->bytecount, dec->uid_table->uids[fs->bytes[UID_BYTE]].type) == SENSOR_ANY))
+        stream_frame_rescue(dec);
+    if (dec->debug_level > 1) {
+        int avg_pos, avg_neg;
+        calculate_wave_center(dec, &avg_pos, &avg_neg);
+        display_frame_analysis(dec, avg_pos, avg_neg, fs->last_center);
+        if (dec->debug_level >= 3) {
+            int pulse_count_storage[MAX_SAMPLE_STORE_SIZE];
+            generate_pulse_count_array(dec, 1, pulse_count_storage);
+        }
+    }
+    stage_done(&dec->stats, STAGE_DECODE, &dec->stage_start);
+    emit_frame(dec, fs->store_positive_pulses, fs->rescued, fs->bytes, fs->bytecount);
+    if (dec->debug_level > 1) printf("\n");
+}
+
+void history_update(struct sample_history *h, const int16_t *block, size_t count) {
+    if (count >= PREAMBLE_WINDOW_SAMPLES) {
+        memcpy(h->samples, block + count - PREAMBLE_WINDOW_SAMPLES, sizeof(h->samples));
+        h->count = PREAMBLE_WINDOW_SAMPLES;
+        return;
+    }
+    int keep = PREAMBLE_WINDOW_SAMPLES - count;
+    if (keep > h->count)
+        keep = h->count;
+    memmove(h->samples, h->samples + h->count - keep, keep * sizeof(int16_t));
+    memcpy(h->samples + keep, block, count * sizeof(int16_t));
+    h->count = keep + count;
+}
+
+// Wave center of the preamble that ends just before block[end]: the midpoint between the average of its samples
+// above and below the center used to find it.
+int preamble_center(const struct sample_history *h, const int16_t *block, size_t end,
+                    const struct preamble_state *st, int center) {
+    int16_t window[PREAMBLE_WINDOW_SAMPLES];
+    int length = st->positive_count + st->negative_count + 2;
+    if (length > PREAMBLE_WINDOW_SAMPLES)
+        length = PREAMBLE_WINDOW_SAMPLES;
+    int from_block = ((size_t) length < end) ? length : (int) end;
+    int from_history = length - from_block;
+    if (from_history > h->count)
+        from_history = h->count;
+    memcpy(window, h->samples + h->count - from_history, from_history * sizeof(int16_t));
+    memcpy(window + from_history, block + end - from_block, from_block * sizeof(int16_t));
+
+    int64_t pos_sum = 0, neg_sum = 0;
+    int pos_count = 0, neg_count = 0;
+    int i;
+    for (i = 0; i < from_history + from_block; i++)
+        if (window[i] >= center) {
+            pos_sum += window[i];
+            pos_count++;
+        } else {
+            neg_sum += window[i];
+            neg_count++;
+        }
+    if ((pos_count == 0) || (neg_count == 0))
+        return center;
+    int64_t avg_pos = pos_sum / pos_count;
+    int64_t avg_neg = neg_sum / neg_count;
+    return avg_neg + ((avg_pos - avg_neg) / 2);
+}
+
+// Also used after lost samples, when whatever was in progress can't be trusted any more
+void efergy_decoder_reset(struct efergy_decoder *dec) {
+    dec->capturing_frame = 0;
+    dec->history.count = 0;
+    preamble_reset(&dec->preamble, dec->analysis_wavecenter);
+}
+
+// Frames go to sink(sink_arg, frame).  uid_table must outlive the decoder.  Debug levels above 1 print their analysis to stdout from whichever thread
+// calls efergy_decoder_push().
+void efergy_decoder_init(struct efergy_decoder *dec, const struct decoder_timing *timing,
+                         const struct uid_table *uid_table, const struct decoder_options *options,
+                         efergy_frame_sink sink, void *sink_arg) {
+    memset(dec, 0, offsetof(struct efergy_decoder, sample_storage));
+    dec->timing = *timing;
+    dec->uid_table = uid_table;
+    dec->debug_level = options->debug_level;
+    dec->batch_decoder = options->batch_decoder;
+    dec->alternate_decodes = options->alternate_decodes;
+    dec->sink = sink;
+    dec->sink_arg = sink_arg;
+    dec->clock.live = (options->start_ns == 0);
+    dec->clock.anchor_ns = options->start_ns;
+    efergy_decoder_reset(dec);
+}
+
+// For an input that is a capture: frames are timed from its first sample (at --start, or now) on
+void efergy_decoder_capture(struct efergy_decoder *dec) {
+    dec->clock.live = 0;
+}
+
+// A live input's block ends now, a capture's first block starts now
+static void sample_clock_anchor(struct efergy_decoder *dec, size_t sample_count) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    dec->clock.anchor_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    dec->clock.anchor_sample = dec->position + (dec->clock.live ? sample_count : 0);
+}
+
+void efergy_decoder_push(struct efergy_decoder *dec, const int16_t *samples, size_t sample_count) {
+    size_t i = 0;
+    stat_add(&dec->stats.samples, sample_count);
+    if (dec->clock.live || (dec->clock.anchor_ns == 0))
+        sample_clock_anchor(dec, sample_count);
+    dec->stage_start = stats_clock_ns();
+    while (i < sample_count) {
+        if (!dec->capturing_frame) {
+            i += find_preamble(samples + i, sample_count - i, dec->analysis_wavecenter, &dec->preamble, &dec->timing);
+            stat_add(&dec->stats.samples_gated, dec->preamble.gated_samples);
+            dec->preamble.gated_samples = 0;
+            stage_done(&dec->stats, STAGE_PREAMBLE, &dec->stage_start);
+            if (i < sample_count) {
+                stat_add(&dec->stats.preambles, 1);
+                dec->frame_position = dec->position + i;
+                if (!dec->batch_decoder) {
+                    int last_center = dec->analysis_wavecenter;
+                    dec->analysis_wavecenter = preamble_center(&dec->history, samples, i, &dec->preamble,
+                                                               dec->analysis_wavecenter);
+                    stage_done(&dec->stats, STAGE_WAVE_CENTER, &dec->stage_start);
+                    stats_wave_center(dec, last_center);
+                    stream_frame_start(&dec->stream, last_center);
+                }
+                i++;    // The sample that completed the preamble isn't part of the frame
+                dec->capturing_frame = 1;
+                dec->sample_store_index = 0;
+            }
+        } else {
+            size_t wanted = dec->timing.sample_store_size - dec->sample_store_index;
+            size_t n = sample_count - i;
+            if (n > wanted)
+                n = wanted;
+            memcpy(&dec->sample_storage[dec->sample_store_index], &samples[i], n * sizeof(int16_t));
+            dec->sample_store_index += n;
+            i += n;
+            if (dec->batch_decoder) {
+                if (dec->sample_store_index == dec->timing.sample_store_size) {
+                    // As always, the last captured sample closes the frame but isn't analyzed
+                    dec->sample_store_index = dec->timing.sample_store_size - 1;
+                    dec->stage_start = stats_clock_ns();
+                    analyze_efergy_message(dec);
+                    dec->stage_start = stats_clock_ns();
+                    dec->capturing_frame = 0;
+                    preamble_reset(&dec->preamble, dec->analysis_wavecenter);
+                }
+            } else {
+                int frame_samples = stream_frame_decode(dec);
+                if ((frame_samples >= 0) && stream_frame_recenter(dec))
+                    frame_samples = stream_frame_decode(dec);
+                stage_done(&dec->stats, STAGE_PULSE_COUNT, &dec->stage_start);
+                if (frame_samples >= 0) {
+                    // Samples from earlier blocks have been handed back, so the search can't go back past this one
+                    size_t rewind = dec->sample_store_index - dec->stream.resume_index;
+                    i -= (rewind < n) ? rewind : n;
+                    dec->sample_store_index = frame_samples;
+                    stream_frame_finish(dec);
+                    dec->stage_start = stats_clock_ns();    // Not counting the time the frame sink took
+                    dec->capturing_frame = 0;
+                    preamble_reset(&dec->preamble, dec->analysis_wavecenter);
+                }
+            }
+        }
+    }
+    history_update(&dec->history, samples, sample_count);
+    dec->position += sample_count;
+}
+
+// -----------------------------------------------------------------------------
+// Supervisor
+//
+// rtl_fm sometimes stops delivering samples altogether, and with the two joined by a shell pipe nothing notices.
+// With --spawn the decoder runs rtl_fm itself (any command that writes rtl_fm samples to stdout, through
+// /bin/sh, in its own process group) and reads its stdout through the usual reader / decoder pipeline.  Its
+// stderr comes through a pipe too, and goes to stderr a line at a time with the command's name in front, so the
+// start up messages can't interleave with ours and there is no need for the fixed one second wait.  The first
+// samples from the command are the readiness signal: the start up time goes to stderr, and the first time round
+// READY=1 goes to $NOTIFY_SOCKET for systemd (Type=notify).
+//
+// supervisor_thread() is the watchdog.  When no samples arrive for --watchdog seconds, or no valid frames for
+// --frame-watchdog seconds (off by default: transmitters can go quiet for good reasons), it sends the command's
+// process group SIGTERM, and SIGKILL if that hasn't done it SUPERVISOR_KILL_SECONDS later.  Whichever way the
+// command ends, the reader sees the end of its output, collects it and starts it again, at most once every
+// SUPERVISOR_RESTART_SECONDS, and the decoder carries on with the new stream.  SIGINT or SIGTERM stops the
+// command for good and the decoder finishes up as it does at the end of stdin.  To try the watchdog without a
+// radio, spawn a command that stalls:
+//  ./EfergyRPI_log --watchdog 2 --spawn "./efergy_synth -n 20 | head -c 1000000; sleep 3600"
+#define SUPERVISOR_DEFAULT_WATCHDOG 10  /* Seconds without samples before the command is restarted */
+#define SUPERVISOR_KILL_SECONDS     2   /* From SIGTERM to SIGKILL */
+#define SUPERVISOR_RESTART_SECONDS  2   /* Least time between starts, so a command that can't start doesn't spin */
+
+struct supervisor {
+    const char *command;
+    char name[32];              // First word of the command, for its stderr lines
+    int watchdog;               // Seconds without samples
+    int frame_watchdog;         // Seconds without valid frames, 0 for no limit
+    pthread_mutex_t lock;       // Around pid, started and the watchdog's view
+    pid_t pid;                  // Process group of the running command, 0 when there isn't one
+    struct timespec started;
+    struct timespec term_sent;  // When the watchdog sent SIGTERM, tv_sec 0 if it hasn't
+    int ready;                  // Samples have arrived from this run of the command
+    int notified;               // READY=1 has gone to $NOTIFY_SOCKET
+    pthread_t thread;
+};
+
+struct supervisor supervisor;
+volatile sig_atomic_t supervisor_stopping;
+volatile sig_atomic_t supervisor_pid;      // For the signal handler
+
+static double seconds_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) + (now.tv_nsec - then->tv_nsec) / 1e9;
+}
+
+static void supervisor_signal(int signal) {
+    (void) signal;
+    supervisor_stopping = 1;
+    if (supervisor_pid > 0)
+        kill(-supervisor_pid, SIGTERM);
+}
+
+// Tells systemd (or whatever set $NOTIFY_SOCKET) about state, if anything is listening
+static void supervisor_notify(const char *state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    int fd;
+    if ((path == NULL) || ((path[0] != '/') && (path[0] != '@')) || (strlen(path) >= sizeof(addr.sun_path)))
+        return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';    // Abstract namespace
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+        return;
+    sendto(fd, state, strlen(state), 0, (struct sockaddr *) &addr,
+           offsetof(struct sockaddr_un, sun_path) + strlen(path));
+    close(fd);
+}
+
+struct stderr_relay {
+    int fd;
+    const char *name;
+};
+
+// Copies one run of the command's stderr to ours, a line at a time
+static void *stderr_relay_thread(void *arg) {
+    struct stderr_relay *relay = arg;
+    FILE *f = fdopen(relay->fd, "r");
+    char line[512];
+    while ((f != NULL) && (fgets(line, sizeof(line), f) != NULL)) {
+        size_t length = strlen(line);
+        fprintf(stderr, "%s: %s%s", relay->name, line, ((length > 0) && (line[length - 1] == '\n')) ? "" : "\n");
+    }
+    if (f != NULL)
+        fclose(f);
+    else
+        close(relay->fd);
+    free(relay);
+    return NULL;
+}
+
+// Starts the command.  Returns the read end of its stdout, or -1 if it couldn't be started.
+static int supervisor_spawn(struct supervisor *sv) {
+    int out[2], err[2];
+    pid_t pid;
+    if (pipe(out) != 0)
+        return -1;
+    if (pipe(err) != 0) {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    fcntl(err[0], F_SETFD, FD_CLOEXEC);
+    if ((pid = fork()) == 0) {
+        // Only async-signal-safe calls between fork() and exec in a threaded process
+        setpgid(0, 0);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[1]);
+        close(err[1]);
+        execl("/bin/sh", "sh", "-c", sv->command, (char *) NULL);
+        _exit(127);
+    }
+    close(out[1]);
+    close(err[1]);
+    if (pid < 0) {
+        close(out[0]);
+        close(err[0]);
+        return -1;
+    }
+    setpgid(pid, pid);  // As well as in the child, so a kill of the group can't come before it exists
+
+    struct stderr_relay *relay = malloc(sizeof(*relay));
+    pthread_t thread;
+    if (relay != NULL) {
+        relay->fd = err[0];
+        relay->name = sv->name;
+        if (pthread_create(&thread, NULL, stderr_relay_thread, relay) == 0)
+            pthread_detach(thread);
+        else {
+            close(err[0]);
+            free(relay);
+        }
+    } else
+        close(err[0]);
+
+    pthread_mutex_lock(&sv->lock);
+    sv->pid = pid;
+    supervisor_pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &sv->started);
+    sv->term_sent.tv_sec = 0;
+    sv->ready = 0;
+    pthread_mutex_unlock(&sv->lock);
+    if (supervisor_stopping)
+        kill(-pid, SIGTERM);    // The signal came in while the command was starting
+    return out[0];
+}
+
+// The reader's first samples from this run of the command
+void supervisor_ready(struct supervisor *sv) {
+    pthread_mutex_lock(&sv->lock);
+    sv->ready = 1;
+    fprintf(stderr, "%s started, first samples after %.2f s\n", sv->name, seconds_since(&sv->started));
+    if (!sv->notified) {
+        supervisor_notify("READY=1");
+        sv->notified = 1;
+    }
+    pthread_mutex_unlock(&sv->lock);
+}
+
+// The command's output has ended (fd is its read end): collects the command and starts it again.  Returns the new
+// command's stdout, or -1 when stopping.
+int supervisor_restart(struct supervisor *sv, int fd) {
+    int status;
+    pid_t pid;
+    close(fd);
+    pthread_mutex_lock(&sv->lock);
+    pid = sv->pid;
+    pthread_mutex_unlock(&sv->lock);
+    kill(-pid, SIGTERM);        // Whatever else is left in its process group
+    while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR))
+        ;
+    pthread_mutex_lock(&sv->lock);
+    sv->pid = 0;
+    supervisor_pid = 0;
+    pthread_mutex_unlock(&sv->lock);
+
+    if (supervisor_stopping)
+        return -1;
+    if (WIFEXITED(status))
+        fprintf(stderr, "%s exited with status %d, restarting\n", sv->name, WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        fprintf(stderr, "%s ended by signal %d, restarting\n", sv->name, WTERMSIG(status));
+    for (;;) {
+        double wait = SUPERVISOR_RESTART_SECONDS - seconds_since(&sv->started);
+        if (wait > 0)
+            usleep(wait * 1e6);
+        if (supervisor_stopping)
+            return -1;
+        atomic_fetch_add(&command_restarts, 1);
+        if ((fd = supervisor_spawn(sv)) >= 0)
+            return fd;
+        fprintf(stderr, "Failed to start %s: %s\n", sv->name, strerror(errno));
+        clock_gettime(CLOCK_MONOTONIC, &sv->started);
+    }
+}
+
+// The watchdog.  Once stopping, it only makes sure the command goes.
+static void *supervisor_thread(void *arg) {
+    struct supervisor *sv = arg;
+    uint64_t last_samples = 0, last_frames = 0;
+    struct timespec samples_seen, frames_seen;
+    int running = 1;
+    clock_gettime(CLOCK_MONOTONIC, &samples_seen);
+    frames_seen = samples_seen;
+    while (!supervisor_stopping || running) {
+        // Every decoder there is decodes the command's output (one, or one per --channels channel)
+        uint64_t samples = 0, frames = 0;
+        struct decoder_stats *s;
+        for (s = atomic_load_explicit(&stats_sources, memory_order_acquire); s != NULL; s = s->next) {
+            samples += stat_get(&s->samples);
+            frames += stat_get(&s->checksum_ok) + stat_get(&s->crc_ok);
+        }
+        sleep(1);
+        pthread_mutex_lock(&sv->lock);
+        if (samples != last_samples)
+            clock_gettime(CLOCK_MONOTONIC, &samples_seen);
+        if (frames != last_frames)
+            clock_gettime(CLOCK_MONOTONIC, &frames_seen);
+        last_samples = samples;
+        last_frames = frames;
+        if (sv->pid > 0) {
+            // Each run of the command gets the whole of both windows to get going
+            double since_start = seconds_since(&sv->started);
+            double quiet = seconds_since(&samples_seen);
+            double no_frames = seconds_since(&frames_seen);
+            if (quiet > since_start)
+                quiet = since_start;
+            if (no_frames > since_start)
+                no_frames = since_start;
+            if (supervisor_stopping && !sv->term_sent.tv_sec)
+                clock_gettime(CLOCK_MONOTONIC, &sv->term_sent);    // supervisor_signal() sent SIGTERM
+            if (sv->term_sent.tv_sec) {
+                if (seconds_since(&sv->term_sent) >= SUPERVISOR_KILL_SECONDS)
+                    kill(-sv->pid, SIGKILL);
+            } else if ((quiet >= sv->watchdog) || (sv->frame_watchdog && (no_frames >= sv->frame_watchdog))) {
+                if (quiet >= sv->watchdog)
+                    fprintf(stderr, "No samples from %s for %.0f s, stopping it\n", sv->name, quiet);
+                else
+                    fprintf(stderr, "No valid frames for %.0f s, stopping %s\n", no_frames, sv->name);
+                kill(-sv->pid, SIGTERM);
+                clock_gettime(CLOCK_MONOTONIC, &sv->term_sent);
+            }
+        }
+        running = (sv->pid > 0);
+        pthread_mutex_unlock(&sv->lock);
+    }
+    return NULL;
+}
+
+// Starts the command and the watchdog, and takes over SIGINT and SIGTERM.  Returns the command's stdout.
+int supervisor_start(struct supervisor *sv) {
+    struct sigaction action;
+    size_t length = strcspn(sv->command, " \t");
+    const char *name = sv->command;
+    const char *slash;
+    int fd;
+    while (((slash = memchr(name, '/', sv->command + length - name)) != NULL))
+        name = slash + 1;
+    snprintf(sv->name, sizeof(sv->name), "%.*s", (int) (sv->command + length - name), name);
+    pthread_mutex_init(&sv->lock, NULL);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = supervisor_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if ((fd = supervisor_spawn(sv)) < 0)
+        return -1;
+    if (pthread_create(&sv->thread, NULL, supervisor_thread, sv) != 0) {
+        kill(-sv->pid, SIGKILL);
+        return -1;
+    }
+    return fd;
+}
+
+void supervisor_stop(struct supervisor *sv) {
+    supervisor_stopping = 1;
+    pthread_join(sv->thread, NULL);
+}
+
+// -----------------------------------------------------------------------------
+// Reader / decoder pipeline
+//
+// Decoding used to run in step with reading stdin, so a slow frame stopped the reads, the pipe filled up and
+// rtl_fm dropped samples (or stalled altogether).  For pipe input ingest_thread() now does nothing but read
+// stdin into sample_ring, a single producer / single consumer lock-free ring that the decoder (the main thread)
+// drains.  The reader never waits for the decoder: whatever doesn't fit in the ring is dropped, counted, and
+// reported to the decoder as a sample_gap at the ring position where it happened, so the decoder can abandon the
+// frame it was in and the output stage can log when and how many samples were lost.
+#define SAMPLE_RING_SAMPLES (1 << 20)   /* Power of 2.  About 11 seconds of rtl_fm output at 96000 samples/s */
+#define GAP_RING_ENTRIES    64
+
+struct sample_ring {
+    int16_t samples[SAMPLE_RING_SAMPLES];
+    _Atomic uint64_t head;      // Only written by ingest_thread()
+    _Atomic uint64_t tail;      // Only written by the decoder
+    struct sample_gap gaps[GAP_RING_ENTRIES];
+    _Atomic uint64_t gap_head;
+    _Atomic uint64_t gap_tail;
+    _Atomic int done;
+    sem_t ready;
+    struct sample_input input;
+    struct supervisor *supervisor;      // Running the command input comes from, NULL for stdin
+    // Overrun counters
+    _Atomic uint64_t samples_read;
+    _Atomic uint64_t samples_lost;
+    _Atomic uint64_t overruns;
+};
+
+// Queues a gap for the decoder, unless the gap queue is full
+static int ingest_queue_gap(struct sample_ring *ring, const struct sample_gap *gap) {
+    uint64_t gap_head = atomic_load_explicit(&ring->gap_head, memory_order_relaxed);
+    if (gap_head - atomic_load_explicit(&ring->gap_tail, memory_order_acquire) >= GAP_RING_ENTRIES)
+        return 0;
+    ring->gaps[gap_head % GAP_RING_ENTRIES] = *gap;
+    atomic_store_explicit(&ring->gap_head, gap_head + 1, memory_order_release);
+    return 1;
+}
+
+void *ingest_thread(void *arg) {
+    struct sample_ring *ring = arg;
+    struct sample_gap pending = { 0, 0, 0, 0 };
+    const int16_t *block;
+    size_t count;
+    int fd;
+
+    for (;;) {
+        while ((count = input_next_block(&ring->input, &block)) > 0) {
+            if (ring->supervisor && !ring->supervisor->ready)
+                supervisor_ready(ring->supervisor);
+            uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            uint64_t space = SAMPLE_RING_SAMPLES - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+            uint64_t input_position = atomic_fetch_add_explicit(&ring->samples_read, count, memory_order_relaxed);
+
+            // A gap has to be queued before any sample that follows it, so a full gap queue means more dropping
+            if (pending.lost && (space > 0)) {
+                if (ingest_queue_gap(ring, &pending))
+                    pending.lost = 0;
+                else
+                    space = 0;
+            }
+            size_t keep = (count < space) ? count : space;
+            if (keep < count) {
+                if (pending.lost == 0) {
+                    pending.position = head + keep;
+                    pending.input_position = input_position + keep;
+                    pending.when = time(NULL);
+                    atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+                }
+                pending.lost += count - keep;
+                atomic_fetch_add_explicit(&ring->samples_lost, count - keep, memory_order_relaxed);
+            }
+
+            size_t offset = head % SAMPLE_RING_SAMPLES;
+            size_t first = (keep < SAMPLE_RING_SAMPLES - offset) ? keep : SAMPLE_RING_SAMPLES - offset;
+            memcpy(&ring->samples[offset], block, first * sizeof(int16_t));
+            memcpy(&ring->samples[0], block + first, (keep - first) * sizeof(int16_t));
+            if (keep) {
+                atomic_store_explicit(&ring->head, head + keep, memory_order_release);
+                sem_post(&ring->ready);
+            }
+        }
+        if ((ring->supervisor == NULL) || ((fd = supervisor_restart(ring->supervisor, ring->input.fd)) < 0))
+            break;
+        input_reopen(&ring->input, fd);
+    }
+    // Samples lost just before EOF still get reported.  The decoder frees up the gap queue as it gets to the gaps.
+    while (pending.lost && !ingest_queue_gap(ring, &pending)) {
+        sem_post(&ring->ready);
+        usleep(1000);
+    }
+    atomic_store(&ring->done, 1);
+    sem_post(&ring->ready);
+    return NULL;
+}
+
+// Runs the decoder on ring samples until the reader hits EOF and the ring is drained.  Sample gaps are reported
+// through frames.
+void decode_from_ring(struct efergy_decoder *dec, struct sample_ring *ring, struct frame_ring *frames) {
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t gap_tail = atomic_load_explicit(&ring->gap_tail, memory_order_relaxed);
+
+        if (gap_tail != atomic_load_explicit(&ring->gap_head, memory_order_acquire)) {
+            struct sample_gap *gap = &ring->gaps[gap_tail % GAP_RING_ENTRIES];
+            if (gap->position == tail) {
+                struct output_record record;
+                record.kind = OUTPUT_SAMPLE_GAP;
+                record.gap = *gap;
+                output_push(frames, &record);
+                stat_add(&dec->stats.samples_lost, gap->lost);
+                dec->position += gap->lost;
+                efergy_decoder_reset(dec);
+                atomic_store_explicit(&ring->gap_tail, gap_tail + 1, memory_order_release);
+                continue;
+            }
+            if (gap->position < head)
+                head = gap->position;   // Decode up to the gap, then deal with it
+        }
+
+        if (tail == head) {
+            if (atomic_load(&ring->done) && (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) &&
+                    (gap_tail == atomic_load_explicit(&ring->gap_head, memory_order_acquire)))
+                break;
+            sem_wait(&ring->ready);
+            continue;
+        }
+        size_t offset = tail % SAMPLE_RING_SAMPLES;
+        size_t count = head - tail;
+        if (count > SAMPLE_RING_SAMPLES - offset)
+            count = SAMPLE_RING_SAMPLES - offset;
+        efergy_decoder_push(dec, &ring->samples[offset], count);
+        atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    }
+}
+
+// Reads fd on its own thread and decodes from the ring on this one, with frames printed by output_thread().  With
+// a supervisor, fd is its command's stdout, and each time that ends the reader carries on with the next run's.
+void run_pipeline(struct efergy_decoder *dec, struct frame_output *out, int fd, int iq_decimation,
+                  struct supervisor *supervisor) {
+    struct sample_ring *ring = calloc(1, sizeof(*ring));
+    struct frame_ring *frames = calloc(1, sizeof(*frames));
+    struct output_stage stage;
+    pthread_t ingest, output;
+    if ((ring == NULL) || (frames == NULL)) {
+        fprintf(stderr, "\nOut of memory for the sample ring\n");
+        exit(EXIT_FAILURE);
+    }
+    sem_init(&ring->ready, 0, 0);
+    input_open(&ring->input, fd, iq_decimation, dec->timing.sample_rate);
+    ring->supervisor = supervisor;
+    output_stage_start(&stage, &output, out, &frames, 1);
+    if (dec->debug_level <= 1) {
+        dec->sink = frame_ring_sink;
+        dec->sink_arg = frames;
+        dec->stats.frames_dropped = &frames->dropped;
+    }
+    if (pthread_create(&ingest, NULL, ingest_thread, ring) != 0) {
+        fprintf(stderr, "\nFailed to start the reader thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    decode_from_ring(dec, ring, frames);
+
+    pthread_join(ingest, NULL);
+    output_stage_stop(&stage, output);
+    input_close(&ring->input);
+
+    if (atomic_load(&ring->samples_lost) || atomic_load(&frames->dropped))
+        fprintf(stderr, "%llu samples read, %llu lost in %llu ring overruns, %llu frames dropped by the output stage\n",
+                (unsigned long long) atomic_load(&ring->samples_read), (unsigned long long) atomic_load(&ring->samples_lost),
+                (unsigned long long) atomic_load(&ring->overruns), (unsigned long long) atomic_load(&frames->dropped));
+    sem_destroy(&ring->ready);
+    free(ring);
+    free(frames);
+}
+
+// -----------------------------------------------------------------------------
+// Multi-input mode
+//
+// With -i, one process decodes several receivers: each -i names a FIFO, a recorded capture, a unix socket or
+// tcp:host:port, and gets its own sample_input and efergy_decoder.  The inputs are shared out between a few
+// worker threads (--threads, by default one per CPU), each of which waits on its inputs with epoll and decodes
+// whatever arrives; a slow input then only costs CPU time when it actually has samples.  Regular files can't be
+// polled (and are always readable), so they are read a few blocks at a time between polls.  There is no sample
+// ring here: an input whose worker falls behind is held up by its pipe or socket buffer instead.  All frames
+// go to the one output thread, tagged with the input name.
+//
+//  rtl_fm ... > /tmp/efergy0 &  rtl_fm ... > /tmp/efergy1 &
+//  ./EfergyRPI_log -i /tmp/efergy0 -i /tmp/efergy1 efergy.log
+#define INPUT_WAKEUP_BLOCKS     8   /* Blocks decoded from one input before the worker moves to the next */
+#define INPUT_EPOLL_EVENTS      16
+
+struct input_source {
+    const char *name;
+    int fd;
+    int regular_file;
+    int closed;
+    struct sample_input input;
+    struct efergy_decoder decoder;
+    struct frame_ring frames;
+};
+
+struct input_worker {
+    pthread_t thread;
+    struct input_source **sources;
+    int source_count;
+};
+
+static int connect_tcp_input(const char *name) {
+    char host[256];
+    const char *spec = name + 4;            // Skip "tcp:"
+    const char *port = strrchr(spec, ':');
+    if ((port == NULL) || (port - spec >= (int) sizeof(host)))
+        return -1;
+    memcpy(host, spec, port - spec);
+    host[port - spec] = '\0';
+    return connect_tcp(host, port + 1);
+}
+
+static int connect_unix_input(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd >= 0) && (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Opens an -i input.  Anything that can be polled is switched to non-blocking.
+void input_source_open(struct input_source *src, int index, const char *name, int iq_decimation,
+                       const struct decoder_timing *timing, const struct decoder_options *options) {
+    struct stat st;
+    src->name = name;
+    if (strncmp(name, "tcp:", 4) == 0)
+        src->fd = connect_tcp_input(name);
+    else if ((stat(name, &st) == 0) && S_ISSOCK(st.st_mode))
+        src->fd = connect_unix_input(name);
+    else
+        src->fd = open(name, O_RDONLY);     // Waits for a writer when name is a FIFO
+    if (src->fd < 0) {
+        fprintf(stderr, "\nFailed to open input %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    src->regular_file = (fstat(src->fd, &st) == 0) && S_ISREG(st.st_mode);
+    if (!src->regular_file)
+        fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) | O_NONBLOCK);
+    input_open(&src->input, src->fd, iq_decimation, timing->sample_rate);
+    efergy_decoder_init(&src->decoder, timing, &transmitter_config, options, frame_ring_sink, &src->frames);
+    if (src->regular_file)
+        efergy_decoder_capture(&src->decoder);
+    src->decoder.input = index;
+    src->decoder.stats.frames_dropped = &src->frames.dropped;
+    stats_register(&src->decoder.stats, name);
+}
+
+// Decodes what the input has to offer, up to INPUT_WAKEUP_BLOCKS blocks.  Returns 1 once the input has ended.
+int input_source_read(struct input_source *src) {
+    const int16_t *samples;
+    size_t count;
+    int blocks;
+    for (blocks = 0; blocks < INPUT_WAKEUP_BLOCKS; blocks++) {
+        if ((count = input_next_block(&src->input, &samples)) == 0)
+            break;
+        efergy_decoder_push(&src->decoder, samples, count);
+    }
+    if (!src->input.eof)
+        return 0;
+    input_close(&src->input);
+    close(src->fd);
+    src->closed = 1;
+    return 1;
+}
+
+void *input_worker_thread(void *arg) {
+    struct input_worker *worker = arg;
+    struct epoll_event events[INPUT_EPOLL_EVENTS];
+    int open_count = worker->source_count;
+    int epoll_fd = epoll_create1(0);
+    int s;
+    if (epoll_fd < 0) {
+        fprintf(stderr, "\nFailed to create an epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+    for (s = 0; s < worker->source_count; s++) {
+        struct input_source *src = worker->sources[s];
+        struct epoll_event ev;
+        if (src->regular_file)
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = src;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) != 0) {
+            fprintf(stderr, "\nCan't poll input %s\n", src->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (open_count > 0) {
+        int files_open = 0;
+        for (s = 0; s < worker->source_count; s++)
+            if (worker->sources[s]->regular_file && !worker->sources[s]->closed) {
+                files_open = 1;
+                open_count -= input_source_read(worker->sources[s]);
+            }
+        if (open_count == 0)
+            break;
+        int n = epoll_wait(epoll_fd, events, INPUT_EPOLL_EVENTS, files_open ? 0 : -1);
+        if ((n < 0) && (errno != EINTR)) {
+            fprintf(stderr, "\nepoll_wait failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (s = 0; s < n; s++) {
+            struct input_source *src = events[s].data.ptr;
+            if (input_source_read(src)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+                open_count--;
+            }
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+// Decodes every input until all of them have ended
+void run_inputs(const char *const *names, int input_count, int thread_count, struct frame_output *out,
+                int iq_decimation, const struct decoder_options *options) {
+    struct input_source **sources = calloc(input_count, sizeof(*sources));
+    struct frame_ring **rings = calloc(input_count, sizeof(*rings));
+    struct input_worker *workers;
+    struct output_stage stage;
+    pthread_t output;
+    uint64_t dropped = 0, valid = 0, rescued = 0;
+    int i;
+
+    if (thread_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpus > 0) ? (int) cpus : 1;
+    }
+    if (thread_count > input_count)
+        thread_count = input_count;
+    workers = calloc(thread_count, sizeof(*workers));
+    if ((sources == NULL) || (rings == NULL) || (workers == NULL)) {
+        fprintf(stderr, "\nOut of memory for the inputs\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < thread_count; i++)
+        workers[i].sources = calloc(input_count, sizeof(struct input_source *));
+    for (i = 0; i < input_count; i++) {
+        struct input_worker *worker = &workers[i % thread_count];
+        if ((sources[i] = calloc(1, sizeof(struct input_source))) == NULL) {
+            fprintf(stderr, "\nOut of memory for the inputs\n");
+            exit(EXIT_FAILURE);
+        }
+        input_source_open(sources[i], i, names[i], iq_decimation, &configured_timing, options);
+        rings[i] = &sources[i]->frames;
+        worker->sources[worker->source_count++] = sources[i];
+    }
+
+    out->input_names = names;
+    output_stage_start(&stage, &output, out, rings, input_count);
+    for (i = 0; i < thread_count; i++)
+        if (pthread_create(&workers[i].thread, NULL, input_worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "\nFailed to start the input threads\n");
+            exit(EXIT_FAILURE);
+        }
+    for (i = 0; i < thread_count; i++)
+        pthread_join(workers[i].thread, NULL);
+    output_stage_stop(&stage, output);
+
+    for (i = 0; i < input_count; i++) {
+        dropped += atomic_load(&sources[i]->frames.dropped);
+        valid += sources[i]->decoder.valid_frames;
+        rescued += sources[i]->decoder.rescued_frames;
+        free(sources[i]);
+    }
+    if (dropped)
+        fprintf(stderr, "%llu frames dropped by the output stage\n", (unsigned long long) dropped);
+    if (options->debug_level > 0)
+        printf("%llu valid frames, %llu of them from alternate decodes\n", (unsigned long long) valid,
+               (unsigned long long) rescued);
+    for (i = 0; i < thread_count; i++)
+        free(workers[i].sources);
+    free(workers);
+    free(rings);
+    free(sources);
+}
+
+// -----------------------------------------------------------------------------
+// Channelizer
+//
+// One rtl_sdr at a wideband rate hears every transmitter within a few hundred kHz, not just the one it is tuned
+// to.  With --channels, its IQ stream is split into one narrow channel per listed offset from the tuned
+// frequency, and each channel gets its own FM front end and efergy_decoder, on a thread of its own.  The reader
+// reads the next block while the channels work on the last one.
+//
+// Each channel is a digital down converter: a numerically controlled oscillator (a 32 bit phase accumulator
+// into a cosine table) mixes the channel down to 0 Hz, and a CIC (cascaded integrator comb) filter decimates it
+// to the discriminator rate.  From the discriminator on it is the --iq front end.  A polyphase filter bank would
+// cost less per channel, but only for channels on its fixed grid, and these ones move: after valid frames a
+// channel retunes itself by 1/CHANNEL_RETUNE_WEIGHT of the mean wave center of the transmitters it has heard
+// (the wave center is their carrier offset), by at most CHANNEL_MAX_PULL_HZ from where it was put, and moves
+// the decoder's centers to match.  A channel put near a transmitter ends up on it and follows it as it drifts,
+// keeping the signal in the middle of the filter.  It can't find one from further away than the --iq front end
+// would (about 15 kHz).  Channels are named after their offsets, which is the input
+// their readings are tagged with.
+//
+//  rtl_sdr -f 433500000 -s 1920000 -g 19.7 - | ./EfergyRPI_log --iq 1920000 --channels -300k,0,250k
+#define MAX_CHANNELS            16
+#define NCO_TABLE_BITS          10
+#define NCO_AMPLITUDE           127     /* Cosine table scale, so a mixed sample fits 16 bits */
+#define CIC_ORDER               3
+#define CIC_MAX_DECIMATION      40      /* The 32 bit CIC's limit: 2^15 * 40^3 < 2^31 */
+#define CHANNEL_MAX_PULL_HZ     25000   /* How far a channel may retune itself from where it was put */
+#define CHANNEL_MIN_RETUNE_HZ   500     /* Smaller corrections aren't worth a retune */
+#define CHANNEL_RETUNE_WEIGHT   2       /* Each retune goes 1/weight of the way to the transmitters */
+
+struct channel {
+    double offset_hz;           // As configured
+    double tuned_hz;            // Where it is tuned now
+    double hz_per_unit;         // Hz per unit of discriminator output (pi == 1 << 14)
+    int iq_rate;
+    uint32_t phase;
+    uint32_t step;
+    uint32_t integrators[2][CIC_ORDER]; // I and Q, wrapping around as CIC filters do
+    uint32_t combs[2][CIC_ORDER];
+    int count;                  // IQ pairs into the integrators since the last comb output
+    int shift;                  // CIC gain taken off before the discriminator
+    int retune;                 // Valid frames since the last retune
+    char name[16];
+    struct iq_frontend fe;      // Discriminator on, fe.decimation being the CIC's
+    struct efergy_decoder decoder;
+    struct frame_ring frames;
+    const uint8_t *block;       // IQ pairs to work on next, NULL to stop
+    size_t pairs;
+    sem_t go;
+    sem_t *done;
+    pthread_t thread;
+};
+
+static int16_t nco_table[1 << NCO_TABLE_BITS];
+
+// Parses --channels' offsets in Hz (with k or M if need be), like -300k,0,250k.  Returns how many there were, 0
+// if the list doesn't parse.
+int parse_channels(const char *list, double offsets[]) {
+    int count = 0;
+    char *end;
+    for (;;) {
+        if (count == MAX_CHANNELS)
+            return 0;
+        offsets[count] = strtod(list, &end);
+        if (end == list)
+            return 0;
+        if (*end == 'k')
+            offsets[count] *= 1e3, end++;
+        else if (*end == 'M')
+            offsets[count] *= 1e6, end++;
+        count++;
+        if (*end == '\0')
+            return count;
+        if (*end != ',')
+            return 0;
+        list = end + 1;
+    }
+}
+
+static void channel_tune(struct channel *ch, double hz) {
+    ch->tuned_hz = hz;
+    ch->step = (uint32_t) (int64_t) llround(hz / ch->iq_rate * 4294967296.0);
+    stat_set(&ch->decoder.stats.channel_hz, llround(hz));
+}
+
+// Frame sink that notes valid frames for the retune, then hands the frame to output_thread()
+static void channel_frame_sink(void *arg, const struct efergy_frame *frame) {
+    struct channel *ch = arg;
+    if (frame->valid_type != SENSOR_ANY)
+        ch->retune = 1;
+    frame_ring_sink(&ch->frames, frame);
+}
+
+void channel_init(struct channel *ch, int index, double offset_hz, int iq_rate, int iq_decimation,
+                  const struct decoder_timing *timing, const struct decoder_options *options, sem_t *done) {
+    int i;
+    if (nco_table[0] == 0)
+        for (i = 0; i < (1 << NCO_TABLE_BITS); i++)
+            nco_table[i] = lround(NCO_AMPLITUDE * cos(2 * M_PI * i / (1 << NCO_TABLE_BITS)));
+    iq_frontend_init(&ch->fe, iq_decimation, timing->sample_rate);
+    if (ch->fe.decimation > CIC_MAX_DECIMATION) {
+        fprintf(stderr, "\nIQ sample rate (--iq option) must be at most %d times %d for --channels\n",
+                CIC_MAX_DECIMATION, IQ_DISCRIMINATOR_RATE);
+        exit(EXIT_FAILURE);
+    }
+    // A mixed sample is under 2^15 and the CIC's gain is decimation^order.  The discriminator wants 16 bits.
+    uint64_t gain = (uint64_t) 1 << 15;
+    for (i = 0; i < CIC_ORDER; i++)
+        gain *= ch->fe.decimation;
+    while ((gain >> ch->shift) > (1 << 16))
+        ch->shift++;
+    ch->offset_hz = offset_hz;
+    ch->iq_rate = iq_rate;
+    ch->hz_per_unit = (double) iq_rate / ch->fe.decimation / 32768;
+    snprintf(ch->name, sizeof(ch->name), "%+.1fkHz", offset_hz / 1000);
+    sem_init(&ch->go, 0, 0);
+    ch->done = done;
+    efergy_decoder_init(&ch->decoder, timing, &transmitter_config, options, channel_frame_sink, ch);
+    ch->decoder.input = index;
+    ch->decoder.stats.frames_dropped = &ch->frames.dropped;
+    ch->decoder.stats.channel = 1;
+    stats_register(&ch->decoder.stats, ch->name);
+    channel_tune(ch, offset_hz);
+}
+
+// Mixes the channel down to 0 Hz, decimates it and demodulates it into ch->fe.out.  Returns the number of samples
+// produced, as iq_demodulate() does.
+static size_t channel_downconvert(struct channel *ch, const uint8_t *iq, size_t pairs) {
+    size_t produced = 0;
+    size_t n;
+    int k;
+    for (n = 0; n < pairs; n++) {
+        int i = iq[2 * n] - 128;
+        int q = iq[2 * n + 1] - 128;
+        int index = ch->phase >> (32 - NCO_TABLE_BITS);
+        int c = nco_table[index];
+        int s = nco_table[(index - (1 << NCO_TABLE_BITS) / 4) & ((1 << NCO_TABLE_BITS) - 1)];
+        ch->phase += ch->step;
+        // (i + jq) * (cos - j sin)
+        uint32_t value[2] = { (uint32_t) (i * c + q * s), (uint32_t) (q * c - i * s) };
+        for (k = 0; k < CIC_ORDER; k++) {
+            value[0] = ch->integrators[0][k] += value[0];
+            value[1] = ch->integrators[1][k] += value[1];
+        }
+        if (++ch->count < ch->fe.decimation)
+            continue;
+        ch->count = 0;
+        for (k = 0; k < CIC_ORDER; k++) {
+            uint32_t delayed_i = ch->combs[0][k], delayed_q = ch->combs[1][k];
+            ch->combs[0][k] = value[0];
+            ch->combs[1][k] = value[1];
+            value[0] -= delayed_i;
+            value[1] -= delayed_q;
+        }
+        produced += iq_discriminate(&ch->fe, (int32_t) value[0] >> ch->shift, (int32_t) value[1] >> ch->shift,
+                                    &ch->fe.out[produced]);
+    }
+    return produced;
+}
+
+// Retunes towards the transmitters heard so far.  Not while a frame is coming in: its samples would jump.
+static void channel_retune(struct channel *ch) {
+    struct efergy_decoder *dec = &ch->decoder;
+    double sum = 0, target;
+    int heard = 0, units, uid;
+    if (dec->capturing_frame)
+        return;
+    ch->retune = 0;
+    for (uid = 0; uid < UID_COUNT; uid++)
+        if (dec->transmitters[uid].frames) {
+            sum += dec->transmitters[uid].center;
+            heard++;
+        }
+    if (heard == 0)
+        return;
+    target = ch->tuned_hz + sum / heard * ch->hz_per_unit / CHANNEL_RETUNE_WEIGHT;
+    if (target > ch->offset_hz + CHANNEL_MAX_PULL_HZ)
+        target = ch->offset_hz + CHANNEL_MAX_PULL_HZ;
+    if (target < ch->offset_hz - CHANNEL_MAX_PULL_HZ)
+        target = ch->offset_hz - CHANNEL_MAX_PULL_HZ;
+    units = lround((target - ch->tuned_hz) / ch->hz_per_unit);
+    if (fabs(units * ch->hz_per_unit) < CHANNEL_MIN_RETUNE_HZ)
+        return;
+
+    channel_tune(ch, ch->tuned_hz + units * ch->hz_per_unit);
+    dec->analysis_wavecenter -= units;
+    for (uid = 0; uid < UID_COUNT; uid++)
+        if (dec->transmitters[uid].frames)
+            dec->transmitters[uid].center -= units;
+    preamble_reset(&dec->preamble, dec->analysis_wavecenter);
+    if (dec->debug_level > 0)
+        fprintf(stderr, "Channel %s retuned to %+.1f kHz\n", ch->name, ch->tuned_hz / 1000);
+}
+
+void *channel_thread(void *arg) {
+    struct channel *ch = arg;
+    for (;;) {
+        sem_wait(&ch->go);
+        if (ch->block == NULL)
+            break;
+        size_t count = channel_downconvert(ch, ch->block, ch->pairs);
+        if (count > 0)
+            efergy_decoder_push(&ch->decoder, ch->fe.out, count);
+        if (ch->retune)
+            channel_retune(ch);
+        sem_post(ch->done);
+    }
+    return NULL;
+}
+
+// Next block of IQ pairs into buffer, from the next run of the supervisor's command if this one has ended.
+// Returns 0 at the end of the input.
+static size_t channel_read(struct sample_input *in, uint8_t *buffer, struct supervisor *supervisor) {
+    int16_t *words;
+    size_t count;
+    int fd;
+    for (;;) {
+        if ((count = input_next_words(in, &words)) > 0) {
+            if (supervisor && !supervisor->ready)
+                supervisor_ready(supervisor);
+            memcpy(buffer, words, count * 2);
+            return count;
+        }
+        if ((supervisor == NULL) || ((fd = supervisor_restart(supervisor, in->fd)) < 0))
+            return 0;
+        input_reopen(in, fd);
+    }
+}
+
+// Decodes every channel of the IQ on fd until it ends (or with a supervisor, until it stops)
+void run_channels(const double offsets[], int count, int fd, int iq_rate, int iq_decimation,
+                  struct frame_output *out, const struct decoder_options *options, struct supervisor *supervisor) {
+    struct channel **channels = calloc(count, sizeof(*channels));
+    struct frame_ring **rings = calloc(count, sizeof(*rings));
+    const char **names = calloc(count, sizeof(*names));
+    struct sample_input *input = malloc(sizeof(*input));
+    uint8_t *buffers[2] = { malloc(INPUT_BLOCK_SAMPLES * 2), malloc(INPUT_BLOCK_SAMPLES * 2) };
+    struct output_stage stage;
+    pthread_t output;
+    sem_t done;
+    uint64_t dropped = 0, valid = 0, rescued = 0;
+    size_t pairs;
+    int current = 0;
+    int i;
+
+    if ((channels == NULL) || (rings == NULL) || (names == NULL) || (input == NULL) || (buffers[0] == NULL) ||
+            (buffers[1] == NULL)) {
+        fprintf(stderr, "\nOut of memory for the channels\n");
+        exit(EXIT_FAILURE);
+    }
+    sem_init(&done, 0, 0);
+    for (i = 0; i < count; i++) {
+        if ((channels[i] = calloc(1, sizeof(struct channel))) == NULL) {
+            fprintf(stderr, "\nOut of memory for the channels\n");
+            exit(EXIT_FAILURE);
+        }
+        channel_init(channels[i], i, offsets[i], iq_rate, iq_decimation, &configured_timing, options, &done);
+        rings[i] = &channels[i]->frames;
+        names[i] = channels[i]->name;
+    }
+    out->input_names = names;
+    output_stage_start(&stage, &output, out, rings, count);
+    for (i = 0; i < count; i++)
+        if (pthread_create(&channels[i]->thread, NULL, channel_thread, channels[i]) != 0) {
+            fprintf(stderr, "\nFailed to start the channel threads\n");
+            exit(EXIT_FAILURE);
+        }
+
+    input_open(input, fd, 0, configured_timing.sample_rate);
+    if (input->map != NULL)
+        for (i = 0; i < count; i++)
+            efergy_decoder_capture(&channels[i]->decoder);
+    pairs = channel_read(input, buffers[current], supervisor);
+    while (pairs > 0) {
+        for (i = 0; i < count; i++) {
+            channels[i]->block = buffers[current];
+            channels[i]->pairs = pairs;
+            sem_post(&channels[i]->go);
+        }
+        current ^= 1;
+        pairs = channel_read(input, buffers[current], supervisor);
+        for (i = 0; i < count; i++)
+            sem_wait(&done);
+    }
+    for (i = 0; i < count; i++) {
+        channels[i]->block = NULL;
+        sem_post(&channels[i]->go);
+        pthread_join(channels[i]->thread, NULL);
+    }
+    output_stage_stop(&stage, output);
+    input_close(input);
+
+    for (i = 0; i < count; i++) {
+        struct channel *ch = channels[i];
+        dropped += atomic_load(&ch->frames.dropped);
+        valid += ch->decoder.valid_frames;
+        rescued += ch->decoder.rescued_frames;
+        if (options->debug_level > 0)
+            printf("Channel %s: %llu valid frames, tuned to %+.1f kHz\n", ch->name,
+                   (unsigned long long) ch->decoder.valid_frames, ch->tuned_hz / 1000);
+    }
+    if (dropped)
+        fprintf(stderr, "%llu frames dropped by the output stage\n", (unsigned long long) dropped);
+    if (options->debug_level > 0)
+        printf("%llu valid frames, %llu of them from alternate decodes\n", (unsigned long long) valid,
+               (unsigned long long) rescued);
+    // The channels' stats stay registered, so they aren't freed
+    sem_destroy(&done);
+    free(buffers[0]);
+    free(buffers[1]);
+    free(input);
+    free(rings);
+}
+
+// -b mode: times each sample kernel set on the samples read from stdin (a recorded capture) and checks that
+// every set produces exactly what the scalar kernels produce.
+#define BENCHMARK_MAX_SAMPLES   (64 * 1024 * 1024)
+
+void benchmark_kernels(int iq_decimation) {
+    struct sample_input input;
+    const int16_t *block;
+    size_t block_count, total = 0;
+    int frame_size = configured_timing.sample_store_size;
+    int16_t *capture = malloc(BENCHMARK_MAX_SAMPLES * sizeof(int16_t));
+    struct efergy_decoder *dec = malloc(sizeof(*dec));
+    if ((capture == NULL) || (dec == NULL)) {
+        fprintf(stderr, "\nOut of memory for benchmark capture\n");
+        exit(EXIT_FAILURE);
+    }
+    input_open(&input, STDIN_FILENO, iq_decimation, configured_timing.sample_rate);
+    while ((total < BENCHMARK_MAX_SAMPLES) && ((block_count = input_next_block(&input, &block)) > 0)) {
+        if (block_count > BENCHMARK_MAX_SAMPLES - total)
+            block_count = BENCHMARK_MAX_SAMPLES - total;
+        memcpy(capture + total, block, block_count * sizeof(int16_t));
+        total += block_count;
+    }
+    input_close(&input);
+    if (total < (size_t) frame_size) {
+        fprintf(stderr, "\nNeed at least %d samples on stdin to benchmark\n", frame_size);
+        exit(EXIT_FAILURE);
+    }
+
+    const struct sample_kernels *selected = kernels;
+    int selected_gate = preamble_gate;
+    size_t frames = total / frame_size;
+    uint64_t mask[MASK_WORDS(MAX_SAMPLE_STORE_SIZE)];
+    int pulses[MAX_SAMPLE_STORE_SIZE];
+    uint64_t reference[5] = { 0, 0, 0, 0, 0 };
+    int k;
+
+    struct decoder_options options = { .debug_level = 0, .batch_decoder = 0, .alternate_decodes = 0, .start_ns = 0 };
+    efergy_decoder_init(dec, &configured_timing, &transmitter_config, &options, NULL, NULL);
+    printf("Benchmarking %zu samples (%zu frames), selected kernels: %s\n", total, frames, selected->name);
+    printf("%-8s %14s %14s %14s %14s %14s   (Msamples/s)\n", "kernels", "sign_mask", "wave_sums", "preamble",
+           "ungated", "pulse_count");
+    for (k = AVAILABLE_KERNEL_COUNT - 1; k >= 0; k--) {
+        struct timespec start;
+        double seconds[5];
+        uint64_t check[5] = { 0, 0, 0, 0, 0 };
+        int gate;
+        size_t f, i;
+        int w;
+        if (!kernels_supported(&available_kernels[k]))
+            continue;
+        kernels = &available_kernels[k];
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (f = 0; f < frames; f++) {
+            kernels->sign_mask(capture + f * frame_size, frame_size, 0, mask);
+            for (w = 0; w < MASK_WORDS(frame_size); w++)
+                check[0] = check[0] * 31 + mask[w];
+        }
+        seconds[0] = elapsed_seconds(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (f = 0; f < frames; f++) {
+            struct wave_sums sums;
+            kernels->wave_sums(capture + f * frame_size, frame_size, &sums);
+            check[1] = check[1] * 31 + sums.pos_sum + sums.neg_sum * 7 + sums.pos_count * 13 + sums.neg_count;
+        }
+        seconds[1] = elapsed_seconds(&start);
+
+        // The preamble search with its noise gate and without: both must find the same preambles
+        for (gate = 1; gate >= 0; gate--) {
+            int slot = gate ? 2 : 4;
+            struct preamble_state preamble;
+            preamble_gate = gate;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            preamble_reset(&preamble, 0);
+            for (i = 0; i < total; ) {
+                i += find_preamble(capture + i, total - i, 0, &preamble, &dec->timing);
+                if (i < total) {
+                    check[slot] = check[slot] * 31 + i;
+                    preamble_reset(&preamble, 0);
+                    i++;
+                }
+            }
+            seconds[slot] = elapsed_seconds(&start);
+        }
+        preamble_gate = selected_gate;
+        if (check[2] != check[4])
+            printf("%-8s preamble search with and without the noise gate disagree\n", kernels->name);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        dec->analysis_wavecenter = 0;
+        for (f = 0; f < frames; f++) {
+            memcpy(dec->sample_storage, capture + f * frame_size, frame_size * sizeof(int16_t));
+            dec->sample_store_index = frame_size;
+            int count = generate_pulse_count_array(dec, 0, pulses);
+            for (w = 0; w < count; w++)
+                check[3] = check[3] * 31 + pulses[w];
+        }
+        seconds[3] = elapsed_seconds(&start);
+
+        printf("%-8s %14.1f %14.1f %14.1f %14.1f %14.1f", kernels->name,
+               frames * frame_size / seconds[0] / 1e6, frames * frame_size / seconds[1] / 1e6,
+               total / seconds[2] / 1e6, total / seconds[4] / 1e6, frames * frame_size / seconds[3] / 1e6);
+        if (k == AVAILABLE_KERNEL_COUNT - 1)
+            memcpy(reference, check, sizeof(reference));
+        else if (memcmp(reference, check, sizeof(reference)) != 0)
+            printf("   MISMATCH against scalar");
+        printf("\n");
+    }
+    kernels = selected;
+    free(dec);
+    free(capture);
+}
+
+// -----------------------------------------------------------------------------
+// Replay
+//
+// --replay decodes stdin, normally a recorded capture or efergy_synth's output, as fast as it can be read: on one
+// thread and without the start up delay.  When the input ends, the throughput goes to stderr as key=value pairs
+// for efergy_bench.sh.
+//  ./efergy_synth -n 1000 | ./EfergyRPI_log --replay -d 1
+// A frame's latency runs from the moment the block holding its end goes to the decoder until the frame comes out:
+// the part of a live receiver's delay that is down to this program rather than to rtl_fm's buffering.
+#define REPLAY_LATENCY_BUCKETS  10000   /* 1us each, slower frames count in the last */
+
+struct replay_stats {
+    struct frame_output *out;
+    struct timespec block_start;    // When the current block went to the decoder
+    uint64_t frames;                // Valid frames
+    double latency_sum;
+    double latency_max;
+    uint32_t latency_us[REPLAY_LATENCY_BUCKETS];
+};
+
+void replay_frame_sink(void *arg, const struct efergy_frame *frame) {
+    struct replay_stats *stats = arg;
+    if (frame->valid_type != SENSOR_ANY) {
+        double latency = elapsed_seconds(&stats->block_start);
+        int bucket = latency * 1e6;
+        stats->frames++;
+        stats->latency_sum += latency;
+        if (latency > stats->latency_max)
+            stats->latency_max = latency;
+        stats->latency_us[(bucket < REPLAY_LATENCY_BUCKETS) ? bucket : REPLAY_LATENCY_BUCKETS - 1]++;
+    }
+    display_frame_sink(stats->out, frame);
+}
+
+void replay_input(struct efergy_decoder *dec, struct frame_output *out, int iq_decimation) {
+    static struct replay_stats stats;
+    struct sample_input input;
+    struct timespec start;
+    const int16_t *samples;
+    size_t sample_count, total = 0;
+    uint64_t below = 0;
+    int p99 = 0;
+
+    stats.out = out;
+    dec->sink = replay_frame_sink;
+    dec->sink_arg = &stats;
+    input_open(&input, STDIN_FILENO, iq_decimation, dec->timing.sample_rate);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((sample_count = input_next_block(&input, &samples)) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &stats.block_start);
+        efergy_decoder_push(dec, samples, sample_count);
+        total += sample_count;
+    }
+    double seconds = elapsed_seconds(&start);
+    input_close(&input);
+
+    while ((p99 < REPLAY_LATENCY_BUCKETS - 1) && ((below += stats.latency_us[p99]) * 100 < stats.frames * 99))
+        p99++;
+    fflush(stdout);
+    fprintf(stderr, "replay: samples=%zu seconds=%.3f msamples_per_s=%.2f realtime=%.0f frames=%llu frames_per_s=%.1f "
+            "latency_mean_us=%.1f latency_p99_us=%d latency_max_us=%.1f\n", total, seconds, total / seconds / 1e6,
+            total / seconds / dec->timing.sample_rate, (unsigned long long) stats.frames, stats.frames / seconds,
+            stats.frames ? stats.latency_sum / stats.frames * 1e6 : 0.0, stats.frames ? p99 : 0,
+            stats.latency_max * 1e6);
+}
+
+// --start's YYYY-MM-DDTHH:MM[:SS] (local time, like the output) or Unix seconds.  Returns zero if it doesn't parse.
+int parse_start_time(const char *text, int64_t *ns) {
+    struct tm tm;
+    char *end;
+    int length = 0, seconds_length = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%d-%d-%d%*[T ]%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+               &length) == 5) {
+        if ((text[length] == ':') && (sscanf(text + length, ":%d%n", &tm.tm_sec, &seconds_length) == 1))
+            length += seconds_length;
+        if (text[length] != '\0')
+            return 0;
+        tm.tm_year -= 1900;
+        tm.tm_mon--;
+        tm.tm_isdst = -1;
+        *ns = (int64_t) mktime(&tm) * 1000000000;
+        return 1;
+    }
+    double seconds = strtod(text, &end);
+    if ((end == text) || (*end != '\0') || (seconds <= 0))
+        return 0;
+    *ns = (int64_t) (seconds * 1e9);
+    return 1;
+}
+
+void  main (int argc, char**argv)
+{
+    int debug_level = 0;
+    int benchmark = 0;
+    int batch_decoder = 0;
+    int single_thread = 0;
+    int rescue = 1;
+    int replay = 0;
+    static struct mqtt_client mqtt;
+    static struct energy_aggregates energy;
+    const char *stats = NULL;
+    int format = FORMAT_TEXT;
+    const char *socket_path = NULL;
+    const char *windows = NULL;
+    const char *mqtt_server = NULL;
+    const char *mqtt_topic = MQTT_DEFAULT_TOPIC;
+    const char *mqtt_user = NULL;
+    int mqtt_qos = 0;
+    int mqtt_keepalive = MQTT_DEFAULT_KEEPALIVE;
+    const char *mqtt_store = NULL;
+    long mqtt_store_size = MQTT_DEFAULT_STORE_SIZE;
+    int iq_rate = 0;
+    int iq_decimation = 0;
+    char *logfile = NULL;
+    int binary_log = 0;
+    const char **inputs = calloc(argc, sizeof(const char *));
+    int input_count = 0;
+    int thread_count = 0;
+    double channels[MAX_CHANNELS];
+    int channel_count = 0;
+    int64_t start_ns = 0;
+    int arg;
+
+    init_crc_table();
+#if TARGET_UID > 0
+    transmitter_config.filter = 1;
+    transmitter_config.uids[TARGET_UID].allowed = 1;
+#endif
+
+    for (arg = 1; arg < argc; arg++) {
+        if (strncmp(argv[arg], "-h", 2) == 0) {
+            printf("\nUsage: %s              - Normal mode\n", argv[0]);
+            printf("       %s <filename>   - Normal mode plus log samples to output file\n", argv[0]);
+            printf("       %s --log-format csv|binary - Format of the <filename> log, default csv (see efergy_logtool)\n",
+                   argv[0]);
+            printf("       %s -d [1,2,3,4] - Set debug/verbosity.  Default level 0 has minimum output\n", argv[0]);
+            printf("       %s -b           - Benchmark the sample kernels on a capture read from stdin\n", argv[0]);
+            printf("       %s --batch      - Use the original batch decoder (reference for comparisons)\n", argv[0]);
+            printf("       %s --no-threads - Read, decode and print on one thread, even from a pipe\n", argv[0]);
+            printf("       %s --no-gate    - Walk every transition in the preamble search (reference for comparisons)\n",
+                   argv[0]);
+            printf("       %s --no-rescue  - Don't try alternate decodes of frames that fail their checksum or crc\n", argv[0]);
+            printf("       %s --spawn command  - Run rtl_fm (command, through sh) and decode its output instead of stdin,\n"
+                   "                         restarting it when it stalls or exits\n", argv[0]);
+            printf("       %s --watchdog secs  - Restart the --spawn command after this long without samples, default %d\n",
+                   argv[0], SUPERVISOR_DEFAULT_WATCHDOG);
+            printf("       %s --frame-watchdog secs - ... or without valid frames, default never\n", argv[0]);
+            printf("       %s --replay     - Decode stdin as fast as it can be read and report the throughput\n", argv[0]);
+            printf("       %s --start time - When the capture on stdin or -i was recorded, for the frame times:\n"
+                   "                         YYYY-MM-DDTHH:MM[:SS] local time or Unix seconds, default now\n", argv[0]);
+            printf("       %s --rate rate  - Sample rate of the input (rtl_fm -r), %d..%d, default %d\n",
+                   argv[0], MIN_SAMPLE_RATE, MAX_SAMPLE_RATE, DEFAULT_SAMPLE_RATE);
+            printf("       %s --iq [rate]  - Input is raw 8 bit IQ from rtl_sdr at rate (default %d), a multiple of --rate\n",
+                   argv[0], DEFAULT_IQ_SAMPLE_RATE);
+            printf("       %s -i input ... - Decode several inputs (FIFO, file, unix socket or tcp:host:port) at once\n",
+                   argv[0]);
+            printf("       %s --threads n  - Worker threads for the -i inputs, default one per CPU\n", argv[0]);
+            printf("       %s --channels hz,hz,... - Decode a channel at each offset (k or M) from the --iq center,\n"
+                   "                         each retuning itself to the transmitters it hears, up to %d channels\n",
+                   argv[0], MAX_CHANNELS);
+            printf("       %s -u uid[:type[:voltage]] ... - Only decode these transmitters (3rd frame byte), type\n"
+                   "                              checksum, crc or tpm, voltage for the W calculation\n", argv[0]);
+            printf("       %s --windows [list] - Report kWh and min/mean/max W per transmitter over these windows, default\n"
+                   "                         %s (s, m, h or d), instead of every reading\n", argv[0], ENERGY_DEFAULT_WINDOWS);
+            printf("       %s --format text|json|binary - Readings on stdout (at debug level 0) and --socket as text lines,\n"
+                   "                         JSON lines or length prefixed binary records, default text\n", argv[0]);
+            printf("       %s --socket path - Serve the --format stream to up to %d local consumers on a unix socket\n",
+                   argv[0], SUBSCRIBER_MAX);
+            printf("       %s --stats file|unix:path|tcp:[host:]port - Counters and histograms in the Prometheus text\n"
+                   "                         format, rewritten every %d seconds or served to whatever connects\n",
+                   argv[0], STATS_FILE_SECONDS);
+            printf("       %s --mqtt host[:port]     - Publish readings to this MQTT broker (password from $MQTT_PASS)\n",
+                   argv[0]);
+            printf("       %s --mqtt-topic topic     - MQTT topic, default %s\n", argv[0], MQTT_DEFAULT_TOPIC);
+            printf("       %s --mqtt-qos 0|1         - MQTT QoS, default 0\n", argv[0]);
+            printf("       %s --mqtt-user user       - MQTT user name, default $MQTT_USER\n", argv[0]);
+            printf("       %s --mqtt-keepalive secs  - MQTT keepalive, default %d\n", argv[0], MQTT_DEFAULT_KEEPALIVE);
+            printf("       %s --mqtt-store file      - Keep unsent MQTT messages in this ring file, across restarts\n",
+                   argv[0]);
+            printf("       %s --mqtt-store-size n    - Messages a new --mqtt-store file holds, default %d\n", argv[0],
+                   MQTT_DEFAULT_STORE_SIZE);
+            exit(0);
+        } else if (strcmp(argv[arg], "-d") == 0) {
+            debug_level = 3;
+            if ((arg + 1 < argc) && (argv[arg + 1][0] != '-')) {
+                debug_level = strtol(argv[++arg], NULL, 0);
+                if ((debug_level < 1) || (debug_level > 4)) {
+                    fprintf(stderr, "\nDebug level (-d option) must be between 1 and 4\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        } else if (strcmp(argv[arg], "-b") == 0) {
+            benchmark = 1;
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch_decoder = 1;
+        } else if (strcmp(argv[arg], "--no-gate") == 0) {
+            preamble_gate = 0;
+        } else if (strcmp(argv[arg], "--no-rescue") == 0) {
+            rescue = 0;
+        } else if (strcmp(argv[arg], "--replay") == 0) {
+            replay = 1;
+        } else if (strcmp(argv[arg], "--no-threads") == 0) {
+            single_thread = 1;
+        } else if ((strcmp(argv[arg], "--log-format") == 0) && (arg + 1 < argc)) {
+            arg++;
+            if ((strcmp(argv[arg], "csv") != 0) && (strcmp(argv[arg], "binary") != 0)) {
+                fprintf(stderr, "\nLog format (--log-format option) must be csv or binary\n");
+                exit(EXIT_FAILURE);
+            }
+            binary_log = (strcmp(argv[arg], "binary") == 0);
+        } else if ((strcmp(argv[arg], "--start") == 0) && (arg + 1 < argc)) {
+            if (!parse_start_time(argv[++arg], &start_ns)) {
+                fprintf(stderr, "\nStart time (--start option) must be YYYY-MM-DDTHH:MM[:SS] or Unix seconds\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--rate") == 0) && (arg + 1 < argc)) {
+            if (!set_sample_rate(&configured_timing, strtol(argv[++arg], NULL, 0))) {
+                fprintf(stderr, "\nSample rate (--rate option) must be between %d and %d\n", MIN_SAMPLE_RATE, MAX_SAMPLE_RATE);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[arg], "--iq") == 0) {
+            iq_rate = DEFAULT_IQ_SAMPLE_RATE;
+            if ((arg + 1 < argc) && (argv[arg + 1][0] != '-'))
+                iq_rate = strtol(argv[++arg], NULL, 0);
+        } else if ((strcmp(argv[arg], "-i") == 0) && (arg + 1 < argc)) {
+            inputs[input_count++] = argv[++arg];
+        } else if ((strcmp(argv[arg], "--channels") == 0) && (arg + 1 < argc)) {
+            if ((channel_count = parse_channels(argv[++arg], channels)) == 0) {
+                fprintf(stderr, "\nChannels (--channels option) must be up to %d offsets in Hz, like -300k,0,250k\n",
+                        MAX_CHANNELS);
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "-u") == 0) && (arg + 1 < argc)) {
+            if (!add_allowed_uid(&transmitter_config, argv[++arg])) {
+                fprintf(stderr, "\nTransmitter (-u option) must be uid[:checksum|crc|tpm[:voltage]], uid 0..255\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--threads") == 0) && (arg + 1 < argc)) {
+            thread_count = strtol(argv[++arg], NULL, 0);
+            if (thread_count < 1) {
+                fprintf(stderr, "\nThread count (--threads option) must be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--format") == 0) && (arg + 1 < argc)) {
+            arg++;
+            for (format = FORMAT_TEXT; format <= FORMAT_BINARY; format++)
+                if (strcmp(argv[arg], format_names[format]) == 0)
+                    break;
+            if (format > FORMAT_BINARY) {
+                fprintf(stderr, "\nOutput format (--format option) must be text, json or binary\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--socket") == 0) && (arg + 1 < argc)) {
+            socket_path = argv[++arg];
+        } else if ((strcmp(argv[arg], "--spawn") == 0) && (arg + 1 < argc)) {
+            supervisor.command = argv[++arg];
+        } else if ((strcmp(argv[arg], "--watchdog") == 0) && (arg + 1 < argc)) {
+            supervisor.watchdog = strtol(argv[++arg], NULL, 0);
+            if (supervisor.watchdog < 1) {
+                fprintf(stderr, "\nWatchdog (--watchdog option) must be at least 1 second\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--frame-watchdog") == 0) && (arg + 1 < argc)) {
+            supervisor.frame_watchdog = strtol(argv[++arg], NULL, 0);
+            if (supervisor.frame_watchdog < 1) {
+                fprintf(stderr, "\nFrame watchdog (--frame-watchdog option) must be at least 1 second\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--stats") == 0) && (arg + 1 < argc)) {
+            stats = argv[++arg];
+        } else if (strcmp(argv[arg], "--windows") == 0) {
+            // The list is optional, so only an argument starting with a digit is one (anything else is the log file)
+            windows = ENERGY_DEFAULT_WINDOWS;
+            if ((arg + 1 < argc) && (argv[arg + 1][0] >= '0') && (argv[arg + 1][0] <= '9')) {
+                windows = argv[++arg];
+                if (!energy_init(&energy, windows, NULL, NULL)) {
+                    fprintf(stderr, "\nWindows (--windows option) must be up to %d of 1s..1d, like %s\n",
+                            ENERGY_MAX_WINDOWS, ENERGY_DEFAULT_WINDOWS);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        } else if ((strcmp(argv[arg], "--mqtt") == 0) && (arg + 1 < argc)) {
+            mqtt_server = argv[++arg];
+        } else if ((strcmp(argv[arg], "--mqtt-topic") == 0) && (arg + 1 < argc)) {
+            mqtt_topic = argv[++arg];
+            if ((mqtt_topic[0] == '\0') || (strlen(mqtt_topic) >= MQTT_TOPIC_SIZE) || strpbrk(mqtt_topic, "+#")) {
+                fprintf(stderr, "\nMQTT topic (--mqtt-topic option) must be 1 to %d characters, without + or #\n",
+                        MQTT_TOPIC_SIZE - 1);
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--mqtt-qos") == 0) && (arg + 1 < argc)) {
+            mqtt_qos = strtol(argv[++arg], NULL, 0);
+            if ((mqtt_qos < 0) || (mqtt_qos > 1)) {
+                fprintf(stderr, "\nMQTT QoS (--mqtt-qos option) must be 0 or 1\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--mqtt-user") == 0) && (arg + 1 < argc)) {
+            mqtt_user = argv[++arg];
+        } else if ((strcmp(argv[arg], "--mqtt-keepalive") == 0) && (arg + 1 < argc)) {
+            mqtt_keepalive = strtol(argv[++arg], NULL, 0);
+            if ((mqtt_keepalive < 1) || (mqtt_keepalive > 65535)) {
+                fprintf(stderr, "\nMQTT keepalive (--mqtt-keepalive option) must be 1 to 65535 seconds\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ((strcmp(argv[arg], "--mqtt-store") == 0) && (arg + 1 < argc)) {
+            mqtt_store = argv[++arg];
+        } else if ((strcmp(argv[arg], "--mqtt-store-size") == 0) && (arg + 1 < argc)) {
+            mqtt_store_size = strtol(argv[++arg], NULL, 0);
+            if ((mqtt_store_size < 16) || (mqtt_store_size > (1L << 24))) {
+                fprintf(stderr, "\nMQTT store size (--mqtt-store-size option) must be 16 to %ld messages\n", 1L << 24);
+                exit(EXIT_FAILURE);
+            }
+        } else if (argv[arg][0] == '-') {
+            fprintf(stderr, "\nUnknown option %s, see %s -h\n", argv[arg], argv[0]);
+            exit(EXIT_FAILURE);
+        } else {
+            logfile = argv[arg];
+        }
+    }
+
+    // Give rtl_fm program some time to get initialized so its startup messages don't interleave with ours.  A
+    // --spawn command's messages come through us instead, and its first samples say when it is ready.
+    if (!replay && !supervisor.command)
+        sleep(1);
+
+    if (iq_rate) {
+        if ((iq_rate < configured_timing.sample_rate) || (iq_rate % configured_timing.sample_rate != 0)) {
+            fprintf(stderr, "\nIQ sample rate (--iq option) must be a multiple of the sample rate (%d)\n", configured_timing.sample_rate);
+            exit(EXIT_FAILURE);
+        }
+        iq_decimation = iq_rate / configured_timing.sample_rate;
+    }
+
+    if ((input_count > 0) && replay) {
+        fprintf(stderr, "\nReplay (--replay option) decodes stdin, not -i inputs\n");
+        exit(EXIT_FAILURE);
+    }
+    if (supervisor.command && ((input_count > 0) || replay || benchmark)) {
+        fprintf(stderr, "\nA --spawn command replaces stdin, and can't go with -i, --replay or -b\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((channel_count > 0) && ((iq_rate == 0) || (input_count > 0) || replay || benchmark)) {
+        fprintf(stderr, "\nChannels (--channels option) need --iq input on stdin or from --spawn, not -i, --replay or -b\n");
+        exit(EXIT_FAILURE);
+    }
+    for (arg = 0; arg < channel_count; arg++)
+        if (fabs(channels[arg]) + CHANNEL_MAX_PULL_HZ >= iq_rate / 2) {
+            fprintf(stderr, "\nChannels (--channels option) must be within +/-%d Hz of the center at --iq %d\n",
+                    iq_rate / 2 - CHANNEL_MAX_PULL_HZ, iq_rate);
+            exit(EXIT_FAILURE);
+        }
+    if (supervisor.watchdog == 0)
+        supervisor.watchdog = SUPERVISOR_DEFAULT_WATCHDOG;
+    if (((input_count > 0) || (channel_count > 0)) && (debug_level > 1)) {
+        fprintf(stderr, "\nDebug levels above 1 need a single input (no -i or --channels option)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    select_sample_kernels();
+    if (benchmark) {
+        benchmark_kernels(iq_decimation);
+        exit(0);
+    }
+
+    struct frame_output out;
+    memset(&out, 0, sizeof(out));
+    out.debug_level = debug_level;
+    out.uid_table = &transmitter_config;
+    if ((logfile != NULL) && (debug_level == 0) && binary_log) {
+        out.binary = binlog_open(logfile);
+        if (out.binary == NULL) {
+            fprintf(stderr, "\nFailed to open binary log file (or it isn't one)!\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if ((logfile != NULL) && (debug_level == 0)) {
+        out.fp = fopen(logfile, "a"); // Log file opened in append mode to avoid destroying data
+        out.samplecount = 0; // Reset sample counter
+        out.loggingok = 1;
+        if (out.fp == NULL) {
+            fprintf(stderr, "\nFailed to open log file!\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        out.loggingok = 0;
+    }
+    if (mqtt_server) {
+        mqtt_init(&mqtt, mqtt_server);
+        mqtt.topic = mqtt_topic;
+        mqtt.qos = mqtt_qos;
+        mqtt.keepalive = mqtt_keepalive;
+        if (mqtt_user)
+            mqtt.user = mqtt_user;
+        if (mqtt_store)
+            mqtt_store_open(&mqtt, mqtt_store, mqtt_store_size);
+        mqtt_start(&mqtt);
+        out.mqtt = &mqtt;
+    }
+    stats_start_time = time(NULL);
+    if (stats && !stats_start(stats)) {
+        fprintf(stderr, "\nFailed to set up statistics (--stats option) on %s\n", stats);
+        exit(EXIT_FAILURE);
+    }
+    if (windows) {
+        energy_init(&energy, windows, output_energy_report, &out);
+        out.energy = &energy;
+    }
+    out.format = format;
+    if (socket_path && ((out.fanout = fanout_start(socket_path)) == NULL)) {
+        fprintf(stderr, "\nFailed to serve the stream (--socket option) on %s\n", socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (debug_level > 0)
+        printf("\nEfergy Power Monitor Decoder - (debug level %d)\n\n", debug_level);
+    else if (format == FORMAT_TEXT)
+        printf("\nEfergy Energy Monitor Decoder\n\n");
+
+    // Recorded captures (regular files) are decoded straight from the mmap'ed file: nothing is waiting to write to
+    // them, so there is nothing to gain from the pipeline.
+    static struct efergy_decoder decoder;
+    struct stat st;
+    int stdin_capture = !supervisor.command && (fstat(STDIN_FILENO, &st) == 0) && S_ISREG(st.st_mode);
+    struct decoder_options options = { .debug_level = debug_level, .batch_decoder = batch_decoder,
+                                       .alternate_decodes = rescue, .start_ns = start_ns };
+    efergy_decoder_init(&decoder, &configured_timing, &transmitter_config, &options, display_frame_sink, &out);
+    if (replay || stdin_capture)
+        efergy_decoder_capture(&decoder);
+    if ((input_count == 0) && (channel_count == 0))
+        stats_register(&decoder.stats, supervisor.command ? "spawn" : "stdin");
+    if (replay)
+        replay_input(&decoder, &out, iq_decimation);
+    else if (channel_count > 0) {
+        int fd = STDIN_FILENO;
+        if (supervisor.command && ((fd = supervisor_start(&supervisor)) < 0)) {
+            fprintf(stderr, "\nFailed to start %s\n", supervisor.command);
+            exit(EXIT_FAILURE);
+        }
+        run_channels(channels, channel_count, fd, iq_rate, iq_decimation, &out, &options,
+                     supervisor.command ? &supervisor : NULL);
+        if (supervisor.command)
+            supervisor_stop(&supervisor);
+    }
+    else if (supervisor.command) {
+        int fd = supervisor_start(&supervisor);
+        if (fd < 0) {
+            fprintf(stderr, "\nFailed to start %s\n", supervisor.command);
+            exit(EXIT_FAILURE);
+        }
+        run_pipeline(&decoder, &out, fd, iq_decimation, &supervisor);
+        supervisor_stop(&supervisor);
+    }
+    else if (input_count > 0)
+        run_inputs(inputs, input_count, thread_count, &out, iq_decimation, &options);
+    else if (!single_thread && !stdin_capture)
+        run_pipeline(&decoder, &out, STDIN_FILENO, iq_decimation, NULL);
+    else {
+        struct sample_input input;
+        const int16_t *samples;
+        size_t sample_count;
+        input_open(&input, STDIN_FILENO, iq_decimation, configured_timing.sample_rate);
+        while ((sample_count = input_next_block(&input, &samples)) > 0)
+            efergy_decoder_push(&decoder, samples, sample_count);
+        input_close(&input);
+    }
+    if ((debug_level > 0) && (input_count == 0) && (channel_count == 0))
+        printf("%llu valid frames, %llu of them from alternate decodes\n", (unsigned long long) decoder.valid_frames,
+               (unsigned long long) decoder.rescued_frames);
+    if (out.mqtt)
+        mqtt_stop(out.mqtt, (debug_level > 0) || replay);
+    if (stats)
+        stats_stop();
+    if (out.fanout)
+        fanout_stop(out.fanout);
+
+    if (out.binary)
+        binlog_close(out.binary);
+    if (out.loggingok) {
+        fclose(out.fp); // If rtl-fm gives EOF and program terminates, close file gracefully.
+    }
 }
\ No newline at end of file
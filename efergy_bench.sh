@@ -0,0 +1,162 @@
+#!/bin/bash
+#
+# Decoder benchmark and regression check, no radio needed.  Run through make:
+#
+#  make bench                          - Report throughput, latency and frame error rate vs SNR
+#  make bench SAVE=baseline.txt        - ... and keep the results as a baseline
+#  make bench BASELINE=baseline.txt    - ... and fail if anything got worse than the baseline
+#  make bench CAPTURES="a.raw b.raw"   - ... also replaying recorded rtl_fm captures
+#  make bench MQTT=localhost           - ... also publishing to a local MQTT broker (Mosquitto, say)
+#
+# Throughput comes from a long synthetic capture replayed at maximum speed (EfergyRPI_log --replay), frame error
+# rate from efergy_synth captures at a range of SNRs, each with a mix of checksum and crc transmitters, inverted
+# polarity, a carrier offset and interfering bursts.  A frame counts as received when the decoder prints its exact
+# bytes with a good checksum or crc; frames it prints that were never sent count as false.  Captures are seeded, so
+# error rates only move when the decoder does.  Throughput is noisy: the check allows TOLERANCE percent (default 10).
+#
+# MQTT messages/s comes from the long capture's readings all arriving at once, latency (frame check to PUBACK, at
+# QoS 1) from a short capture fed in at about real time, and the backlog figure from the long capture's readings
+# queued in an --mqtt-store file while the broker was unreachable.
+#
+# The channelizer check decodes three transmitters spread over 1.92 MHz of IQ with --channels, each channel put
+# 5 to 12 kHz off its transmitter, and fails unless every channel gets all its transmitter's frames.
+#
+# The watchdog check runs the decoder in --spawn mode on a fake rtl_fm that sends a few frames and then stalls,
+# and fails unless the decoder restarts it and decodes the frames again.
+
+DECODER=${DECODER:-./EfergyRPI_log}
+SYNTH=${SYNTH:-./efergy_synth}
+TOLERANCE=${TOLERANCE:-10}
+SNRS=${SNRS:-"4 6 8 10 12 14 16 20"}
+FRAMES=${FRAMES:-300}
+SYNTH_OPTIONS="--type mixed -t 4 --invert 0.3 --offset 2000 --interferers 0.5"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+results="$work/results"
+
+# Prints the key=value pairs of --replay's report.  The decoder's exit status means nothing, so this goes by
+# whether the report is there.
+replay() {
+    "$DECODER" --replay -d 1 "$@" 2> "$work/replay.err" > "$work/replay.out"
+    grep -q '^replay: ' "$work/replay.err" || {
+        cat "$work/replay.err" >&2
+        kill $$
+    }
+    sed -n 's/^replay: //p' "$work/replay.err"
+}
+
+# value key "key=value ..."
+value() {
+    echo "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+# Frame bytes of the good frames in the last replay, one line of hex each
+good_frames() {
+    awk '/ (chksum|crc) ok/ { line = ""; for (i = 1; i <= NF; i++) if ($i ~ /^[0-9a-f][0-9a-f]$/) line = line (line == "" ? "" : " ") $i; print line }' \
+        "$work/replay.out"
+}
+
+echo "Throughput (synthetic capture)"
+"$SYNTH" -n 3000 -s 1 --snr 20 $SYNTH_OPTIONS > "$work/long.raw"
+stats=$(replay < "$work/long.raw")
+printf "  %-24s %10s Msamples/s %8sx real time %10s frames/s   latency mean %s us, p99 %s us, max %s us\n" synthetic \
+    "$(value msamples_per_s "$stats")" "$(value realtime "$stats")" "$(value frames_per_s "$stats")" \
+    "$(value latency_mean_us "$stats")" "$(value latency_p99_us "$stats")" "$(value latency_max_us "$stats")"
+echo "throughput $(value msamples_per_s "$stats")" >> "$results"
+
+for capture in $CAPTURES; do
+    stats=$(replay < "$capture")
+    printf "  %-24s %10s Msamples/s %8sx real time %10s frames/s   latency mean %s us, p99 %s us, max %s us\n" \
+        "$(basename "$capture")" "$(value msamples_per_s "$stats")" "$(value realtime "$stats")" \
+        "$(value frames_per_s "$stats")" "$(value latency_mean_us "$stats")" "$(value latency_p99_us "$stats")" \
+        "$(value latency_max_us "$stats")"
+done
+
+if [ -n "$MQTT" ]; then
+    echo
+    echo "MQTT ($MQTT, QoS 1)"
+    "$DECODER" --replay --mqtt "$MQTT" --mqtt-qos 1 < "$work/long.raw" 2> "$work/mqtt.err" > /dev/null
+    stats=$(sed -n 's/^mqtt: //p' "$work/mqtt.err")
+    printf "  %-24s %10s messages/s   latency mean %s us, max %s us   (%s dropped, %s unsent)\n" burst \
+        "$(value messages_per_s "$stats")" "$(value latency_mean_us "$stats")" "$(value latency_max_us "$stats")" \
+        "$(value dropped "$stats")" "$(value unsent "$stats")"
+    "$SYNTH" -n 50 -s 2 --snr 20 --gap 50 > "$work/paced.raw"
+    split -n 100 "$work/paced.raw" "$work/piece."
+    for piece in "$work"/piece.*; do
+        cat "$piece"
+        sleep 0.03
+    done | "$DECODER" --replay --mqtt "$MQTT" --mqtt-qos 1 2> "$work/mqtt.err" > /dev/null
+    stats=$(sed -n 's/^mqtt: //p' "$work/mqtt.err")
+    printf "  %-24s %10s messages/s   latency mean %s us, max %s us   (%s dropped, %s unsent)\n" paced \
+        "$(value messages_per_s "$stats")" "$(value latency_mean_us "$stats")" "$(value latency_max_us "$stats")" \
+        "$(value dropped "$stats")" "$(value unsent "$stats")"
+    "$DECODER" --replay --mqtt 127.0.0.1:1 --mqtt-store "$work/backlog.store" < "$work/long.raw" > /dev/null 2>&1
+    "$DECODER" --replay --mqtt "$MQTT" --mqtt-qos 1 --mqtt-store "$work/backlog.store" < /dev/null \
+        2> "$work/mqtt.err" > /dev/null
+    stats=$(sed -n 's/^mqtt: //p' "$work/mqtt.err")
+    printf "  %-24s %10s messages/s   (%s published, %s unsent)\n" backlog \
+        "$(value messages_per_s "$stats")" "$(value published "$stats")" "$(value unsent "$stats")"
+fi
+
+echo
+echo "Channelizer (3 transmitters at -290, +5 and +262 kHz, --iq 1920000 --channels -300k,0,250k)"
+"$SYNTH" --iq 1920000 -n 150 -s 4 --snr 14 -t 3 --freqs -290000,5000,262000 --invert 0.3 > "$work/wide.raw"
+start=$(date +%s.%N)
+"$DECODER" --iq 1920000 --channels -300k,0,250k -d 1 < "$work/wide.raw" > "$work/wide.out" 2> /dev/null
+end=$(date +%s.%N)
+grep '^Channel ' "$work/wide.out" | sed 's/^/  /'
+# Less the decoder's one second start up wait
+awk -v pairs="$(($(stat -c %s "$work/wide.raw") / 2))" -v seconds="$(awk -v s="$start" -v e="$end" 'BEGIN { print e - s - 1 }')" \
+    'BEGIN { printf "  %.1fx real time\n", pairs / 1920000 / seconds }'
+if [ "$(grep -c '^Channel .*: 50 valid frames' "$work/wide.out")" -ne 3 ]; then
+    echo "FAILED: a channel missed frames"
+    exit 1
+fi
+
+echo
+echo "Watchdog (fake rtl_fm sending 10 frames, then stalling)"
+"$SYNTH" -n 10 -s 3 > "$work/stall.raw"
+timeout -s INT 7 "$DECODER" --watchdog 1 --spawn "cat '$work/stall.raw'; sleep 3600" > "$work/watchdog.out" \
+    2> "$work/watchdog.err"
+restarts=$(grep -c "restarting" "$work/watchdog.err")
+readings=$(grep -c "," "$work/watchdog.out")
+printf "  %s restarts, %s readings\n" "$restarts" "$readings"
+if [ "$restarts" -lt 1 ] || [ "$readings" -le 10 ]; then
+    echo "FAILED: the stalled command wasn't restarted and decoded again"
+    cat "$work/watchdog.err"
+    exit 1
+fi
+
+echo
+echo "Frame error rate ($FRAMES frames per SNR: $SYNTH_OPTIONS)"
+printf "  %6s %10s %10s %10s %8s\n" "SNR dB" sent received false FER
+for snr in $SNRS; do
+    "$SYNTH" -n "$FRAMES" -s "$snr" --snr "$snr" $SYNTH_OPTIONS -e "$work/sent.txt" > "$work/snr.raw"
+    replay < "$work/snr.raw" > /dev/null
+    good_frames | sort > "$work/received.txt"
+    sort "$work/sent.txt" > "$work/sent_sorted.txt"
+    sent=$(wc -l < "$work/sent_sorted.txt")
+    received=$(comm -12 "$work/sent_sorted.txt" "$work/received.txt" | wc -l)
+    false_frames=$(comm -13 "$work/sent_sorted.txt" "$work/received.txt" | wc -l)
+    fer=$(awk -v s="$sent" -v r="$received" 'BEGIN { printf "%.3f", 1 - r / s }')
+    printf "  %6s %10s %10s %10s %8s\n" "$snr" "$sent" "$received" "$false_frames" "$fer"
+    echo "fer$snr $fer" >> "$results"
+    echo "false$snr $false_frames" >> "$results"
+done
+
+[ -n "$SAVE" ] && cp "$results" "$SAVE" && echo && echo "Saved as $SAVE"
+
+if [ -n "$BASELINE" ]; then
+    echo
+    awk -v tolerance="$TOLERANCE" '
+        FNR == NR { baseline[$1] = $2; next }
+        !($1 in baseline) { next }
+        $1 == "throughput" && $2 < baseline[$1] * (1 - tolerance / 100) {
+            printf "REGRESSION: throughput %s Msamples/s, baseline %s\n", $2, baseline[$1]; failed = 1; next }
+        $1 ~ /^fer/ && $2 > baseline[$1] + 0.005 {
+            printf "REGRESSION: %s dB frame error rate %s, baseline %s\n", substr($1, 4), $2, baseline[$1]; failed = 1; next }
+        $1 ~ /^false/ && $2 > baseline[$1] {
+            printf "REGRESSION: %s false frames at %s dB, baseline %s\n", $2, substr($1, 6), baseline[$1]; failed = 1; next }
+        END { if (!failed) print "No regressions against the baseline"; exit failed }' "$BASELINE" "$results"
+fi
@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# CPU cost of the built-in IQ front end (--iq) against rtl_fm doing the FM demodulation:
+#
+#  ./efergy_iqbench.sh                 - Decode synthetic IQ test vectors, and the same frames as rtl_fm output
+#  LIVE=30 ./efergy_iqbench.sh         - ... then 30 s each of rtl_fm | EfergyRPI_log and rtl_sdr | EfergyRPI_log --iq
+#
+# The test vectors come from efergy_synth (seeded, so always the same): FRAMES frames (default 300) at SNR dB
+# (default 20), as rtl_sdr IQ at IQ_RATE (default 288000) and as rtl_fm output at 96000.  Each is decoded with
+# --replay, and the report gives the decoder's user + system CPU time per second of signal, as a percentage of one
+# core, and the frames decoded of those sent.  rtl_fm can only read a dongle, so the rtl_fm output row is the decoder
+# alone; with LIVE set, both pipelines are run on the dongle in turn and the figure covers every process in them.
+
+DECODER=${DECODER:-./EfergyRPI_log}
+SYNTH=${SYNTH:-./efergy_synth}
+FRAMES=${FRAMES:-300}
+SNR=${SNR:-20}
+IQ_RATE=${IQ_RATE:-288000}
+FREQUENCY=${FREQUENCY:-433510000}
+TIMEFORMAT="%3R %3U %3S"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# run label signal_seconds command... - the command's stdout is the decoder's -d 1 output
+run() {
+    local label=$1 seconds=$2 t
+    shift 2
+    t=$( { time "$@" > "$work/out" 2> /dev/null; } 2>&1 )
+    [ "$seconds" = wall ] && seconds=$(echo "$t" | awk '{ print $1 }')
+    printf "%-36s %8.1f %8.2f%% %10s\n" "$label" "$seconds" \
+        "$(echo "$t $seconds" | awk '{ print ($2 + $3) / $4 * 100 }')" \
+        "$(grep -c ' ok' "$work/out")$([ -n "$sent" ] && echo "/$sent")"
+}
+
+"$SYNTH" -n "$FRAMES" --snr "$SNR" -e "$work/sent" > "$work/fm.raw" 2> /dev/null
+"$SYNTH" -n "$FRAMES" --snr "$SNR" --iq "$IQ_RATE" > "$work/iq.raw" 2> /dev/null
+sent=$(wc -l < "$work/sent")
+
+printf "%-36s %8s %9s %10s\n" input "signal s" "CPU" frames
+run "rtl_fm output, 96000 (decoder only)" "$(stat -c %s "$work/fm.raw" | awk '{ print $1 / 2 / 96000 }')" \
+    "$DECODER" --replay -d 1 < "$work/fm.raw"
+run "rtl_sdr IQ, $IQ_RATE (--iq)" "$(stat -c %s "$work/iq.raw" | awk -v rate="$IQ_RATE" '{ print $1 / 2 / rate }')" \
+    "$DECODER" --replay -d 1 --iq "$IQ_RATE" < "$work/iq.raw"
+
+if [ -n "$LIVE" ]; then
+    for tool in rtl_fm rtl_sdr; do
+        command -v $tool > /dev/null || { echo "LIVE needs $tool" >&2; exit 1; }
+    done
+    sent=
+    run "rtl_fm | EfergyRPI_log (live)" wall \
+        bash -c "timeout -s INT $LIVE rtl_fm -f $FREQUENCY -s 200000 -r 96000 -g 50 - 2> /dev/null | $DECODER -d 1"
+    run "rtl_sdr | EfergyRPI_log --iq (live)" wall \
+        bash -c "timeout -s INT $LIVE rtl_sdr -f $FREQUENCY -s $IQ_RATE -g 19.7 - 2> /dev/null | $DECODER -d 1 --iq $IQ_RATE"
+fi
@@ -0,0 +1,570 @@
+// EFERGY BINARY LOG READER
+//
+// Compile:
+//  gcc -O3 -o efergy_logtool efergy_logtool.c
+//
+// Run:
+//  ./EfergyRPI_log --log-format binary energy.log
+//  ./efergy_logtool stats energy.log
+//  ./efergy_logtool stats --from 2026-10-01 --to 2026-10-08 --interval 3600 energy.log
+//  ./efergy_logtool csv --uid 34 --from 2026-10-17T06:00 energy.log > morning.csv
+//
+// Reads the fixed width binary log EfergyRPI_log writes with --log-format binary.  The log is memory mapped and
+// only the records in the --from/--to range are touched: the range is found by binary search on the UTC timestamps.
+// These are when each frame was received, by the decoder's sample clock, so they only go wrong if the clock was
+// stepped back while logging or a capture was backfilled (--start) into a log that already runs past it.  The range
+// is then right up to the step, not to the record.
+//
+// csv writes one line per reading: time,uid,watts, the time in UTC as ISO 8601 with milliseconds, or with --local
+// as local "%x,%X" like EfergyRPI_log's own CSV logs.  Formatting is by hand, with the date worked out once per day
+// (once per second with --local), so exporting runs at close to disk speed.
+//
+// stats prints, for each transmitter, the readings, the time span, the minimum, mean and maximum watts and the
+// energy in kWh.  Energy is the area under the readings, joining successive readings of a transmitter with straight
+// lines; a gap longer than --max-gap seconds (a transmitter out of range, the decoder stopped) counts as nothing
+// rather than being bridged.  With --interval the same goes out as CSV, one line per transmitter per interval,
+// energy split at the interval boundaries.
+//------------------------------------------------------------------------------
+#define _GNU_SOURCE     // strptime, timegm
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DEFAULT_MAX_GAP_SECONDS 60      /* Transmitters send every 6 to 10 seconds (up to 20 on low battery) */
+#define OUTPUT_BUFFER_SIZE      (1 << 20)
+#define OUTPUT_LINE_MAX         128
+
+// The log format, as written by EfergyRPI_log.c, which has the master copy of these.  They must match.
+#define BINLOG_MAGIC            "EfergyL1"
+#define BINLOG_BLOCK_SIZE       4096
+#define BINLOG_RECORD_SIZE      64
+#define BINLOG_BLOCK_RECORDS    (BINLOG_BLOCK_SIZE / BINLOG_RECORD_SIZE)
+#define BINLOG_RESCUED          0x01
+#define BINLOG_NEGATIVE_PULSES  0x02
+
+struct binlog_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t record_size;
+    int64_t created_utc_ns;
+};
+
+struct binlog_record {
+    int64_t utc_ns;
+    int64_t monotonic_ns;
+    double watts;
+    uint64_t seq;
+    uint16_t input;
+    uint8_t uid;
+    uint8_t valid_type;         // 1 checksum, 2 crc, 0 not a record
+    uint8_t flags;
+    uint8_t bytecount;
+    uint8_t bytes[9];
+    uint8_t reserved[15];
+    uint16_t crc;
+};
+
+_Static_assert(sizeof(struct binlog_record) == BINLOG_RECORD_SIZE, "binlog_record must be 64 bytes");
+
+struct uid_stats {
+    uint64_t count;
+    int64_t first_ns, last_ns;
+    double last_watts;
+    double min, max, sum;
+    double joules;
+};
+
+// Settings
+int64_t from_ns = INT64_MIN;
+int64_t to_ns = INT64_MAX;
+int uid_filter = -1;
+int local_time = 0;
+int verify = 0;
+double max_gap_seconds = DEFAULT_MAX_GAP_SECONDS;
+int64_t interval_ns = 0;
+
+uint16_t crc_table[256];
+
+static void init_crc_table(void) {
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        crc_table[i] = crc;
+    }
+}
+
+// EfergyRPI_log's compute_crc() (CRC-CCITT xmodem of all but the last two bytes), a byte at a time
+static int record_crc_ok(const struct binlog_record *r) {
+    const unsigned char *bytes = (const unsigned char *) r;
+    uint16_t crc = 0;
+    int i;
+    for (i = 0; i < BINLOG_RECORD_SIZE - 2; i++)
+        crc = (crc << 8) ^ crc_table[(crc >> 8) ^ bytes[i]];
+    return crc == r->crc;
+}
+
+static int record_ok(const struct binlog_record *r) {
+    return (r->valid_type != 0) && record_crc_ok(r);
+}
+
+// Buffered stdout
+char output[OUTPUT_BUFFER_SIZE];
+size_t output_length;
+
+static void output_flush(void) {
+    size_t done = 0;
+    while (done < output_length) {
+        ssize_t n = write(STDOUT_FILENO, output + done, output_length - done);
+        if (n <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    output_length = 0;
+}
+
+static char *output_reserve(void) {
+    if (output_length > OUTPUT_BUFFER_SIZE - OUTPUT_LINE_MAX)
+        output_flush();
+    return output + output_length;
+}
+
+static char *put_digits(char *p, unsigned value, int digits) {
+    int i;
+    for (i = digits - 1; i >= 0; i--) {
+        p[i] = '0' + value % 10;
+        value /= 10;
+    }
+    return p + digits;
+}
+
+static char *put_unsigned(char *p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+// value to 3 or 6 decimal places, like printf's %.3f or %.6f for the range readings come in
+static char *put_fixed(char *p, double value, int decimals) {
+    uint64_t scale = (decimals == 3) ? 1000 : 1000000;
+    if (value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    uint64_t scaled = (uint64_t) (value * scale + 0.5);
+    p = put_unsigned(p, scaled / scale);
+    *p++ = '.';
+    return put_digits(p, scaled % scale, decimals);
+}
+
+// Civil date from days since 1970-01-01 (Howard Hinnant's algorithm)
+static void civil_from_days(int64_t days, int *year, unsigned *month, unsigned *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned) (days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = (int) (yoe + era * 400) + (*month <= 2);
+}
+
+// Writes the time column(s), caching the date (UTC) or the whole second (local time)
+static char *put_time(char *p, int64_t utc_ns) {
+    static int64_t cached_key = INT64_MIN;
+    static char cached[64];
+    static int cached_length;
+    int64_t seconds = utc_ns / 1000000000 - (utc_ns % 1000000000 < 0);
+    unsigned msec = (unsigned) ((utc_ns - seconds * 1000000000) / 1000000);
+
+    if (local_time) {
+        if (seconds != cached_key) {
+            time_t t = seconds;
+            struct tm tm;
+            cached_length = strftime(cached, sizeof(cached), "%x,%X", localtime_r(&t, &tm));
+            cached_key = seconds;
+        }
+        memcpy(p, cached, cached_length);
+        return p + cached_length;
+    }
+
+    int64_t days = seconds / 86400 - (seconds % 86400 < 0);
+    unsigned second_of_day = (unsigned) (seconds - days * 86400);
+    if (days != cached_key) {
+        int year;
+        unsigned month, day;
+        civil_from_days(days, &year, &month, &day);
+        cached_length = snprintf(cached, sizeof(cached), "%04d-%02u-%02uT", year, month, day);
+        cached_key = days;
+    }
+    memcpy(p, cached, cached_length);
+    p += cached_length;
+    p = put_digits(p, second_of_day / 3600, 2);
+    *p++ = ':';
+    p = put_digits(p, second_of_day / 60 % 60, 2);
+    *p++ = ':';
+    p = put_digits(p, second_of_day % 60, 2);
+    *p++ = '.';
+    p = put_digits(p, msec, 3);
+    *p++ = 'Z';
+    return p;
+}
+
+// Unix seconds (with a fraction if need be) or YYYY-MM-DD[THH:MM[:SS]], in UTC or with --local local time.
+// Returns 0 if it is neither.
+static int parse_time(const char *text, int64_t *ns) {
+    struct tm tm;
+    char *end;
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(text, "%Y-%m-%d", &tm)) != NULL) {
+        if (((*end == 'T') || (*end == ' ')) && ((end = strptime(end + 1, "%H:%M", &tm)) != NULL) && (*end == ':'))
+            end = strptime(end + 1, "%S", &tm);
+        if ((end == NULL) || (*end != '\0'))
+            return 0;
+        tm.tm_isdst = -1;
+        *ns = (int64_t) (local_time ? mktime(&tm) : timegm(&tm)) * 1000000000;
+        return 1;
+    }
+    double seconds = strtod(text, &end);
+    if ((end == text) || (*end != '\0'))
+        return 0;
+    *ns = (int64_t) (seconds * 1e9);
+    return 1;
+}
+
+// The records of a log, and how many of them there are: up to the first bad one in the last block
+static const struct binlog_record *map_log(const char *path, size_t *count) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        fprintf(stderr, "\nFailed to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size < BINLOG_BLOCK_SIZE) {
+        fprintf(stderr, "\n%s isn't an EfergyRPI_log binary log\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "\nFailed to map %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const struct binlog_header *header = (const struct binlog_header *) map;
+    if ((memcmp(header->magic, BINLOG_MAGIC, sizeof(header->magic)) != 0) ||
+            (header->block_size != BINLOG_BLOCK_SIZE) || (header->record_size != BINLOG_RECORD_SIZE)) {
+        fprintf(stderr, "\n%s isn't an EfergyRPI_log binary log (or is from a different version)\n", path);
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+    const struct binlog_record *records = (const struct binlog_record *) (map + BINLOG_BLOCK_SIZE);
+    size_t n = (st.st_size - BINLOG_BLOCK_SIZE) / BINLOG_RECORD_SIZE;
+    size_t last_block = (n > 0) ? (n - 1) / BINLOG_BLOCK_RECORDS * BINLOG_BLOCK_RECORDS : 0;
+    size_t i;
+    for (i = last_block; (i < n) && record_ok(&records[i]); i++)
+        ;
+    *count = i;
+    return records;
+}
+
+// First record at or after ns
+static size_t find_time(const struct binlog_record *records, size_t count, int64_t ns) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (records[middle].utc_ns < ns)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Intervals of --interval stay open until no reading can bridge a gap back into them, in a ring of slots
+struct interval_slot {
+    int64_t number;             // start / interval_ns
+    int used;
+    uint64_t present[4];        // Bit per uid with readings or energy here
+    struct uid_stats uids[256];
+};
+
+struct interval_slot *slots;
+int slot_count;
+int64_t oldest_interval;        // Earliest one still open
+int open_intervals;
+
+static struct interval_slot *interval_slot(int64_t number) {
+    struct interval_slot *slot = &slots[number % slot_count];
+    if (!slot->used) {
+        slot->used = 1;
+        slot->number = number;
+        open_intervals++;
+    }
+    return slot;
+}
+
+static struct uid_stats *interval_uid(struct interval_slot *slot, int uid) {
+    slot->present[uid >> 6] |= 1ULL << (uid & 63);
+    return &slot->uids[uid];
+}
+
+// An interval a transmitter has energy in but no readings (a gap longer than the interval) has empty watts columns
+static void print_interval(struct interval_slot *slot) {
+    int word;
+    for (word = 0; word < 4; word++) while (slot->present[word]) {
+        int uid = word * 64 + __builtin_ctzll(slot->present[word]);
+        slot->present[word] &= slot->present[word] - 1;
+        struct uid_stats *s = &slot->uids[uid];
+        char *p = output_reserve();
+        p = put_time(p, slot->number * interval_ns);
+        *p++ = ',';
+        p = put_unsigned(p, uid);
+        *p++ = ',';
+        p = put_unsigned(p, s->count);
+        *p++ = ',';
+        if (s->count) {
+            p = put_fixed(p, s->min, 3);
+            *p++ = ',';
+            p = put_fixed(p, s->sum / s->count, 3);
+            *p++ = ',';
+            p = put_fixed(p, s->max, 3);
+            *p++ = ',';
+        } else {
+            memcpy(p, ",,,", 3);
+            p += 3;
+        }
+        p = put_fixed(p, s->joules / 3.6e6, 6);
+        *p++ = '\n';
+        output_length = p - output;
+        memset(s, 0, sizeof(*s));
+    }
+    slot->used = 0;
+    open_intervals--;
+}
+
+// Prints the open intervals that end before until, oldest first
+static void close_intervals(int64_t until_ns) {
+    while ((open_intervals > 0) && ((oldest_interval + 1) * interval_ns <= until_ns)) {
+        struct interval_slot *slot = &slots[oldest_interval % slot_count];
+        if (slot->used && (slot->number == oldest_interval))
+            print_interval(slot);
+        oldest_interval++;
+    }
+}
+
+// Energy of the straight line from (from, from_watts) to (to, to_watts), split between the intervals it crosses
+static void add_interval_energy(int uid, int64_t from, int64_t to, double from_watts, double to_watts) {
+    int64_t number = from / interval_ns;
+    for (; number * interval_ns < to; number++) {
+        int64_t start = (number * interval_ns > from) ? number * interval_ns : from;
+        int64_t end = ((number + 1) * interval_ns < to) ? (number + 1) * interval_ns : to;
+        double start_watts = from_watts + (to_watts - from_watts) * (double) (start - from) / (to - from);
+        double end_watts = from_watts + (to_watts - from_watts) * (double) (end - from) / (to - from);
+        interval_uid(interval_slot(number), uid)->joules += (start_watts + end_watts) / 2 * ((end - start) / 1e9);
+    }
+}
+
+static void add_reading(struct uid_stats *s, int64_t ns, double watts) {
+    if ((s->count == 0) || (watts < s->min))
+        s->min = watts;
+    if ((s->count == 0) || (watts > s->max))
+        s->max = watts;
+    if (s->count == 0)
+        s->first_ns = ns;
+    s->sum += watts;
+    s->count++;
+}
+
+static void usage(const char *name) {
+    printf("\nUsage: %s csv|stats [options] log\n", name);
+    printf("       csv                - Readings as CSV: time,uid,watts\n");
+    printf("       stats              - Readings, watts and kWh per transmitter\n");
+    printf("       --from time        - From this time: unix seconds or YYYY-MM-DD[THH:MM[:SS]], UTC\n");
+    printf("       --to time          - Up to (not including) this time\n");
+    printf("       --uid uid          - Only this transmitter\n");
+    printf("       --local            - Times in and out are local time, and csv times look like EfergyRPI_log's\n");
+    printf("       --interval secs    - stats as CSV per interval: start,uid,readings,min,mean,max,kwh\n");
+    printf("       --max-gap secs     - Longest gap between readings bridged for kWh, default %d\n",
+           DEFAULT_MAX_GAP_SECONDS);
+    printf("       --verify           - Check every record's crc, and count the bad ones (skipped) on stderr\n");
+}
+
+int main(int argc, char **argv) {
+    const char *command = NULL, *path = NULL;
+    const char *from_text = NULL, *to_text = NULL;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+        if (strncmp(argv[arg], "-h", 2) == 0) {
+            usage(argv[0]);
+            exit(0);
+        } else if (strcmp(argv[arg], "--local") == 0) {
+            local_time = 1;
+        } else if (strcmp(argv[arg], "--verify") == 0) {
+            verify = 1;
+        } else if (argv[arg][0] != '-') {
+            if (command == NULL)
+                command = argv[arg];
+            else
+                path = argv[arg];
+        } else if (value == NULL) {
+            fprintf(stderr, "\nOption %s needs a value, see %s -h\n", argv[arg], argv[0]);
+            exit(EXIT_FAILURE);
+        } else {
+            arg++;
+            if (strcmp(argv[arg - 1], "--from") == 0)
+                from_text = value;
+            else if (strcmp(argv[arg - 1], "--to") == 0)
+                to_text = value;
+            else if (strcmp(argv[arg - 1], "--uid") == 0)
+                uid_filter = strtol(value, NULL, 0);
+            else if (strcmp(argv[arg - 1], "--interval") == 0)
+                interval_ns = (int64_t) (strtod(value, NULL) * 1e9);
+            else if (strcmp(argv[arg - 1], "--max-gap") == 0)
+                max_gap_seconds = strtod(value, NULL);
+            else {
+                fprintf(stderr, "\nUnknown option %s, see %s -h\n", argv[arg - 1], argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if ((command == NULL) || (path == NULL) || ((strcmp(command, "csv") != 0) && (strcmp(command, "stats") != 0))) {
+        fprintf(stderr, "\nNeeds a command (csv or stats) and a log, see %s -h\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // Parsed once --local is known, wherever it came
+    if ((from_text && !parse_time(from_text, &from_ns)) || (to_text && !parse_time(to_text, &to_ns))) {
+        fprintf(stderr, "\nTimes (--from, --to options) must be unix seconds or YYYY-MM-DD[THH:MM[:SS]]\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((uid_filter < -1) || (uid_filter > 255)) {
+        fprintf(stderr, "\nTransmitter (--uid option) must be 0..255\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((interval_ns < 0) || (max_gap_seconds <= 0)) {
+        fprintf(stderr, "\nInterval and gap (--interval, --max-gap options) must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    init_crc_table();
+
+    size_t count;
+    const struct binlog_record *records = map_log(path, &count);
+    size_t first = find_time(records, count, from_ns);
+    size_t last = (to_ns == INT64_MAX) ? count : find_time(records, count, to_ns);
+    int64_t max_gap_ns = (int64_t) (max_gap_seconds * 1e9);
+    uint64_t bad = 0;
+    size_t i;
+
+    if (strcmp(command, "csv") == 0) {
+        char *p = output_reserve();
+        p += sprintf(p, local_time ? "date,time,uid,watts\n" : "time,uid,watts\n");
+        output_length = p - output;
+        for (i = first; i < last; i++) {
+            const struct binlog_record *r = &records[i];
+            if ((uid_filter >= 0) && (r->uid != uid_filter))
+                continue;
+            if ((r->valid_type == 0) || (verify && !record_crc_ok(r))) {
+                bad++;
+                continue;
+            }
+            p = output_reserve();
+            p = put_time(p, r->utc_ns);
+            *p++ = ',';
+            p = put_unsigned(p, r->uid);
+            *p++ = ',';
+            p = put_fixed(p, r->watts, 3);
+            *p++ = '\n';
+            output_length = p - output;
+        }
+    } else {
+        struct uid_stats total[256];
+        memset(total, 0, sizeof(total));
+        if (interval_ns) {
+            slot_count = max_gap_ns / interval_ns + 2;
+            slots = calloc(slot_count, sizeof(struct interval_slot));
+            if (slots == NULL) {
+                fprintf(stderr, "\nInterval (--interval option) too short for --max-gap\n");
+                exit(EXIT_FAILURE);
+            }
+            printf("start,uid,readings,min,mean,max,kwh\n");
+            fflush(stdout);
+        }
+        for (i = first; i < last; i++) {
+            const struct binlog_record *r = &records[i];
+            if ((uid_filter >= 0) && (r->uid != uid_filter))
+                continue;
+            if ((r->valid_type == 0) || (verify && !record_crc_ok(r))) {
+                bad++;
+                continue;
+            }
+            struct uid_stats *t = &total[r->uid];
+            int64_t gap = r->utc_ns - t->last_ns;
+            int bridged = (t->count > 0) && (gap > 0) && (gap <= max_gap_ns);
+
+            if (bridged)
+                t->joules += (t->last_watts + r->watts) / 2 * (gap / 1e9);
+            add_reading(t, r->utc_ns, r->watts);
+            if (interval_ns) {
+                // Nothing from here on can bridge back past max_gap.  Readings from before the oldest open
+                // interval (the clock stepped back) go in that.
+                int64_t number = r->utc_ns / interval_ns;
+                if (open_intervals == 0)
+                    oldest_interval = number;
+                close_intervals(r->utc_ns - max_gap_ns);
+                if (number < oldest_interval)
+                    number = oldest_interval;
+                if (bridged && (t->last_ns >= oldest_interval * interval_ns))
+                    add_interval_energy(r->uid, t->last_ns, r->utc_ns, t->last_watts, r->watts);
+                add_reading(interval_uid(interval_slot(number), r->uid), r->utc_ns, r->watts);
+            }
+            t->last_ns = r->utc_ns;
+            t->last_watts = r->watts;
+        }
+
+        if (interval_ns) {
+            close_intervals(INT64_MAX);
+        } else {
+            int uid;
+            printf("%5s %10s %-24s %-24s %10s %10s %10s %12s\n", "uid", "readings", "first", "last",
+                   "min W", "mean W", "max W", "kWh");
+            fflush(stdout);
+            for (uid = 0; uid < 256; uid++) {
+                const struct uid_stats *t = &total[uid];
+                if (t->count == 0)
+                    continue;
+                char *p = output_reserve();
+                p += sprintf(p, "%5d %10llu ", uid, (unsigned long long) t->count);
+                char *time_start = p;
+                p = put_time(p, t->first_ns);
+                p += sprintf(p, "%*s", 25 - (int) (p - time_start), "");
+                time_start = p;
+                p = put_time(p, t->last_ns);
+                p += sprintf(p, "%*s", 25 - (int) (p - time_start), "");
+                p += sprintf(p, "%10.3f %10.3f %10.3f %12.6f\n", t->min, t->sum / t->count, t->max, t->joules / 3.6e6);
+                output_length = p - output;
+            }
+        }
+    }
+    output_flush();
+    if (bad)
+        fprintf(stderr, "%llu bad records skipped\n", (unsigned long long) bad);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Input throughput of the decoder on recorded rtl_fm captures, no radio needed:
+#
+#  ./efergy_readbench.sh a.raw b.raw                        - Msamples/s for each capture, from a file and a pipe
+#  REF=./EfergyRPI_log.old ./efergy_readbench.sh a.raw      - ... next to the same figures for another build
+#
+# A capture is what rtl_fm writes, e.g. rtl_fm -f 433510000 -s 200000 -r 96000 -g 50 > a.raw.  Each capture goes to
+# the decoder's stdin once as a regular file, which it maps, and once through a pipe, which it reads in blocks.  The
+# figure is samples over the decoder's user + system CPU time, best of RUNS (default 3), so the one second start-up
+# delay and time spent waiting for the pipe don't count.
+
+DECODER=${DECODER:-./EfergyRPI_log}
+RUNS=${RUNS:-3}
+TIMEFORMAT="%3U %3S"
+
+if [ $# -eq 0 ]; then
+    echo "usage: [DECODER=...] [REF=...] [RUNS=n] $0 capture.raw..." >&2
+    exit 1
+fi
+
+# cpu_seconds decoder capture file|pipe
+cpu_seconds() {
+    local run t best=
+    for ((run = 0; run < RUNS; run++)); do
+        if [ "$3" = file ]; then
+            t=$( { time "$1" < "$2" > /dev/null 2>&1; } 2>&1 )
+        else
+            t=$(cat "$2" | { time "$1" > /dev/null 2>&1; } 2>&1)
+        fi
+        best=$(echo "$t $best" | awk '{ t = $1 + $2; if ($3 != "" && $3 < t) t = $3; print t }')
+    done
+    echo "$best"
+}
+
+# msamples_per_s samples seconds
+msamples_per_s() {
+    awk -v n="$1" -v s="$2" 'BEGIN { if (s > 0) printf "%.1f", n / s / 1e6; else print "-" }'
+}
+
+printf "%-24s %12s %10s %10s" capture Msamples file pipe
+[ -n "$REF" ] && printf " %10s %10s" "ref file" "ref pipe"
+printf "   (Msamples/s)\n"
+for capture in "$@"; do
+    samples=$(( $(stat -c %s "$capture") / 2 ))
+    printf "%-24s %12s" "$(basename "$capture")" "$(msamples_per_s "$samples" 1)"
+    for decoder in "$DECODER" $REF; do
+        for mode in file pipe; do
+            printf " %10s" "$(msamples_per_s "$samples" "$(cpu_seconds "$decoder" "$capture" $mode)")"
+        done
+    done
+    printf "\n"
+done
@@ -0,0 +1,370 @@
+// EFERGY TRANSMITTER SIGNAL SYNTHESIZER
+//
+// Compile:
+//  gcc -O3 -o efergy_synth efergy_synth.c -lm
+//
+// Run:
+//  ./efergy_synth -n 500 --snr 10 -e expected.txt > capture.raw
+//  ./EfergyRPI_log --replay -d 1 < capture.raw
+//
+// Produces what rtl_fm (or with --iq, rtl_sdr) would have recorded from a few Efergy transmitters, so the decoder
+// can be measured and regression checked on any Linux box, no radio or meter box needed.  The signal is built at
+// complex baseband: each transmitter's FSK frames (checksum or crc, either polarity, with a carrier offset),
+// optional interfering bursts on other frequencies, and white noise at the requested SNR.  For rtl_fm output it is
+// then run through a polar discriminator at twice the output rate and averaged down, like rtl_fm -s 192000 -r 96000,
+// and scaled the way rtl_fm scales it (pi == 1 << 14).  With --iq the baseband itself is written out as rtl_sdr's
+// unsigned 8 bit I/Q pairs.
+//
+// SNR is the carrier to noise ratio over the full (complex) sample rate, so the same --snr is worth more at a
+// higher --iq rate, just as it would be on air.  The frames go to -e's file, one line of hex bytes each, in the
+// order they were sent: the format EfergyRPI_log -d 1 prints them in.
+//------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define DEFAULT_SAMPLE_RATE     96000
+#define DEFAULT_IQ_SAMPLE_RATE  288000
+#define RTL_FM_OVERSAMPLE       2       /* Discriminator samples per output sample in rtl_fm mode */
+#define DEFAULT_DEVIATION_HZ    18000   /* About +/-3000 out of rtl_fm -s 200000 -r 96000, like a real transmitter */
+#define DEFAULT_GAP_MS          40      /* Mean gap between frames.  Real transmitters send every 6 to 10 seconds */
+#define IQ_AMPLITUDE            40.0    /* Carrier amplitude in 8 bit IQ, leaving headroom for noise and interferers */
+
+// Efergy frame timing, from rtl_fm captures at 96000 samples/s
+#define BIT_SECONDS             (18.0 / 96000)
+#define SHORT_PULSE_SECONDS     (6.0 / 96000)
+#define PREAMBLE_LOW_SECONDS    (180.0 / 96000)
+#define PREAMBLE_HIGH_SECONDS   (48.0 / 96000)
+#define TRAILER_SECONDS         (200.0 / 96000)
+
+#define MAX_TRANSMITTERS        16
+#define FRAME_BYTES_CRC         9
+#define FRAME_BYTES_CHECKSUM    8
+#define INTERFERER_MIN_SECONDS  0.010
+#define INTERFERER_MAX_SECONDS  0.050
+
+#define TYPE_MIXED      0
+#define TYPE_CHECKSUM   1
+#define TYPE_CRC        2
+
+struct transmitter {
+    unsigned char uid;
+    int crc;                    // Sends a 2 byte crc, otherwise a 1 byte checksum
+    int inverted;               // Frequencies swapped, as seen when tuned to the other side of the carrier
+    double freq;                // Carrier offset of its own, from --freqs, on top of --offset
+    double watts;
+};
+
+struct interferer {
+    double end;                 // Seconds
+    double freq;
+    double amplitude;
+    double next_toggle;         // On/off keyed with random pulse widths
+    int on;
+};
+
+// Settings
+int sample_rate = DEFAULT_SAMPLE_RATE;
+int iq_rate = 0;                // Non zero for rtl_sdr IQ output
+double snr_db = 30;
+double deviation = DEFAULT_DEVIATION_HZ;
+double offset = 0;
+double freqs[MAX_TRANSMITTERS];
+int freq_count = 0;
+double interferers_per_second = 0;
+double interferer_db = 0;       // Interferer power relative to the transmitters
+double invert_fraction = 0;
+double gap_seconds = DEFAULT_GAP_MS / 1000.0;
+int frame_type = TYPE_MIXED;
+int transmitter_count = 3;
+
+// Baseband state
+int baseband_rate;
+double phase;
+double time_now;                // Seconds since the start of the stream
+struct interferer interference;
+double prev_i = 1, prev_q = 0;
+double post_sum;
+int post_phase;
+uint64_t rng_state = 1;
+
+// xorshift64*, so a seed gives the same capture whatever the libc
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_uniform(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rng_range(double low, double high) {
+    return low + (high - low) * rng_uniform();
+}
+
+static double rng_gauss(void) {
+    double u = rng_uniform();
+    if (u < 1e-300)
+        u = 1e-300;
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * rng_uniform());
+}
+
+uint16_t compute_crc(const unsigned char bytes[], int bytecount) {
+    uint16_t crc = 0;
+    int i, bit;
+    for (i = 0; i < bytecount; i++) {
+        crc ^= bytes[i] << 8;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// Writes one output sample (rtl_fm) or pair (IQ) from the next baseband sample
+static void output_baseband(double i, double q) {
+    if (iq_rate) {
+        int iq[2] = { (int) lround(i + 127.5), (int) lround(q + 127.5) };
+        unsigned char pair[2];
+        int k;
+        for (k = 0; k < 2; k++)
+            pair[k] = (iq[k] < 0) ? 0 : (iq[k] > 255) ? 255 : iq[k];
+        fwrite(pair, 1, 2, stdout);
+        return;
+    }
+    // Phase step is the angle of current * conj(previous)
+    double re = i * prev_i + q * prev_q;
+    double im = q * prev_i - i * prev_q;
+    prev_i = i;
+    prev_q = q;
+    post_sum += atan2(im, re) / M_PI * (1 << 14);
+    if (++post_phase < RTL_FM_OVERSAMPLE)
+        return;
+    long value = lround(post_sum / RTL_FM_OVERSAMPLE);
+    int16_t sample = (value < -32768) ? -32768 : (value > 32767) ? 32767 : value;
+    fwrite(&sample, sizeof(sample), 1, stdout);
+    post_sum = post_phase = 0;
+}
+
+// Emits seconds of baseband with the transmitter at freq (carrier off when amplitude is 0), plus interference and
+// noise
+static void emit(double seconds, double freq, double amplitude) {
+    double noise = IQ_AMPLITUDE / sqrt(2 * pow(10, snr_db / 10));
+    double end = time_now + seconds;
+    double step = 1.0 / baseband_rate;
+    double interferer_amplitude = IQ_AMPLITUDE * pow(10, interferer_db / 20);
+    while (time_now < end) {
+        double i = amplitude * cos(phase);
+        double q = amplitude * sin(phase);
+        phase = fmod(phase + 2 * M_PI * freq * step, 2 * M_PI);
+
+        struct interferer *intf = &interference;
+        if ((interferers_per_second > 0) && (time_now >= intf->end) &&
+                (rng_uniform() < interferers_per_second * step)) {
+            intf->end = time_now + rng_range(INTERFERER_MIN_SECONDS, INTERFERER_MAX_SECONDS);
+            intf->freq = rng_range(-baseband_rate / 4.0, baseband_rate / 4.0);
+            intf->amplitude = interferer_amplitude;
+            intf->next_toggle = time_now;
+            intf->on = 0;
+        }
+        if (time_now < intf->end) {
+            if (time_now >= intf->next_toggle) {
+                intf->on = !intf->on;
+                intf->next_toggle = time_now + rng_range(0.0002, 0.001);
+            }
+            if (intf->on) {
+                double angle = 2 * M_PI * intf->freq * time_now;
+                i += intf->amplitude * cos(angle);
+                q += intf->amplitude * sin(angle);
+            }
+        }
+        output_baseband(i + noise * rng_gauss(), q + noise * rng_gauss());
+        time_now += step;
+    }
+}
+
+// Frame bytes as EfergyRPI_log decodes them: bytes 4 and 5 are the current ADC reading and byte 6 its (signed)
+// power of 2 scale, for 240V.  Returns the byte count.
+static int build_frame(struct transmitter *tx, unsigned char bytes[]) {
+    int exponent = -3;
+    double adc;
+    int i;
+    tx->watts *= rng_range(0.9, 1.1);
+    if (tx->watts < 20)
+        tx->watts = 20;
+    if (tx->watts > 7000)
+        tx->watts = 7000;
+    while ((adc = tx->watts * 32768 / (240 * pow(2, exponent))) > 65535)
+        exponent++;
+    bytes[0] = 0x09;
+    bytes[1] = 0x7c;
+    bytes[2] = tx->uid;
+    bytes[3] = 0x10;
+    bytes[4] = (int) adc >> 8;
+    bytes[5] = (int) adc & 0xff;
+    bytes[6] = (unsigned char) (signed char) exponent;
+    if (!tx->crc) {
+        unsigned char checksum = 0;
+        for (i = 0; i < 7; i++)
+            checksum += bytes[i];
+        bytes[7] = checksum;
+        return FRAME_BYTES_CHECKSUM;
+    }
+    uint16_t crc = compute_crc(bytes, 7);
+    bytes[7] = crc >> 8;
+    bytes[8] = crc & 0xff;
+    return FRAME_BYTES_CRC;
+}
+
+// A 1 is a short low then a long high, a 0 the other way round
+static void send_frame(const struct transmitter *tx, const unsigned char bytes[], int bytecount) {
+    double high = (tx->inverted ? -deviation : deviation) + offset + tx->freq;
+    double low = (tx->inverted ? deviation : -deviation) + offset + tx->freq;
+    int i, bit;
+    emit(PREAMBLE_LOW_SECONDS, low, IQ_AMPLITUDE);
+    emit(PREAMBLE_HIGH_SECONDS, high, IQ_AMPLITUDE);
+    for (i = 0; i < bytecount; i++)
+        for (bit = 7; bit >= 0; bit--) {
+            double low_seconds = ((bytes[i] >> bit) & 1) ? SHORT_PULSE_SECONDS : BIT_SECONDS - SHORT_PULSE_SECONDS;
+            emit(low_seconds, low, IQ_AMPLITUDE);
+            emit(BIT_SECONDS - low_seconds, high, IQ_AMPLITUDE);
+        }
+    emit(TRAILER_SECONDS, low, IQ_AMPLITUDE);
+}
+
+static void usage(const char *name) {
+    printf("\nUsage: %s [options] > capture.raw\n", name);
+    printf("       -n frames          - Frames to send, default 100\n");
+    printf("       -e file            - Write the frames sent to file, one line of hex bytes each\n");
+    printf("       -s seed            - Random seed, default 1\n");
+    printf("       -t transmitters    - Number of transmitters taking turns, 1..%d, default 3\n", MAX_TRANSMITTERS);
+    printf("       --type type        - checksum, crc or mixed (alternating between transmitters), default mixed\n");
+    printf("       --snr dB           - Carrier to noise ratio over the sample rate, default 30\n");
+    printf("       --offset hz        - Carrier frequency offset, default 0\n");
+    printf("       --freqs hz,hz,...  - Carrier offsets of the transmitters in turn, say -300000,0,250000 with --iq\n");
+    printf("       --deviation hz     - FSK deviation, default %d\n", DEFAULT_DEVIATION_HZ);
+    printf("       --invert fraction  - Fraction of transmitters received with inverted polarity, default 0\n");
+    printf("       --interferers n    - Interfering bursts per second on random frequencies, default 0\n");
+    printf("       --interferer-db dB - Interferer power relative to the transmitters, default 0\n");
+    printf("       --gap ms           - Mean gap between frames, default %d\n", DEFAULT_GAP_MS);
+    printf("       --rate rate        - rtl_fm output rate (EfergyRPI_log --rate), default %d\n", DEFAULT_SAMPLE_RATE);
+    printf("       --iq [rate]        - Write 8 bit IQ at rate (default %d) instead of rtl_fm samples\n",
+           DEFAULT_IQ_SAMPLE_RATE);
+}
+
+int main(int argc, char **argv) {
+    struct transmitter transmitters[MAX_TRANSMITTERS];
+    const char *expected_name = NULL;
+    FILE *expected = NULL;
+    int frame_count = 100;
+    int arg, f, i;
+
+    for (arg = 1; arg < argc; arg++) {
+        const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+        if (strncmp(argv[arg], "-h", 2) == 0) {
+            usage(argv[0]);
+            exit(0);
+        } else if (strcmp(argv[arg], "--iq") == 0) {
+            iq_rate = DEFAULT_IQ_SAMPLE_RATE;
+            if (value && (value[0] != '-'))
+                iq_rate = strtol(argv[++arg], NULL, 0);
+            continue;
+        } else if (value == NULL) {
+            fprintf(stderr, "\nOption %s needs a value, see %s -h\n", argv[arg], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        arg++;
+        if (strcmp(argv[arg - 1], "-n") == 0)
+            frame_count = strtol(value, NULL, 0);
+        else if (strcmp(argv[arg - 1], "-e") == 0)
+            expected_name = value;
+        else if (strcmp(argv[arg - 1], "-s") == 0)
+            rng_state = strtoull(value, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+        else if (strcmp(argv[arg - 1], "-t") == 0)
+            transmitter_count = strtol(value, NULL, 0);
+        else if (strcmp(argv[arg - 1], "--type") == 0)
+            frame_type = (strcmp(value, "checksum") == 0) ? TYPE_CHECKSUM :
+                         (strcmp(value, "crc") == 0) ? TYPE_CRC :
+                         (strcmp(value, "mixed") == 0) ? TYPE_MIXED : -1;
+        else if (strcmp(argv[arg - 1], "--snr") == 0)
+            snr_db = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--offset") == 0)
+            offset = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--freqs") == 0) {
+            char *next = (char *) value;
+            for (freq_count = 0; (freq_count < MAX_TRANSMITTERS) && *next; freq_count++) {
+                freqs[freq_count] = strtod(next, &next);
+                if (*next == ',')
+                    next++;
+            }
+        } else if (strcmp(argv[arg - 1], "--deviation") == 0)
+            deviation = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--invert") == 0)
+            invert_fraction = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--interferers") == 0)
+            interferers_per_second = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--interferer-db") == 0)
+            interferer_db = strtod(value, NULL);
+        else if (strcmp(argv[arg - 1], "--gap") == 0)
+            gap_seconds = strtod(value, NULL) / 1000;
+        else if (strcmp(argv[arg - 1], "--rate") == 0)
+            sample_rate = strtol(value, NULL, 0);
+        else {
+            fprintf(stderr, "\nUnknown option %s, see %s -h\n", argv[arg - 1], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (frame_type < 0) {
+        fprintf(stderr, "\nFrame type (--type option) must be checksum, crc or mixed\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((transmitter_count < 1) || (transmitter_count > MAX_TRANSMITTERS)) {
+        fprintf(stderr, "\nTransmitter count (-t option) must be between 1 and %d\n", MAX_TRANSMITTERS);
+        exit(EXIT_FAILURE);
+    }
+    if ((sample_rate <= 0) || (iq_rate && (iq_rate % sample_rate != 0))) {
+        fprintf(stderr, "\nIQ sample rate (--iq option) must be a multiple of the sample rate (%d)\n", sample_rate);
+        exit(EXIT_FAILURE);
+    }
+    if (expected_name && ((expected = fopen(expected_name, "w")) == NULL)) {
+        fprintf(stderr, "\nFailed to open %s\n", expected_name);
+        exit(EXIT_FAILURE);
+    }
+    baseband_rate = iq_rate ? iq_rate : RTL_FM_OVERSAMPLE * sample_rate;
+
+    // Distinct uids, so frames can be told apart by transmitter
+    for (i = 0; i < transmitter_count; i++) {
+        struct transmitter *tx = &transmitters[i];
+        int j, duplicate;
+        do {
+            tx->uid = 1 + rng_next() % 255;
+            for (duplicate = 0, j = 0; j < i; j++)
+                duplicate |= transmitters[j].uid == tx->uid;
+        } while (duplicate);
+        tx->crc = (frame_type == TYPE_CRC) || ((frame_type == TYPE_MIXED) && (i & 1));
+        tx->inverted = rng_uniform() < invert_fraction;
+        tx->freq = freq_count ? freqs[i % freq_count] : 0;
+        tx->watts = rng_range(100, 3000);
+    }
+
+    for (f = 0; f < frame_count; f++) {
+        struct transmitter *tx = &transmitters[f % transmitter_count];
+        unsigned char bytes[FRAME_BYTES_CRC];
+        int bytecount = build_frame(tx, bytes);
+        emit(rng_range(gap_seconds / 2, gap_seconds * 3 / 2), 0, 0);
+        send_frame(tx, bytes, bytecount);
+        if (expected) {
+            for (i = 0; i < bytecount; i++)
+                fprintf(expected, (i == 0) ? "%02x" : " %02x", bytes[i]);
+            fprintf(expected, "\n");
+        }
+    }
+    emit(gap_seconds, 0, 0);
+
+    if (expected)
+        fclose(expected);
+    return 0;
+}